@@ -1,9 +1,14 @@
 #include "app.h"
 #include "../test/test.h"
 #include "b-tree-buf.h"
+#include "buffer-pool.h"
 #include "free-rrn-list.h"
 #include "io-buf.h"
-#include "queue.h"
+#include "record-cache.h"
+#include "secondary-index.h"
+#include "wal.h"
+
+#include <unistd.h>
 
 void print_ascii_art(void) {
   printf("                                         ,----,                      "
@@ -53,6 +58,35 @@ void get_id(int i, char *placa) {
   }
 }
 
+// lists the vehicles whose field lies between two values, equal ones for a
+// single value
+void search_field(app *a, data_record *d) {
+  int f = -1;
+  char lo[TAMANHO_MARCA], hi[TAMANHO_MARCA];
+  for (int i = 0; i < SECONDARY_FIELDS; i++)
+    printf("%d. %s\n", i, secondary_name(i));
+  printf("Field: ");
+  scanf("%d", &f);
+  if (f < 0 || f >= SECONDARY_FIELDS) {
+    puts("!!Unknown field");
+    return;
+  }
+  printf("From: ");
+  scanf("%19s", lo);
+  printf("To: ");
+  scanf("%19s", hi);
+
+  u32 rrns[RANGE_BATCH];
+  size_t n = secondary_search(a->b, a->data, f, lo, hi, rrns, RANGE_BATCH);
+  for (size_t i = 0; i < n && i < RANGE_BATCH; i++) {
+    if (load_data_record_into(a->data, rrns[i], d) == IO_SUCCESS)
+      print_data_record(d);
+  }
+  if (n > RANGE_BATCH)
+    printf("... and %zu more\n", n - RANGE_BATCH);
+  printf("%zu vehicles found\n", n);
+}
+
 void cli(app *a) {
   int choice = -1;
   page *p;
@@ -72,20 +106,27 @@ void cli(app *a) {
     printf("4. Remove\n");
     if (DEBUG)
       printf("5. Print root -- DEBUG\n");
+    printf("6. Search by marca, categoria, status or ano\n");
 
     printf("Enter your choice: ");
     scanf("%d", &choice);
 
     switch (choice) {
     case 0:
+      free(d);
       return;
     case 1:
       get_id(0, placa);
       p = b_search(a->b, placa, &pos);
       if (p) {
-        print_page(p);
-        d = load_data_record(a->data, p->keys[pos].data_register_rrn);
-        print_data_record(d);
+        print_page(a->b, p);
+        u32 rrn = page_key(p, pos).data_register_rrn;
+        const data_record *r = map_data_record(a->data, rrn);
+        if (r)
+          print_data_record(r);
+        else if (load_data_record_into(a->data, rrn, d) == IO_SUCCESS)
+          print_data_record(d);
+        unpin_page(a->b, p);
         break;
       }
       puts("Page not found!");
@@ -113,7 +154,7 @@ void cli(app *a) {
       printf("Status:\n");
       scanf("%s", d->status);
 
-      u16 rrn = get_free_rrn(a->ld);
+      u32 rrn = get_free_rrn(a->ld);
       if (rrn == 0 && ftell(a->data->fp) >=
                           (a->data->hr->header_size + a->data->hr->record_size))
         rrn = get_free_rrn(a->ld);
@@ -122,12 +163,15 @@ void cli(app *a) {
       break;
     case 4:
       get_id(0, placa);
-      b_remove(a->b, a->data, placa);
+      b_remove(a->b, a->data, a->ld, placa);
       break;
     case 5:
 
       if (DEBUG)
-        print_page(a->b->root);
+        print_page(a->b, a->b->root);
+      break;
+    case 6:
+      search_field(a, d);
       break;
     default:
       printf("Invalid choice.\n");
@@ -163,7 +207,6 @@ void clear_app(app *app) {
     clear_io_buf(app->data);
     app->data = NULL;
   }
-  clear_all_pages();
   if (app->b) {
     clear_tree_buf(app->b);
     app->b = NULL;
@@ -180,20 +223,78 @@ void clear_app(app *app) {
     puts("!! Error while clearing app");
 }
 
+// syncs b and closes its log, then serves its pages from a mapping of the
+// file instead of the pool
+static btree_status map_unlogged(b_tree_buf *b) {
+  btree_status status = b_flush(b);
+  if (status != BTREE_SUCCESS)
+    return status;
+  clear_wal(b->wal);
+  b->wal = NULL;
+  set_root(b, NULL);
+
+  b->io->use_mmap = true;
+  if (map_file(b->io) != IO_SUCCESS)
+    return BTREE_ERROR_IO;
+  page *root = load_page(b, b->io->br->root_rrn);
+  set_root(b, root);
+  unpin_page(b, root);
+  return BTREE_SUCCESS;
+}
+
 int main(int argc, char **argv) {
   int n = 99;
 
   app *a;
   char *index_file = malloc(MAX_ADDRESS);
   char *data_file = malloc(MAX_ADDRESS);
-  char converted_char;
+  int opt;
 
   a = alloc_app();
 
-  strcpy(index_file, "public/btree-");
-  converted_char = ORDER + '0';
-  index_file[strlen(index_file)] = converted_char;
-  strcat(index_file, ".idx");
+  // order and page size only apply when the index is created
+  u32 order = DEFAULT_ORDER;
+  size_t cache_bytes = RECORD_CACHE_BYTES;
+  while ((opt = getopt(argc, argv, "mdp:c:o:s:")) != -1) {
+    switch (opt) {
+    case 'm':
+      a->b->io->use_mmap = true;
+      break;
+    case 'd':
+      a->data->use_mmap = true;
+      break;
+    case 'p':
+      if (set_pool_capacity(a->b, (u32)atoi(optarg)) != BTREE_SUCCESS)
+        return 1;
+      break;
+    case 'c':
+      cache_bytes = (size_t)atol(optarg);
+      break;
+    case 'o':
+      order = (u32)atoi(optarg);
+      break;
+    case 's':
+      order = page_order((u32)atoi(optarg));
+      break;
+    default:
+      printf("Usage: %s [-m] [-d] [-p pool_frames] [-c cache_bytes] "
+             "[-o order | -s page_bytes]\n",
+             argv[0]);
+      return 1;
+    }
+  }
+
+  if (!valid_order(order)) {
+    printf("!!Error: order must be between %d and %d\n", MIN_ORDER, MAX_ORDER);
+    return 1;
+  }
+  a->b->io->br->order = order;
+
+  // a mapped index is only mapped once its log is replayed and closed
+  bool mapped = a->b->io->use_mmap;
+  a->b->io->use_mmap = false;
+
+  strcpy(index_file, "public/btree.idx");
   strcpy(data_file, "public/veiculos.dat");
 
   create_index_file(a->b->io, index_file);
@@ -201,6 +302,11 @@ int main(int argc, char **argv) {
 
   load_file(a->b->io, index_file, "index");
   load_file(a->data, data_file, "data");
+  if (!a->b->io->fp)
+    return 1;
+  if (cache_bytes != RECORD_CACHE_BYTES &&
+      set_cache_budget(a->data, cache_bytes) != IO_SUCCESS)
+    return 1;
 
   free(data_file);
   free(index_file);
@@ -208,13 +314,18 @@ int main(int argc, char **argv) {
   load_list(a->b->i, a->b->io->br->free_rrn_address);
   load_list(a->ld, a->data->hr->free_rrn_address);
 
+  // whatever a crash left in the log is redone before the root is read
+  if (open_wal(a->b) != BTREE_SUCCESS)
+    return 1;
+
   page *temp = load_page(a->b, a->b->io->br->root_rrn);
-  a->b->root = temp;
-  if (ftell(a->b->io->fp) <= a->b->io->br->header_size) {
+  set_root(a->b, temp);
+  unpin_page(a->b, temp);
+  if (!a->b->root) {
     insert_list(a->b->i, 0);
     build_tree(a->b, a->data, n);
     if (DEBUG) {
-      print_queue(a->b->q);
+      print_pool(a->b);
       test_tree(a->b, a->data, n);
     }
 
@@ -223,10 +334,27 @@ int main(int argc, char **argv) {
     write_index_header(a->b->io);
   }
 
+  // every field is indexed before the first change, so none falls behind
+  for (int f = 0; f < SECONDARY_FIELDS; f++) {
+    if (open_secondary(a->b, a->data, f) != BTREE_SUCCESS)
+      return 1;
+  }
+
+  // -m runs without a log, as the kernel may write mapped pages back at any
+  // time; the logs were replayed above, but later changes are not redone
+  // after a crash
+  if (mapped) {
+    for (int f = 0; f < SECONDARY_FIELDS; f++) {
+      if (map_unlogged(a->b->secondary[f]) != BTREE_SUCCESS)
+        return 1;
+    }
+    if (map_unlogged(a->b) != BTREE_SUCCESS)
+      return 1;
+    puts("Index mapped without a log: a crash may lose or tear changes");
+  }
+
   cli(a);
 
-  if (DEBUG)
-    test_queue_search();
   clear_app(a);
   return 0;
 }
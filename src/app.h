@@ -3,6 +3,8 @@
 
 #include "defines.h"
 
+void search_field(app *a, data_record *d);
+
 void cli(app *a);
 
 app *alloc_app(void);
@@ -1,10 +1,15 @@
 #include "b-tree-buf.h"
+#include "buffer-pool.h"
 #include "free-rrn-list.h"
 #include "io-buf.h"
-#include "queue.h"
+#include "secondary-index.h"
+#include "wal.h"
 
-page **g_allocated;
-u16 g_n = 0;
+#include <endian.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 b_tree_buf *alloc_tree_buf(void) {
   b_tree_buf *b = malloc(sizeof(b_tree_buf));
@@ -14,6 +19,11 @@ b_tree_buf *alloc_tree_buf(void) {
   }
 
   b->root = NULL;
+  b->wal = NULL;
+  b->snapshots = NULL;
+  b->scratch = NULL;
+  memset(b->secondary, 0, sizeof(b->secondary));
+  b->unsettled = 0;
   b->io = alloc_io_buf();
   if (!b->io) {
     free(b);
@@ -21,22 +31,28 @@ b_tree_buf *alloc_tree_buf(void) {
     return NULL;
   }
 
-  b->q = alloc_queue();
-  if (!b->q) {
+  b->pool = alloc_buffer_pool(P);
+  if (!b->pool) {
     free(b->io);
     free(b);
-    puts("!!Could not allocate queue");
+    puts("!!Could not allocate buffer pool");
     return NULL;
   }
 
   b->i = alloc_ilist();
   if (!b->i) {
-    free(b->q);
+    clear_buffer_pool(b->pool);
     free(b->io);
     free(b);
     puts("!!Could not allocate ilist");
     return NULL;
   }
+  pthread_rwlock_init(&b->latch, NULL);
+  pthread_mutex_init(&b->root_lock, NULL);
+  pthread_mutex_init(&b->snapshot_lock, NULL);
+  pthread_mutex_init(&b->scratch_lock, NULL);
+  for (int l = 0; l < PAGE_LATCHES; l++)
+    pthread_rwlock_init(&b->page_latches[l], NULL);
 
   if (DEBUG)
     puts("@Allocated b_tree_buf_BUFFER");
@@ -45,14 +61,29 @@ b_tree_buf *alloc_tree_buf(void) {
 
 void clear_tree_buf(b_tree_buf *b) {
   if (b) {
+    while (b->snapshots)
+      bt_snapshot_close(b->snapshots);
+    for (int f = 0; f < SECONDARY_FIELDS; f++)
+      clear_tree_buf(b->secondary[f]);
+    memset(b->secondary, 0, sizeof(b->secondary));
+    if (b->io && b->io->fp)
+      b_flush(b);
+    clear_wal(b->wal);
+    b->wal = NULL;
+    set_root(b, NULL);
     clear_ilist(b->i);
-    clear_queue(b->q);
+    clear_buffer_pool(b->pool);
     clear_io_buf(b->io);
-    if (b->root) {
-      page *q_page = queue_search(b->q, b->root->rrn);
-      if (!q_page) {
-        b->root = NULL;
-      }
+    pthread_rwlock_destroy(&b->latch);
+    pthread_mutex_destroy(&b->root_lock);
+    pthread_mutex_destroy(&b->snapshot_lock);
+    pthread_mutex_destroy(&b->scratch_lock);
+    for (int l = 0; l < PAGE_LATCHES; l++)
+      pthread_rwlock_destroy(&b->page_latches[l]);
+    while (b->scratch) {
+      scratch *next = b->scratch->next;
+      free(b->scratch);
+      b->scratch = next;
     }
     free(b);
     b = NULL;
@@ -67,11 +98,233 @@ void populate_index_header(index_header_record *bh, const char *file_name) {
     return;
   }
 
-  bh->page_size = sizeof(page);
+  if (!valid_order(bh->order))
+    bh->order = DEFAULT_ORDER;
+  bh->page_size = order_page_size(bh->order);
   bh->root_rrn = 0;
   strcpy(bh->free_rrn_address, file_name);
   bh->free_rrn_address[strlen(file_name) + 1] = '\0';
-  bh->header_size = (sizeof(u16) * 3) + strlen(file_name) + 1;
+  bh->header_size = index_header_size(file_name);
+}
+
+bool valid_order(u32 order) { return order >= MIN_ORDER && order <= MAX_ORDER; }
+
+u32 order_page_size(u32 order) {
+  return sizeof(page) + sizeof(key) * (order - 1) + sizeof(u32) * order;
+}
+
+// largest order whose pages fit in page_size bytes
+u32 page_order(u32 page_size) {
+  if (page_size < order_page_size(1))
+    return 0;
+  return (page_size - sizeof(page) + sizeof(key)) / (sizeof(key) + sizeof(u32));
+}
+
+// the header is padded so pages start 8-byte aligned in a mapping
+u16 index_header_size(const char *free_rrn_address) {
+  size_t size = INDEX_FIXED_HEADER + strlen(free_rrn_address) + 1;
+  return (size + 7) & ~(size_t)7;
+}
+
+// child rrns come right after the header
+u32 *page_children(b_tree_buf *b, page *p) {
+  (void)b;
+  return (u32 *)p->data;
+}
+
+// most keys a page can hold: all but one differ in at least one byte
+int page_capacity(b_tree_buf *b) {
+  int slots = (b->io->br->page_size - sizeof(page)) / (1 + sizeof(u32));
+  return slots > 0 ? slots + 1 : 1;
+}
+
+// bytes a page takes with n keys of width id bytes past a shared prefix;
+// separators on internal pages (those with children) have no data rrn
+static u32 packed_size(int n, int c, int prefix, int width) {
+  u32 slot = width + (c ? 0 : sizeof(u32));
+  return sizeof(page) + sizeof(u32) * c + prefix + n * slot;
+}
+
+// id bytes up to the last non-zero one
+static int id_len(u64 bits) {
+  return bits ? TAMANHO_PLACA - __builtin_ctzll(bits) / 8 : 0;
+}
+
+// leading bytes two ids share, where len is the longest of them
+static int shared_bytes(u64 a, u64 b, int len) {
+  return a == b ? len : __builtin_clzll(a ^ b) / 8;
+}
+
+static const u8 *page_prefix(const page *p) {
+  return p->data + sizeof(u32) * p->child_num;
+}
+
+static u32 slot_size(const page *p) {
+  return p->width + (p->leaf ? sizeof(u32) : 0);
+}
+
+static u8 *page_slot(const page *p, int i) {
+  return (u8 *)page_prefix(p) + p->prefix + i * slot_size(p);
+}
+
+static u64 prefix_bits(const page *p) {
+  const u8 *s = page_prefix(p);
+  u64 v = 0;
+  for (int j = 0; j < p->prefix; j++)
+    v = v << 8 | s[j];
+  return p->prefix ? v << 8 * (TAMANHO_PLACA - p->prefix) : 0;
+}
+
+// the slot's bytes in place, without the prefix
+static u64 slot_bits(const page *p, int i) {
+  const u8 *s = page_slot(p, i);
+  u64 v = 0;
+  for (int j = 0; j < p->width; j++)
+    v = v << 8 | s[j];
+  return p->width ? v << 8 * (TAMANHO_PLACA - p->prefix - p->width) : 0;
+}
+
+u64 page_key_bits(const page *p, int i) {
+  u64 v = prefix_bits(p) | slot_bits(p, i);
+  return p->plates ? plate_bits(v >> PLATE_CODE_SHIFT) : v;
+}
+
+key page_key(const page *p, int i) {
+  key k;
+  u64 be = htobe64(page_key_bits(p, i));
+  memcpy(k.id, &be, sizeof(u64));
+  k.data_register_rrn = NULL_RRN;
+  if (p->leaf)
+    memcpy(&k.data_register_rrn, page_slot(p, i) + p->width, sizeof(u32));
+  return k;
+}
+
+void unpack_keys(const page *p, key *keys) {
+  for (int i = 0; i < p->keys_num; i++)
+    keys[i] = page_key(p, i);
+}
+
+// what a page stores for k: its plate code on pages of plates, its id bytes
+// otherwise, left aligned either way
+static u64 key_value(const key *k, bool plates) {
+  u64 code;
+  if (plates && plate_code(key_bits(k), &code))
+    return code << PLATE_CODE_SHIFT;
+  return key_bits(k);
+}
+
+static bool all_plates(const key *keys, int n) {
+  u64 code;
+  for (int i = 0; i < n; i++) {
+    if (!plate_code(key_bits(&keys[i]), &code))
+      return false;
+  }
+  return n > 0;
+}
+
+static void write_slot(const page *p, u8 *s, const key *k) {
+  u64 be = htobe64(key_value(k, p->plates));
+  memcpy(s, (u8 *)&be + p->prefix, p->width);
+  if (p->leaf)
+    memcpy(s + p->width, &k->data_register_rrn, sizeof(u32));
+}
+
+// prefix and width of n sorted keys stored as plate codes or id bytes
+static void page_shape(const key *keys, int n, bool plates, int *prefix,
+                       int *width) {
+  int len = 0;
+  for (int i = 0; i < n; i++) {
+    int l = id_len(key_value(&keys[i], plates));
+    len = l > len ? l : len;
+  }
+  *prefix = n ? shared_bytes(key_value(&keys[0], plates),
+                             key_value(&keys[n - 1], plates), len)
+              : 0;
+  *width = len - *prefix;
+}
+
+// whether n sorted keys and c children fit on one page
+bool keys_fit(b_tree_buf *b, const key *keys, int n, int c) {
+  int prefix, width;
+  page_shape(keys, n, all_plates(keys, n), &prefix, &width);
+  return packed_size(n, c, prefix, width) <= b->io->br->page_size;
+}
+
+// rewrites the keys and children of p, which may be given its own children;
+// false when they do not fit, with p left as it was
+bool pack_page(b_tree_buf *b, page *p, const key *keys, int n,
+               const u32 *children, int c) {
+  int prefix, width;
+  bool plates = all_plates(keys, n);
+  page_shape(keys, n, plates, &prefix, &width);
+  u32 size = packed_size(n, c, prefix, width);
+  if (size > b->io->br->page_size)
+    return false;
+
+  if (c > 0)
+    memmove(page_children(b, p), children, sizeof(u32) * c);
+  p->child_num = c;
+  p->keys_num = n;
+  p->prefix = prefix;
+  p->width = width;
+  p->plates = plates;
+  if (n > 0) {
+    u64 be = htobe64(key_value(&keys[0], plates));
+    memcpy((u8 *)page_prefix(p), &be, prefix);
+  }
+  for (int i = 0; i < n; i++)
+    write_slot(p, page_slot(p, i), &keys[i]);
+  memset((u8 *)p + size, 0, b->io->br->page_size - size);
+  return true;
+}
+
+// a page runs short below the keys its order asks for or below half its
+// bytes, so packed pages merge back as they empty; drop counts keys about to
+// leave it
+static bool page_short(b_tree_buf *b, const page *p, int drop) {
+  int n = p->keys_num - drop;
+  u32 used = packed_size(n, p->child_num, p->prefix, p->width) - sizeof(page);
+  return n < (b->io->br->order - 1) / 2 ||
+         2 * used < b->io->br->page_size - sizeof(page);
+}
+
+// k goes into p without touching the other slots: it is stored like the
+// others, starts with the prefix, ends within the width and one more slot
+// (and child) has room
+static bool fits_slot(b_tree_buf *b, const page *p, const key *k, int c) {
+  u64 code;
+  if (p->keys_num < 2 || (p->plates && !plate_code(key_bits(k), &code)))
+    return false;
+  u64 bits = key_value(k, p->plates);
+  if (p->prefix &&
+      (bits ^ prefix_bits(p)) >> 8 * (TAMANHO_PLACA - p->prefix) != 0)
+    return false;
+  return id_len(bits) <= p->prefix + p->width &&
+         packed_size(p->keys_num + 1, p->child_num + c, p->prefix,
+                     p->width) <= b->io->br->page_size;
+}
+
+// puts k at pos and child right after it, shifting the slots behind them
+static void insert_slot(b_tree_buf *b, page *p, const key *k, int pos,
+                        u32 child) {
+  u32 size = slot_size(p);
+  u8 *start = (u8 *)page_prefix(p);
+  if (child != NULL_RRN) {
+    u32 *children = page_children(b, p);
+    memmove(start + sizeof(u32), start, p->prefix + p->keys_num * size);
+    memmove(children + pos + 2, children + pos + 1,
+            sizeof(u32) * (p->child_num - pos - 1));
+    children[pos + 1] = child;
+    p->child_num++;
+  }
+  u8 *s = page_slot(p, pos);
+  memmove(s + size, s, (p->keys_num - pos) * size);
+  write_slot(p, s, k);
+  p->keys_num++;
+}
+
+u64 page_offset(b_tree_buf *b, u32 rrn) {
+  return (u64)b->io->br->header_size + (u64)b->io->br->page_size * rrn;
 }
 
 void build_tree(b_tree_buf *b, io_buf *data, int n) {
@@ -85,107 +338,797 @@ void build_tree(b_tree_buf *b, io_buf *data, int n) {
       puts("@Loaded rrn list");
     }
   }
-  data_record *d;
+
+  if (!b->root) {
+    btree_status status = b_bulk_load(b, data, n, BULK_FILL_PERCENT);
+    if (status != BTREE_SUCCESS) {
+      printf("!!Failed to bulk load tree, error: %d\n", status);
+      exit(0);
+    }
+    return;
+  }
+
+  data_record d;
   for (int i = 0; i < n; i++) {
-    d = load_data_record(data, i);
-    if (!d) {
+    if (load_data_record_into(data, i, &d) != IO_SUCCESS) {
       printf("!!Failed to load record %d\n", i);
       continue;
     }
     if (DEBUG)
-      print_data_record(d);
+      print_data_record(&d);
 
-    btree_status status = b_insert(b, data, d, i);
+    btree_status status = b_insert(b, data, &d, i);
     if ((status != BTREE_SUCCESS) && (status != BTREE_INSERTED_IN_PAGE)) {
-      printf("!!Failed to insert record %d, error: %d\n", i - 1, status);
+      printf("!!Failed to insert record %d, error: %d\n", i, status);
       exit(0);
     }
   }
-  if (d)
-    free(d);
 
   if (DEBUG) {
     puts("@Built tree");
   }
 }
 
-page *load_page(b_tree_buf *b, u16 rrn) {
+static int compare_keys(const void *a, const void *b) {
+  return compare_key((const key *)a, (const key *)b);
+}
+
+// shortest id above lo and not above hi: the bytes of hi up to the first one
+// that differs from lo, or of its plate code. Promoted in place of hi, it
+// keeps upper pages narrow
+key separator(const key *lo, const key *hi) {
+  // two plates are cut in their codes, so pages of plates keep their codec
+  bool plates = all_plates(lo, 1) && all_plates(hi, 1);
+  u64 l = key_value(lo, plates), h = key_value(hi, plates);
+  int keep = shared_bytes(l, h, TAMANHO_PLACA) + 1;
+  u64 bits = keep < TAMANHO_PLACA ? h & ~(~(u64)0 >> 8 * keep) : h;
+  if (plates)
+    bits = plate_bits(bits >> PLATE_CODE_SHIFT);
+
+  key k;
+  u64 be = htobe64(bits);
+  memcpy(k.id, &be, sizeof(u64));
+  k.data_register_rrn = NULL_RRN;
+  return k;
+}
+
+// entries (keys of a leaf, children of an internal page) that go on the next
+// page of a level: as many as fit in fill_percent of the page, but not fewer
+// than a page must hold nor so many that the page after it falls short. On
+// internal pages keys[i] is the separator after child i
+static int bulk_count(b_tree_buf *b, const key *keys, int left, bool leaf,
+                      u8 fill_percent) {
+  int order = b->io->br->order;
+  int min = leaf ? (order - 1) / 2 : (order + 1) / 2;
+  int max = leaf ? order - 1 : order;
+  u32 budget = sizeof(page) +
+               (b->io->br->page_size - sizeof(page)) * fill_percent / 100;
+
+  // the page holds plate codes until it takes a key that is no plate
+  bool plates = leaf ? all_plates(keys, 1) : true;
+  int count = 1, len = leaf ? id_len(key_value(&keys[0], plates)) : 0;
+  while (count < left) {
+    // keys stored once the page takes one more entry
+    int n = leaf ? count + 1 : count;
+    if (plates && !all_plates(keys + n - 1, 1)) {
+      plates = false;
+      for (int i = len = 0; i < n - 1; i++)
+        len = id_len(key_bits(&keys[i])) > len ? id_len(key_bits(&keys[i]))
+                                                : len;
+    }
+    u64 last = key_value(&keys[n - 1], plates);
+    len = id_len(last) > len ? id_len(last) : len;
+    int prefix = shared_bytes(key_value(&keys[0], plates), last, len);
+    if (packed_size(n, leaf ? 0 : count + 1, prefix, len - prefix) > budget)
+      break;
+    count++;
+  }
+
+  // max entries fit whatever their keys
+  if (count < min)
+    count = min;
+  if (count >= left)
+    return left;
+  if (left - count < min)
+    count = left <= max ? left : left - min;
+  return count;
+}
+
+static bool bulk_ready(b_tree_buf *b) {
+  if (b->root) {
+    puts("!!Bulk load needs an empty index");
+    return false;
+  }
+  // pages are written from rrn 0 on, over any a snapshot still reads
+  if (b->snapshots) {
+    puts("!!Bulk load cannot run while a snapshot is open");
+    return false;
+  }
+  return true;
+}
+
+// writes m sorted, distinct keys as a new tree from rrn 0 on
+static btree_status bulk_build(b_tree_buf *b, const key *keys, int m,
+                               u8 fill_percent) {
+  if (!bulk_ready(b))
+    return BTREE_ERROR_INVALID_PAGE;
+  if (m == 0)
+    return BTREE_SUCCESS;
+
+  // separator (lowest bound) and rrn of every node on the level being built
+  key *level_keys = malloc(sizeof(key) * m);
+  u32 *level_rrns = malloc(sizeof(u32) * m);
+  page *p = alloc_page(b);
+  if (!level_keys || !level_rrns || !p) {
+    free(level_keys);
+    free(level_rrns);
+    free(p);
+    return BTREE_ERROR_MEMORY;
+  }
+
+  btree_status status = BTREE_SUCCESS;
+  u32 next_rrn = 0;
+  if (fseek(b->io->fp, b->io->br->header_size, SEEK_SET) != 0)
+    status = BTREE_ERROR_IO;
+
+  int nodes = 0, taken = 0;
+  while (taken < m && status == BTREE_SUCCESS) {
+    int count = bulk_count(b, keys + taken, m - taken, true, fill_percent);
+    init_page(b, p);
+    p->rrn = next_rrn++;
+    p->next_leaf = taken + count < m ? next_rrn : NULL_RRN;
+    if (taken + count < m)
+      p->high = separator(&keys[taken + count - 1], &keys[taken + count]);
+    if (!pack_page(b, p, keys + taken, count, NULL, 0))
+      status = BTREE_ERROR_PAGE_FULL;
+
+    level_keys[nodes] = taken ? separator(&keys[taken - 1], &keys[taken])
+                              : keys[taken];
+    level_rrns[nodes++] = p->rrn;
+    taken += count;
+
+    if (status == BTREE_SUCCESS &&
+        fwrite(p, b->io->br->page_size, 1, b->io->fp) != 1)
+      status = BTREE_ERROR_IO;
+  }
+
+  u8 level = 0;
+  while (nodes > 1 && status == BTREE_SUCCESS) {
+    int parents = 0;
+    taken = 0;
+    level++;
+    while (taken < nodes && status == BTREE_SUCCESS) {
+      int count = bulk_count(b, level_keys + taken + 1, nodes - taken, false,
+                             fill_percent);
+      init_page(b, p);
+      p->rrn = next_rrn++;
+      p->leaf = false;
+      p->level = level;
+      p->next_leaf = taken + count < nodes ? next_rrn : NULL_RRN;
+      if (taken + count < nodes)
+        p->high = level_keys[taken + count];
+      if (!pack_page(b, p, level_keys + taken + 1, count - 1,
+                     level_rrns + taken, count))
+        status = BTREE_ERROR_PAGE_FULL;
+
+      level_keys[parents] = level_keys[taken];
+      level_rrns[parents++] = p->rrn;
+      taken += count;
+
+      if (status == BTREE_SUCCESS &&
+          fwrite(p, b->io->br->page_size, 1, b->io->fp) != 1)
+        status = BTREE_ERROR_IO;
+    }
+    nodes = parents;
+  }
+
+  fflush(b->io->fp);
+  free(p);
+  free(level_keys);
+
+  if (status != BTREE_SUCCESS) {
+    free(level_rrns);
+    puts("!!Error while writing bulk loaded pages");
+    return status;
+  }
+
+  u32 root_rrn = level_rrns[0];
+  free(level_rrns);
+
+  reset_list(b->i, next_rrn);
+  status = write_root_rrn(b, root_rrn);
+  if (status != BTREE_SUCCESS)
+    return status;
+
+  page *root = load_page(b, root_rrn);
+  if (!root)
+    return BTREE_ERROR_IO;
+  set_root(b, root);
+  unpin_page(b, root);
+
+  if (DEBUG)
+    printf("@Bulk loaded %d keys into %u pages\n", m, next_rrn);
+
+  return BTREE_SUCCESS;
+}
+
+static btree_status bulk_load(b_tree_buf *b, io_buf *data, int n,
+                              u8 fill_percent) {
+  if (!bulk_ready(b))
+    return BTREE_ERROR_INVALID_PAGE;
+
+  key *keys = malloc(sizeof(key) * (n > 0 ? n : 1));
+  if (!keys)
+    return BTREE_ERROR_MEMORY;
+
+  // data records are read in one sequential pass, as memory reads when the
+  // data file is mapped
+  int m = 0;
+  data_record d;
+  if (fseek(data->fp, data->hr->header_size, SEEK_SET) != 0) {
+    free(keys);
+    return BTREE_ERROR_IO;
+  }
+  for (int i = 0; i < n; i++) {
+    if (data->map ? load_data_record_into(data, i, &d) != IO_SUCCESS
+                  : fread(&d, sizeof(data_record), 1, data->fp) != 1) {
+      printf("!!Failed to load record %d\n", i);
+      break;
+    }
+    if (d.placa[0] == '*' || d.placa[0] == '\0')
+      continue;
+    populate_key(&keys[m++], &d, i);
+  }
+
+  qsort(keys, m, sizeof(key), compare_keys);
+
+  int unique = 0;
+  for (int i = 0; i < m; i++) {
+    if (unique > 0 && compare_key(&keys[unique - 1], &keys[i]) == 0) {
+      printf("!!Duplicate key %s skipped on bulk load\n", keys[i].id);
+      continue;
+    }
+    keys[unique++] = keys[i];
+  }
+
+  btree_status status = bulk_build(b, keys, unique, fill_percent);
+  free(keys);
+  return status;
+}
+
+static int store_root_rrn(b_tree_buf *b) {
+  fseek(b->io->fp, sizeof(u32), SEEK_SET);
+  size_t flag = fwrite(&b->io->br->root_rrn, sizeof(u32), 1, b->io->fp);
+  if (flag != 1) {
+    puts("!!Error: Could not update root rrn");
+    exit(-1);
+  }
+
+  fflush(b->io->fp);
+
+  return BTREE_SUCCESS;
+}
+
+// a change to b is unsettled from before it is logged until the secondary
+// indexes follow it; a crash in between leaves b's log with something to
+// redo, which open_secondary takes as the cue to rebuild them
+static void unsettle(b_tree_buf *b) {
+  __atomic_add_fetch(&b->unsettled, 1, __ATOMIC_ACQ_REL);
+}
+
+static void settle(b_tree_buf *b) {
+  __atomic_sub_fetch(&b->unsettled, 1, __ATOMIC_ACQ_REL);
+}
+
+// once the pages, the root and the free list are synced the log holds
+// nothing the files lack, so it starts over
+static btree_status checkpoint(b_tree_buf *b) {
+  if (store_root_rrn(b) != BTREE_SUCCESS ||
+      fdatasync(fileno(b->io->fp)) != 0 ||
+      (b->i->io->fp && fsync(fileno(b->i->io->fp)) != 0)) {
+    puts("!!Error: could not sync the index for a checkpoint");
+    return BTREE_ERROR_IO;
+  }
+  btree_status status = wal_truncate(b->wal, b->io->br->page_size);
+
+  // the list just synced counts snapshot copies as used; the log frees them
+  // again should a crash end the snapshots
+  bool logged = false;
+  for (bt_snapshot *s = b->snapshots; s && status >= 0; s = s->next) {
+    for (u32 h = 0; h < s->slots && status >= 0; h++) {
+      if (s->rrns[h] != NULL_RRN && s->copies[h] != NULL_RRN) {
+        status = wal_append(b->wal, WAL_SHADOW, s->copies[h], NULL, 0);
+        logged = true;
+      }
+    }
+  }
+
+  // an unsettled change leaves an empty group behind, so that a crash
+  // before it settles still finds the log with something to redo
+  if (status >= 0 && __atomic_load_n(&b->unsettled, __ATOMIC_ACQUIRE) > 0) {
+    status = wal_append(b->wal, WAL_BEGIN, NULL_RRN, NULL, 0);
+    if (status == BTREE_SUCCESS)
+      status = wal_append(b->wal, WAL_END, NULL_RRN, NULL, 0);
+    logged = true;
+  }
+  if (logged && status >= 0)
+    status = wal_commit(b->wal);
+  return status;
+}
+
+static btree_status flush_index(b_tree_buf *b) {
+  btree_status status = flush_pool(b);
+  flush_list(b->i);
+  if (b->io->map && msync(b->io->map, mapped_size(b->io), MS_ASYNC) != 0)
+    status = BTREE_ERROR_IO;
+  if (fflush(b->io->fp) != 0) {
+    puts("!!Error: could not flush index file");
+    return BTREE_ERROR_IO;
+  }
+  if (status == BTREE_SUCCESS && b->wal)
+    status = checkpoint(b);
+  return status;
+}
+
+btree_status b_bulk_load(b_tree_buf *b, io_buf *data, int n, u8 fill_percent) {
+  if (!b || !b->io || !b->io->fp || !data || !data->fp || n < 0)
+    return BTREE_ERROR_INVALID_PAGE;
+
+  pthread_rwlock_wrlock(&b->latch);
+  btree_status status = bulk_load(b, data, n, fill_percent);
+
+  // bulk loaded pages bypass the log, so they are synced right away
+  if (status == BTREE_SUCCESS && b->wal)
+    status = flush_index(b);
+  pthread_rwlock_unlock(&b->latch);
+
+  // secondary indexes opened on the empty tree are loaded from it
+  for (int f = 0; f < SECONDARY_FIELDS && status == BTREE_SUCCESS; f++) {
+    if (b->secondary[f] && !b->secondary[f]->root)
+      status = build_secondary(b, data, f);
+  }
+  return status;
+}
+
+// keys must be sorted and distinct, as B-PLUS-TREE_migrate gathers them
+btree_status b_bulk_build(b_tree_buf *b, const key *keys, int n,
+                          u8 fill_percent) {
+  if (!b || !b->io || !b->io->fp || (n > 0 && !keys) || n < 0)
+    return BTREE_ERROR_INVALID_PAGE;
+
+  pthread_rwlock_wrlock(&b->latch);
+  btree_status status = bulk_build(b, keys, n, fill_percent);
+  if (status == BTREE_SUCCESS && b->wal)
+    status = flush_index(b);
+  pthread_rwlock_unlock(&b->latch);
+  return status;
+}
+
+// page at rrn inside the index mapping; with grow the file is extended to
+// hold it, otherwise the mapping only catches up with the current file size
+static page *mapped_page(b_tree_buf *b, u32 rrn, bool grow) {
+  size_t end = page_offset(b, rrn) + b->io->br->page_size;
+
+  // readers may race to catch the mapping up, the mapping lock orders them
+  if (end > mapped_size(b->io)) {
+    pthread_mutex_lock(&b->io->map_lock);
+    int status = end > mapped_size(b->io) ? remap_file(b->io, grow ? end : 0)
+                                          : IO_SUCCESS;
+    pthread_mutex_unlock(&b->io->map_lock);
+    if (status != IO_SUCCESS)
+      return NULL;
+  }
+  if (end > mapped_size(b->io))
+    return NULL;
+
+  return (page *)(b->io->map + end - b->io->br->page_size);
+}
+
+// asks the kernel to start reading count pages from rrn in the background
+void prefetch_pages(b_tree_buf *b, u32 rrn, u32 count) {
+  if (!b || !b->io || !b->io->fp || rrn == NULL_RRN || count == 0)
+    return;
+
+  u64 offset = page_offset(b, rrn);
+  u64 len = (u64)count * b->io->br->page_size;
+  if (!b->io->map) {
+    posix_fadvise(fileno(b->io->fp), offset, len, POSIX_FADV_WILLNEED);
+    return;
+  }
+
+  size_t size = mapped_size(b->io);
+  if (offset >= size)
+    return;
+  if (offset + len > size)
+    len = size - offset;
+  u64 skew = offset % sysconf(_SC_PAGESIZE);
+  madvise(b->io->map + offset - skew, len + skew, MADV_WILLNEED);
+}
+
+page *load_page(b_tree_buf *b, u32 rrn) {
   if (!b || !b->io) {
     puts("!!Error: invalid parameters");
     return NULL;
   }
 
-  page *page = queue_search(b->q, rrn);
-  if (page) {
-    if (DEBUG)
-      puts("@Page found in queue");
+  if (b->io->map)
+    return mapped_page(b, rrn, false);
+
+  bool claimed;
+  page *page = pool_claim(b, rrn, &claimed);
+  if (!page || !claimed) {
+    if (page && DEBUG)
+      puts("@Page found in pool");
     return page;
   }
 
-  page = alloc_page();
-  if (!page)
+  // positional reads leave the shared file offset alone, so any number of
+  // readers can miss at once
+  ssize_t bytes_read = pread(fileno(b->io->fp), page, b->io->br->page_size,
+                             page_offset(b, rrn));
+  bool ok = bytes_read == (ssize_t)b->io->br->page_size;
+  if (ok)
+    page->rrn = rrn;
+  pool_loaded(b, page, ok);
+  if (!ok) {
+    unpin_page(b, page);
     return NULL;
+  }
+  return page;
+}
 
-  page->rrn = rrn;
-
-  size_t byte_offset =
-      (size_t)(b->io->br->header_size) + ((size_t)(b->io->br->page_size) * rrn);
+page *new_page(b_tree_buf *b, u32 rrn) {
+  if (b->io->map) {
+    page *p = mapped_page(b, rrn, true);
+    if (p) {
+      init_page(b, p);
+      p->rrn = rrn;
+    }
+    return p;
+  }
 
-  if (fseek(b->io->fp, byte_offset, SEEK_SET) != 0) {
-    free(page);
+  bool claimed;
+  page *p = pool_claim(b, rrn, &claimed);
+  if (!p)
     return NULL;
+
+  init_page(b, p);
+  p->rrn = rrn;
+  if (claimed)
+    pool_loaded(b, p, true);
+  return p;
+}
+
+// b->root keeps one pin on the root page for as long as it is the root
+void set_root(b_tree_buf *b, page *p) {
+  if (!b || b->root == p)
+    return;
+
+  if (p)
+    pin_page(b, p);
+  if (b->root)
+    unpin_page(b, b->root);
+  b->root = p;
+}
+
+static pthread_rwlock_t *page_latch(b_tree_buf *b, u32 rrn) {
+  return &b->page_latches[rrn % PAGE_LATCHES];
+}
+
+// takes the latch of a pinned page, shared or exclusive
+static page *latch(b_tree_buf *b, page *p, bool write) {
+  if (p && write)
+    pthread_rwlock_wrlock(page_latch(b, p->rrn));
+  else if (p)
+    pthread_rwlock_rdlock(page_latch(b, p->rrn));
+  return p;
+}
+
+static void unlatch(b_tree_buf *b, page *p) {
+  if (p)
+    pthread_rwlock_unlock(page_latch(b, p->rrn));
+}
+
+static void unlatch_page(b_tree_buf *b, page *p) {
+  unlatch(b, p);
+  unpin_page(b, p);
+}
+
+// keys from the high key on left p when it was split, so the links are
+// followed until a page covers k; only one latch is held at any time, which
+// is safe because pages split to the right and none is freed concurrently
+static page *move_right(b_tree_buf *b, page *p, key k, bool write) {
+  while (p && p->next_leaf != NULL_RRN && compare_key(&k, &p->high) >= 0) {
+    u32 next = p->next_leaf;
+    unlatch_page(b, p);
+    p = latch(b, load_page(b, next), write);
   }
+  return p;
+}
 
-  size_t bytes_read = fread(page, 1, b->io->br->page_size, b->io->fp);
-  if (bytes_read != b->io->br->page_size) {
-    free(page);
+static page *pin_root(b_tree_buf *b) {
+  pthread_mutex_lock(&b->root_lock);
+  page *root = b->root;
+  pin_page(b, root);
+  pthread_mutex_unlock(&b->root_lock);
+  return root;
+}
+
+// latched page at level covering k, exclusive when write is set; the rrns of
+// the internal pages passed on the way down are pushed on stack if given
+static page *find_page(b_tree_buf *b, key k, u8 level, bool write, u32 *stack,
+                       u8 *depth) {
+  page *p = pin_root(b);
+  if (p && p->level < level) {
+    unpin_page(b, p);
     return NULL;
   }
 
-  push_page(b, page);
+  // levels never change, so the latch mode is known before taking it
+  p = latch(b, p, write && p && p->level == level);
+  while (true) {
+    p = move_right(b, p, k, write && p && p->level == level);
+    if (!p || p->level == level)
+      return p;
 
-  return page;
+    int pos;
+    if (search_in_page(p, k, &pos) == BTREE_FOUND_KEY)
+      pos++;
+    u32 child = page_children(b, p)[pos];
+    u8 child_level = p->level - 1;
+    if (stack)
+      stack[(*depth)++] = p->rrn;
+    unlatch_page(b, p);
+    p = latch(b, load_page(b, child), write && child_level == level);
+  }
+}
+
+static u32 snapshot_slot(bt_snapshot *s, u32 rrn) {
+  u32 mask = s->slots - 1;
+  u32 h = (rrn * 2654435761u) & mask;
+  while (s->rrns[h] != NULL_RRN && s->rrns[h] != rrn)
+    h = (h + 1) & mask;
+  return h;
+}
+
+static bool grow_snapshot(bt_snapshot *s) {
+  u32 slots = s->slots ? s->slots * 2 : 64;
+  u32 *rrns = malloc(sizeof(u32) * slots);
+  u32 *copies = malloc(sizeof(u32) * slots);
+  if (!rrns || !copies) {
+    free(rrns);
+    free(copies);
+    puts("!!Memory allocation failed for snapshot table");
+    return false;
+  }
+  memset(rrns, 0xFF, sizeof(u32) * slots);
+
+  u32 *old_rrns = s->rrns, *old_copies = s->copies, old_slots = s->slots;
+  s->rrns = rrns;
+  s->copies = copies;
+  s->slots = slots;
+  for (u32 h = 0; h < old_slots; h++) {
+    if (old_rrns[h] == NULL_RRN)
+      continue;
+    u32 slot = snapshot_slot(s, old_rrns[h]);
+    s->rrns[slot] = old_rrns[h];
+    s->copies[slot] = old_copies[h];
+  }
+  free(old_rrns);
+  free(old_copies);
+  return true;
+}
+
+// records where s reads rrn from, unless it already knows
+static bool snapshot_put(bt_snapshot *s, u32 rrn, u32 copy) {
+  if ((s->used + 1) * 2 > s->slots && !grow_snapshot(s))
+    return false;
+
+  u32 h = snapshot_slot(s, rrn);
+  if (s->rrns[h] != rrn) {
+    s->rrns[h] = rrn;
+    s->copies[h] = copy;
+    s->used++;
+  }
+  return true;
 }
 
-int write_root_rrn(b_tree_buf *b, u16 rrn) {
+// rrn for a new page; no open snapshot reads it, so writers never copy it
+static u32 alloc_rrn(b_tree_buf *b) {
+  u32 rrn = get_free_rrn(b->i);
+  if (!b->snapshots)
+    return rrn;
+
+  // a missing entry only costs a needless copy later
+  pthread_mutex_lock(&b->snapshot_lock);
+  for (bt_snapshot *s = b->snapshots; s; s = s->next)
+    snapshot_put(s, rrn, NULL_RRN);
+  pthread_mutex_unlock(&b->snapshot_lock);
+  return rrn;
+}
+
+// copies p for every open snapshot still reading it in place; the caller
+// holds p exclusively and is about to change or free it
+static btree_status shadow_page(b_tree_buf *b, page *p) {
+  if (!b->snapshots)
+    return BTREE_SUCCESS;
+
+  btree_status status = BTREE_SUCCESS;
+  pthread_mutex_lock(&b->snapshot_lock);
+  for (bt_snapshot *s = b->snapshots; s && status >= 0; s = s->next) {
+    if (s->rrns[snapshot_slot(s, p->rrn)] == p->rrn)
+      continue;
+
+    // copies are not logged, a crash ends every snapshot anyway
+    u32 rrn = get_free_rrn(b->i);
+    page *copy = new_page(b, rrn);
+    if (!copy || !snapshot_put(s, p->rrn, rrn)) {
+      unpin_page(b, copy);
+      insert_list(b->i, rrn);
+      status = BTREE_ERROR_MEMORY;
+      break;
+    }
+    memcpy(copy, p, b->io->br->page_size);
+    copy->rrn = rrn;
+    if (!set_dirty(b, copy, 0) && !in_map(b->io, copy))
+      status = write_page(b, copy);
+    unpin_page(b, copy);
+  }
+  pthread_mutex_unlock(&b->snapshot_lock);
+  return status;
+}
+
+// frees the rrn of a page merged away, logged so replay frees it as well
+static void release_rrn(b_tree_buf *b, u32 rrn) {
+  wal_append(b->wal, WAL_FREE, rrn, NULL, 0);
+  insert_list(b->i, rrn);
+}
+
+// with a log the header only changes at checkpoints
+int write_root_rrn(b_tree_buf *b, u32 rrn) {
   if (!b) {
     puts("!!Error: NULL b_tree_buf");
     return BTREE_ERROR_IO;
   }
 
   b->io->br->root_rrn = rrn;
+  if (b->wal)
+    return wal_append(b->wal, WAL_ROOT, rrn, NULL, 0);
+  return store_root_rrn(b);
+}
 
-  fseek(b->io->fp, 0, SEEK_SET);
-  size_t flag = fwrite(&rrn, sizeof(u16), 1, b->io->fp);
-  if (flag != 1) {
-    puts("!!Error: Could not update root rrn");
-    exit(-1);
-  }
-
-  fflush(b->io->fp);
+// makes an operation durable, sharing the log sync with every thread that
+// committed meanwhile, and checkpoints once the log has grown too long
+static btree_status commit(b_tree_buf *b, btree_status status) {
+  if (!b->wal)
+    return status;
 
-  return BTREE_SUCCESS;
+  btree_status synced = wal_commit(b->wal);
+  if (synced == BTREE_SUCCESS && wal_full(b->wal))
+    synced = b_flush(b);
+  return synced < 0 ? synced : status;
 }
 
-void b_update(b_tree_buf *b, io_buf *data, free_rrn_list *ld,
-              const char *placa) {}
-
+// the leaf comes back pinned but not latched, so while other threads insert
+// its keys may shift; concurrent lookups go through b_search_many instead
 page *b_search(b_tree_buf *b, const char *s, u16 *return_pos) {
-  if (!b || !b->root || !s)
+  *return_pos = (u16)-1;
+  if (!b || !s)
     return NULL;
 
   key k;
-  strncpy(k.id, s, TAMANHO_PLACA - 1);
-  k.id[TAMANHO_PLACA - 1] = '\0';
+  memset(k.id, 0, TAMANHO_PLACA);
+  memcpy(k.id, s, strnlen(s, TAMANHO_PLACA - 1));
 
-  page *found_page = NULL;
-  *return_pos = search_key(b, b->root, k, return_pos, &found_page);
+  pthread_rwlock_rdlock(&b->latch);
+  page *leaf = find_page(b, k, 0, false, NULL, NULL);
+  int pos;
+  bool found = leaf && search_in_page(leaf, k, &pos) == BTREE_FOUND_KEY;
+  unlatch(b, leaf);
+  pthread_rwlock_unlock(&b->latch);
 
-  if (found_page->leaf)
-    return found_page;
+  if (!found) {
+    unpin_page(b, leaf);
+    return NULL;
+  }
+  *return_pos = pos;
+  return leaf;
+}
 
-  *return_pos = (u16)-1;
-  return NULL;
+// looks up n plates at once, leaving each data rrn (or NULL_RRN) in the
+// matching out_rrns slot; probes are sorted so consecutive ones share the
+// upper part of their descent and every leaf is searched from one load
+static size_t search_many(b_tree_buf *b, const char **plates, size_t n,
+                          u32 *out_rrns) {
+  for (size_t i = 0; i < n; i++)
+    out_rrns[i] = NULL_RRN;
+  if (n == 0)
+    return 0;
+
+  // the probe index rides in the rrn field while sorting
+  key *probes = malloc(sizeof(key) * n);
+  if (!probes) {
+    puts("!!Memory allocation failed for probes");
+    return 0;
+  }
+  for (size_t i = 0; i < n; i++) {
+    memset(probes[i].id, 0, TAMANHO_PLACA);
+    if (plates[i])
+      memcpy(probes[i].id, plates[i], strnlen(plates[i], TAMANHO_PLACA - 1));
+    probes[i].data_register_rrn = (u32)i;
+  }
+  qsort(probes, n, sizeof(key), compare_keys);
+
+  size_t found = 0;
+  tree_path path;
+  btree_status status = descend(b, probes[0], &path);
+  for (size_t i = 0; i < n && status >= 0; i++) {
+    if (i > 0) {
+      rewind_path(b, &path, probes[i]);
+      status = resume_descent(b, probes[i], &path);
+    }
+    if (status == BTREE_FOUND_KEY) {
+      out_rrns[probes[i].data_register_rrn] = path.hit.data_register_rrn;
+      found++;
+    }
+  }
+  if (status >= 0)
+    release_path(b, &path);
+
+  free(probes);
+  return found;
+}
+
+size_t b_search_many(b_tree_buf *b, const char **plates, size_t n,
+                     u32 *out_rrns) {
+  if (!b || (n > 0 && (!plates || !out_rrns)))
+    return 0;
+
+  pthread_rwlock_rdlock(&b->latch);
+  size_t found = search_many(b, plates, n, out_rrns);
+  pthread_rwlock_unlock(&b->latch);
+  return found;
+}
+
+// rewrites the record of d->placa where it is, moving its keys in the
+// secondary indexes along with the fields that changed
+btree_status b_update(b_tree_buf *b, io_buf *data, data_record *d) {
+  if (!b || !data || !d)
+    return BTREE_ERROR_INVALID_PAGE;
+
+  const char *plate = d->placa;
+  u32 rrn;
+  data_record old;
+  btree_status status = BTREE_NOT_FOUND_KEY;
+
+  // from the lookup to the secondary keys every other writer is kept out,
+  // so two updates, or an update and a remove, of a plate never both start
+  // from the same old record
+  unsettle(b);
+  pthread_rwlock_wrlock(&b->latch);
+  if (search_many(b, &plate, 1, &rrn) == 1)
+    status = load_data_record_into(data, rrn, &old) == IO_SUCCESS
+                 ? BTREE_SUCCESS
+                 : BTREE_ERROR_IO;
+
+  // the record is not logged, so an empty group in b's log stands for it
+  if (status == BTREE_SUCCESS)
+    status = wal_append(b->wal, WAL_BEGIN, NULL_RRN, NULL, 0);
+  if (status == BTREE_SUCCESS)
+    status = wal_append(b->wal, WAL_END, NULL_RRN, NULL, 0);
+  if (status == BTREE_SUCCESS)
+    status = wal_commit(b->wal);
+  if (status == BTREE_SUCCESS) {
+    write_data_record(data, d, rrn);
+    status = secondary_update(b, &old, d, rrn);
+  }
+  pthread_rwlock_unlock(&b->latch);
+
+  // a checkpoint takes the latch, so a log grown too long waits for it
+  if (status == BTREE_SUCCESS)
+    status = commit(b, status);
+  settle(b);
+  return status;
 }
 
 void b_range_search(b_tree_buf *b, io_buf *data, key_range *range) {
@@ -194,264 +1137,1047 @@ void b_range_search(b_tree_buf *b, io_buf *data, key_range *range) {
     return;
   }
 
-  page *curr = b->root;
-  while (!curr->leaf) {
-    int i;
-    for (i = 0; i < curr->keys_num; i++) {
-      if (strcmp(range->start_id, curr->keys[i].id) < 0) {
-        break;
-      }
-    }
-    curr = load_page(b, curr->children[i]);
-    if (!curr) {
-      puts("!!Error loading page during range search");
-      return;
-    }
+  bt_cursor *c = bt_cursor_open(b, range->start_id, range->end_id);
+  if (!c) {
+    puts("!!Error loading page during range search");
+    return;
   }
 
   bool found_any = false;
-  while (curr) {
-    if (curr->keys_num > 0 && strcmp(curr->keys[0].id, range->end_id) > 0) {
-      break;
+  key keys[RANGE_BATCH];
+  data_record records[RANGE_BATCH];
+  int n;
+  while ((n = bt_cursor_next_batch(c, data, keys, records, RANGE_BATCH)) > 0) {
+    for (int i = 0; i < n; i++) {
+      if (records[i].placa[0] == '\0')
+        continue;
+      found_any = true;
+      print_data_record(&records[i]);
     }
+  }
+  bt_cursor_close(c);
 
-    for (int i = 0; i < curr->keys_num; i++) {
-      if (strcmp(curr->keys[i].id, range->end_id) > 0) {
-        break;
-      }
+  if (!found_any) {
+    puts("Nenhum registro encontrado no intervalo especificado.");
+  }
+}
 
-      if (strcmp(curr->keys[i].id, range->start_id) >= 0) {
-        found_any = true;
-        data_record *record =
-            load_data_record(data, curr->keys[i].data_register_rrn);
-        if (record) {
-          print_data_record(record);
-          free(record);
-        }
-      }
-    }
+// leaves are mostly allocated in key order, so the pages after the next leaf
+// are likely the ones the scan reaches after it; the leaf is latched
+static void read_ahead(bt_cursor *c) {
+  u32 next = c->leaf->next_leaf;
+  if (next == NULL_RRN || (next >= c->ahead_from && next < c->ahead_to))
+    return;
+
+  prefetch_pages(c->b, next, READAHEAD_LEAVES);
+  c->ahead_from = next;
+  c->ahead_to = next + READAHEAD_LEAVES;
+}
+
+// freezes the tree as it is now; writers copy every page they change or free
+// afterwards, so the snapshot keeps reading what it saw
+bt_snapshot *bt_snapshot_open(b_tree_buf *b) {
+  if (!b)
+    return NULL;
+
+  bt_snapshot *s = malloc(sizeof(bt_snapshot));
+  if (!s) {
+    puts("!!Memory allocation failed for snapshot");
+    return NULL;
+  }
+  s->b = b;
+  s->rrns = s->copies = NULL;
+  s->slots = s->used = 0;
+  if (!grow_snapshot(s)) {
+    free(s);
+    return NULL;
+  }
+
+  // no writer is between two pages while the latch is held exclusively
+  pthread_rwlock_wrlock(&b->latch);
+  s->root = b->root ? b->root->rrn : NULL_RRN;
+  pthread_mutex_lock(&b->snapshot_lock);
+  s->next = b->snapshots;
+  b->snapshots = s;
+  pthread_mutex_unlock(&b->snapshot_lock);
+  pthread_rwlock_unlock(&b->latch);
+  return s;
+}
+
+// no cursor may still be open on s
+void bt_snapshot_close(bt_snapshot *s) {
+  if (!s)
+    return;
 
-    if (curr->next_leaf == (u16)-1) {
+  b_tree_buf *b = s->b;
+  pthread_rwlock_wrlock(&b->latch);
+  pthread_mutex_lock(&b->snapshot_lock);
+  for (bt_snapshot **at = &b->snapshots; *at; at = &(*at)->next) {
+    if (*at == s) {
+      *at = s->next;
       break;
     }
+  }
+  pthread_mutex_unlock(&b->snapshot_lock);
 
-    page *next = load_page(b, curr->next_leaf);
-    curr = next;
+  // the copies are never read again, so cached ones need not reach the disk
+  for (u32 h = 0; h < s->slots; h++) {
+    if (s->rrns[h] == NULL_RRN || s->copies[h] == NULL_RRN)
+      continue;
+    page *copy = b->pool ? pool_search(b->pool, s->copies[h]) : NULL;
+    if (copy) {
+      drop_page(b, copy);
+      unpin_page(b, copy);
+    }
+    release_rrn(b, s->copies[h]);
   }
+  pthread_rwlock_unlock(&b->latch);
 
-  if (!found_any) {
-    puts("Nenhum registro encontrado no intervalo especificado.");
+  free(s->rrns);
+  free(s->copies);
+  free(s);
+}
+
+// copies page rrn as s sees it into out; the live page is latched while the
+// table is checked, since a writer copies it under its exclusive latch
+static bool snapshot_page(bt_snapshot *s, u32 rrn, page *out) {
+  b_tree_buf *b = s->b;
+  pthread_rwlock_rdlock(&b->latch);
+  page *p = latch(b, load_page(b, rrn), false);
+
+  pthread_mutex_lock(&b->snapshot_lock);
+  u32 h = snapshot_slot(s, rrn);
+  u32 copy = s->rrns[h] == rrn ? s->copies[h] : NULL_RRN;
+  pthread_mutex_unlock(&b->snapshot_lock);
+
+  // copies are never written again, so they are read without a latch
+  if (copy != NULL_RRN) {
+    unlatch_page(b, p);
+    p = load_page(b, copy);
+  }
+  if (p)
+    memcpy(out, p, b->io->br->page_size);
+  if (copy != NULL_RRN)
+    unpin_page(b, p);
+  else
+    unlatch_page(b, p);
+  pthread_rwlock_unlock(&b->latch);
+  return p != NULL;
+}
+
+static bool snapshot_next(bt_cursor *c, key *out) {
+  int pos = lower_bound(c->leaf, c->from);
+  while (pos >= c->leaf->keys_num) {
+    u32 next = c->leaf->next_leaf;
+    if (next == NULL_RRN || !snapshot_page(c->snap, next, c->copy)) {
+      c->leaf = NULL;
+      return false;
+    }
+    pos = lower_bound(c->leaf, c->from);
+  }
+
+  if (page_key_bits(c->leaf, pos) > c->end) {
+    c->leaf = NULL;
+    return false;
+  }
+
+  key k = page_key(c->leaf, pos);
+  c->from = key_bits(&k) + 1;
+  if (out)
+    *out = k;
+  return true;
+}
+
+static bt_cursor *alloc_cursor(b_tree_buf *b, u64 from, u64 end) {
+  bt_cursor *c = malloc(sizeof(bt_cursor));
+  if (!c) {
+    puts("!!Memory allocation failed for cursor");
+    return NULL;
   }
+  c->b = b;
+  c->snap = NULL;
+  c->copy = NULL;
+  c->leaf = NULL;
+  c->done = false;
+  c->from = from;
+  c->end = end;
+  c->ahead_from = c->ahead_to = 0;
+  return c;
 }
 
-int search_in_page(page *p, key key, int *return_pos) {
-  if (!p) {
-    puts("!!Error: no page");
-    return BTREE_ERROR_INVALID_PAGE;
+static key first_key(u64 from) {
+  key first;
+  memset(&first, 0, sizeof(key));
+  u64 be = htobe64(from);
+  memcpy(first.id, &be, sizeof(u64));
+  return first;
+}
+
+// reads s instead of the live tree; the tree latch is only held while a page
+// is copied, so writers go on between two leaves. data records removed
+// after s was opened may already hold other vehicles
+bt_cursor *bt_cursor_open_snapshot(bt_snapshot *s, const char *start,
+                                   const char *end) {
+  if (!s)
+    return NULL;
+
+  bt_cursor *c = alloc_cursor(s->b, start ? key_norm(start) : 0,
+                              end ? key_norm(end) : UINT64_MAX);
+  if (!c)
+    return NULL;
+  c->snap = s;
+  c->copy = alloc_page(s->b);
+  if (!c->copy) {
+    free(c);
+    return NULL;
   }
 
-  for (int i = 0; i < p->keys_num; i++) {
-    if (p->keys[i].id[0] == '\0') {
-      *return_pos = i;
-      return BTREE_NOT_FOUND_KEY;
+  key first = first_key(c->from);
+  u32 rrn = s->root;
+  while (rrn != NULL_RRN) {
+    if (!snapshot_page(s, rrn, c->copy)) {
+      bt_cursor_close(c);
+      return NULL;
     }
-
-    if (DEBUG)
-      printf("page key id: %s\t key id: %s\n", p->keys[i].id, key.id);
-    if (strcmp(p->keys[i].id, key.id) == 0) {
-      puts("@Curr key was found");
-      *return_pos = i;
-      return BTREE_FOUND_KEY;
+    if (c->copy->next_leaf != NULL_RRN &&
+        compare_key(&first, &c->copy->high) >= 0) {
+      rrn = c->copy->next_leaf;
+      continue;
     }
-
-    if (strcmp(p->keys[i].id, key.id) > 0) {
-      *return_pos = i;
-      if (DEBUG)
-        puts("@Curr key is greater than the new one");
-      return BTREE_NOT_FOUND_KEY;
+    if (c->copy->level == 0) {
+      c->leaf = c->copy;
+      break;
     }
+
+    int pos;
+    if (search_in_page(c->copy, first, &pos) == BTREE_FOUND_KEY)
+      pos++;
+    rrn = page_children(s->b, c->copy)[pos];
   }
+  return c;
+}
 
-  *return_pos = p->keys_num;
-  return BTREE_NOT_FOUND_KEY;
+// a NULL start or end leaves that side of the range open
+bt_cursor *bt_cursor_open(b_tree_buf *b, const char *start, const char *end) {
+  return bt_cursor_open_bits(b, start ? key_norm(start) : 0,
+                             end ? key_norm(end) : UINT64_MAX);
 }
 
-u16 search_key(b_tree_buf *b, page *p, key k, u16 *found_pos,
-               page **return_page) {
-  if (!p)
-    return (u16)-1;
+// scans the keys whose bits lie in [from, end], for ids that are no strings
+bt_cursor *bt_cursor_open_bits(b_tree_buf *b, u64 from, u64 end) {
+  if (!b)
+    return NULL;
+  return alloc_cursor(b, from, end);
+}
 
-  int pos;
-  int result = search_in_page(p, k, &pos);
+// pins and latches the leaf that holds from, or the one before it; the tree
+// latch is held
+static bool seek_leaf(bt_cursor *c) {
+  page *root = pin_root(c->b);
+  if (!root) {
+    c->done = true;
+    return false;
+  }
+  unpin_page(c->b, root);
 
-  if (DEBUG) {
-    printf("page key id: %s     key id: %s\n",
-           p->keys_num > 0 ? p->keys[0].id : "", k.id);
+  c->leaf = find_page(c->b, first_key(c->from), 0, false, NULL, NULL);
+  if (!c->leaf) {
+    puts("!!Error loading page during range search");
+    c->done = true;
+    return false;
   }
+  read_ahead(c);
+  return true;
+}
 
-  if (result == BTREE_FOUND_KEY) {
-    *found_pos = pos;
-    *return_page = p;
-    return pos;
+// steps c->leaf, latched on entry and on return, to the next key in range;
+// the tree latch is held
+static bool live_next(bt_cursor *c, key *out) {
+  int pos = lower_bound(c->leaf, c->from);
+  while (c->leaf && pos >= c->leaf->keys_num) {
+    u32 next = c->leaf->next_leaf;
+    unlatch_page(c->b, c->leaf);
+    c->leaf = next == NULL_RRN ? NULL : latch(c->b, load_page(c->b, next), false);
+    if (c->leaf) {
+      read_ahead(c);
+      pos = lower_bound(c->leaf, c->from);
+    }
   }
 
-  if (p->leaf) {
-    *return_page = p;
-    *found_pos = pos;
-    return (u16)-1;
+  if (!c->leaf || page_key_bits(c->leaf, pos) > c->end) {
+    c->done = true;
+    return false;
+  }
+
+  key k = page_key(c->leaf, pos);
+  c->from = key_bits(&k) + 1;
+  if (out)
+    *out = k;
+  return true;
+}
+
+// the tree latch is taken per call rather than while the cursor is open, so
+// the caller may change the tree between two calls
+bool bt_cursor_next(bt_cursor *c, key *out) {
+  if (!c || c->done)
+    return false;
+  if (c->snap)
+    return c->leaf && snapshot_next(c, out);
+
+  pthread_rwlock_rdlock(&c->b->latch);
+  bool found = seek_leaf(c) && live_next(c, out);
+  unlatch_page(c->b, c->leaf);
+  c->leaf = NULL;
+  pthread_rwlock_unlock(&c->b->latch);
+  return found;
+}
+
+bool bt_cursor_next_record(bt_cursor *c, io_buf *data, data_record *dst) {
+  key k;
+  while (bt_cursor_next(c, &k)) {
+    if (load_data_record_into(data, k.data_register_rrn, dst) == IO_SUCCESS)
+      return true;
   }
+  return false;
+}
+
+// fills up to max keys and their records; a live cursor takes the tree latch
+// once for the whole batch. the records are read in rrn order and any that
+// cannot be read are left zeroed
+int bt_cursor_next_batch(bt_cursor *c, io_buf *data, key *keys,
+                         data_record *records, int max) {
+  int n = 0;
+  u32 rrns[RANGE_BATCH];
+  if (!c || c->done)
+    return 0;
+  if (max > RANGE_BATCH)
+    max = RANGE_BATCH;
+
+  bool live = !c->snap;
+  if (live) {
+    pthread_rwlock_rdlock(&c->b->latch);
+    if (!seek_leaf(c))
+      max = 0;
+  }
+  while (n < max &&
+         (live ? live_next(c, &keys[n]) : bt_cursor_next(c, &keys[n]))) {
+    rrns[n] = keys[n].data_register_rrn;
+    n++;
+  }
+  if (live) {
+    unlatch_page(c->b, c->leaf);
+    c->leaf = NULL;
+  }
+  if (n > 0)
+    load_data_records(data, rrns, n, records);
+  if (live)
+    pthread_rwlock_unlock(&c->b->latch);
+  return n;
+}
+
+void bt_cursor_close(bt_cursor *c) {
+  if (!c)
+    return;
+  free(c->copy);
+  free(c);
+}
+
+_Static_assert(TAMANHO_PLACA == sizeof(u64), "plates must fill a u64");
+
+// plates are compared as big-endian integers of their 8 id bytes, which
+// orders them exactly like strcmp as long as the bytes after the terminator
+// are zero; populate_key and b_search guarantee that for stored keys
+u64 key_norm(const char *id) {
+  char buf[TAMANHO_PLACA] = {0};
+  memcpy(buf, id, strnlen(id, TAMANHO_PLACA));
+  u64 v;
+  memcpy(&v, buf, sizeof(u64));
+  return be64toh(v);
+}
+
+u64 key_bits(const key *k) {
+  u64 v;
+  memcpy(&v, k->id, sizeof(u64));
+  return be64toh(v);
+}
+
+// Mercosul (LLLNLNN) and older (LLLNNNN) plates as numbers below 26^3 * 10 *
+// 36 * 100 that sort like the plates: each letter takes 26 values, each digit
+// 10 and the fifth character 36, digits before letters as in ASCII. False
+// for any other id
+bool plate_code(u64 bits, u64 *code) {
+  if (bits & 0xFF)
+    return false;
+
+  u64 v = 0;
+  for (int i = 0; i < TAMANHO_PLACA - 1; i++) {
+    u8 c = bits >> 8 * (TAMANHO_PLACA - 1 - i);
+    bool letter = c >= 'A' && c <= 'Z', digit = c >= '0' && c <= '9';
+    if (i < 3 && letter)
+      v = v * 26 + (c - 'A');
+    else if (i == 4 && (letter || digit))
+      v = v * 36 + (digit ? c - '0' : c - 'A' + 10);
+    else if (i >= 3 && i != 4 && digit)
+      v = v * 10 + (c - '0');
+    else
+      return false;
+  }
+  *code = v;
+  return true;
+}
+
+// the id bits of the plate a code stands for
+u64 plate_bits(u64 code) {
+  u64 bits = 0;
+  for (int i = TAMANHO_PLACA - 2; i >= 0; i--) {
+    int radix = i < 3 ? 26 : i == 4 ? 36 : 10;
+    int d = code % radix;
+    code /= radix;
+    u8 c = i < 3 ? 'A' + d : d < 10 ? '0' + d : 'A' + d - 10;
+    bits |= (u64)c << 8 * (TAMANHO_PLACA - 1 - i);
+  }
+  return bits;
+}
+
+// high key of the rightmost page on a level, above every plate
+void set_max_key(key *k) {
+  k->data_register_rrn = NULL_RRN;
+  memset(k->id, 0xFF, TAMANHO_PLACA);
+}
 
-  page *next = load_page(b, p->children[pos]);
-  if (!next)
-    return (u16)-1;
+int compare_key(const key *a, const key *b) {
+  u64 x = key_bits(a), y = key_bits(b);
+  return (x > y) - (x < y);
+}
 
-  u16 ret = search_key(b, next, k, found_pos, return_page);
+// first slot whose key is not below target; keys are decoded from their
+// slots as they are probed, and the halving step compiles to a conditional
+// move so the loop has no data dependent branches
+int lower_bound(const page *p, u64 target) {
+  int n = p->keys_num;
+  if (n == 0)
+    return 0;
+
+  // pages of plates are probed by code; an id that is no plate is compared
+  // with the plates its probes decode to
+  u64 code;
+  int base = 0;
+  if (p->plates && !plate_code(target, &code)) {
+    while (n > 1) {
+      int half = n / 2;
+      base = page_key_bits(p, base + half) < target ? base + half : base;
+      n -= half;
+    }
+    return base + (page_key_bits(p, base) < target);
+  }
+  if (p->plates)
+    target = code << PLATE_CODE_SHIFT;
 
-  if (next != b->root && !queue_search(b->q, next->rrn)) {
-    free(next);
+  u64 prefix = prefix_bits(p);
+  while (n > 1) {
+    int half = n / 2;
+    base = (prefix | slot_bits(p, base + half)) < target ? base + half : base;
+    n -= half;
+  }
+  return base + ((prefix | slot_bits(p, base)) < target);
+}
+
+int search_in_page(page *p, key key, int *return_pos) {
+  if (!p) {
+    puts("!!Error: no page");
+    return BTREE_ERROR_INVALID_PAGE;
   }
 
-  return ret;
+  u64 target = key_bits(&key);
+  int pos = lower_bound(p, target);
+  *return_pos = pos;
+
+  if (pos < p->keys_num && page_key_bits(p, pos) == target) {
+    if (DEBUG)
+      printf("@Key %s found at %d\n", key.id, pos);
+    return BTREE_FOUND_KEY;
+  }
+  return BTREE_NOT_FOUND_KEY;
 }
 
-void populate_key(key *k, data_record *d, u16 rrn) {
+void populate_key(key *k, data_record *d, u32 rrn) {
   if (!k || !d)
     return;
 
-  strncpy(k->id, d->placa, TAMANHO_PLACA);
+  memset(k->id, 0, TAMANHO_PLACA);
+  memcpy(k->id, d->placa, strnlen(d->placa, TAMANHO_PLACA));
   k->data_register_rrn = rrn;
 
   if (DEBUG) {
-    printf("@Populated key with ID: %s and data RRN: %hu\n", k->id,
+    printf("@Populated key with ID: %s and data RRN: %u\n", k->id,
            k->data_register_rrn);
   }
 }
 
-btree_status insert_in_page(page *p, key k, page *r_child, int pos) {
-  if (!p)
+// arrays to repack up to three pages in, kept on a free list so splits and
+// merges reuse them instead of going to malloc; one is taken per writer
+static scratch *take_scratch(b_tree_buf *b) {
+  u32 cap = page_capacity(b) + 1;
+  pthread_mutex_lock(&b->scratch_lock);
+  scratch *sc = b->scratch;
+  if (sc)
+    b->scratch = sc->next;
+  pthread_mutex_unlock(&b->scratch_lock);
+  if (sc && sc->cap >= cap)
+    return sc;
+
+  // none left, or sized for the pages of another index
+  free(sc);
+  sc = malloc(sizeof(scratch) + sizeof(key) * cap * 3 +
+              sizeof(u32) * (cap + 1) * 3);
+  if (!sc) {
+    puts("!!Error: could not allocate scratch keys");
+    return NULL;
+  }
+  sc->next = NULL;
+  sc->cap = cap;
+  sc->keys = (key *)(sc + 1);
+  sc->children = (u32 *)(sc->keys + cap * 3);
+  return sc;
+}
+
+static void give_scratch(b_tree_buf *b, scratch *sc) {
+  pthread_mutex_lock(&b->scratch_lock);
+  sc->next = b->scratch;
+  b->scratch = sc;
+  pthread_mutex_unlock(&b->scratch_lock);
+}
+
+btree_status insert_in_page(b_tree_buf *b, page *p, key k, page *r_child,
+                            int pos) {
+  if (!b || !p)
     return BTREE_ERROR_INVALID_PAGE;
 
+  btree_status status = shadow_page(b, p);
+  if (status < 0)
+    return status;
+
   if (DEBUG) {
     printf("Current state - keys: %d, children: %d, inserting at pos: %d\n",
            p->keys_num, p->child_num, pos);
   }
 
-  for (int i = p->keys_num - 1; i >= pos; i--) {
-    p->keys[i + 1] = p->keys[i];
+  u32 child = !p->leaf && r_child ? r_child->rrn : NULL_RRN;
+  if (fits_slot(b, p, &k, child != NULL_RRN)) {
+    insert_slot(b, p, &k, pos, child);
+  } else {
+    // a key outside the prefix or past the width repacks the whole page
+    int n = p->keys_num, c = p->child_num;
+    scratch *sc = take_scratch(b);
+    if (!sc)
+      return BTREE_ERROR_MEMORY;
+    key *keys = sc->keys;
+    u32 *children = sc->children;
+    unpack_keys(p, keys);
+    memcpy(children, page_children(b, p), sizeof(u32) * c);
+    memmove(keys + pos + 1, keys + pos, sizeof(key) * (n - pos));
+    keys[pos] = k;
+    if (child != NULL_RRN) {
+      memmove(children + pos + 2, children + pos + 1,
+              sizeof(u32) * (c - pos - 1));
+      children[pos + 1] = child;
+      c++;
+    }
+    bool packed = pack_page(b, p, keys, n + 1, children, c);
+    give_scratch(b, sc);
+    if (!packed)
+      return BTREE_ERROR_PAGE_FULL;
   }
 
-  p->keys[pos] = k;
-  p->keys_num++;
+  if (DEBUG) {
+    printf("After insertion - keys: %d, children: %d\n", p->keys_num,
+           p->child_num);
+    printf("Inserted key with data RRN: %u\n", k.data_register_rrn);
+  }
+
+  return BTREE_INSERTED_IN_PAGE;
+}
+
+btree_status descend(b_tree_buf *b, key k, tree_path *path) {
+  path->depth = 0;
+  page *root = b ? pin_root(b) : NULL;
+  if (!root)
+    return BTREE_ERROR_INVALID_PAGE;
+
+  path->pages[0] = root;
+  path->depth = 1;
+  return resume_descent(b, k, path);
+}
+
+// continues a descent from the deepest page already on path; pages stay
+// pinned on path, but each is only latched while it is searched
+btree_status resume_descent(b_tree_buf *b, key k, tree_path *path) {
+  page *p = path->pages[--path->depth];
+
+  while (true) {
+    if (path->depth == MAX_HEIGHT) {
+      puts("!!Error: tree is deeper than MAX_HEIGHT");
+      unpin_page(b, p);
+      release_path(b, path);
+      return BTREE_ERROR_INVALID_PAGE;
+    }
+
+    p = move_right(b, latch(b, p, false), k, false);
+    if (!p) {
+      release_path(b, path);
+      return BTREE_ERROR_IO;
+    }
+
+    int pos;
+    btree_status status = search_in_page(p, k, &pos);
+    // a key equal to a separator lives in the subtree right of it
+    if (!p->leaf && status == BTREE_FOUND_KEY)
+      pos++;
+    u32 child = p->leaf ? NULL_RRN : page_children(b, p)[pos];
+    if (status == BTREE_FOUND_KEY && p->leaf)
+      path->hit = page_key(p, pos);
+    unlatch(b, p);
+
+    path->pages[path->depth] = p;
+    path->slots[path->depth] = pos;
+    path->depth++;
+
+    if (p->leaf)
+      return status;
+
+    p = load_page(b, child);
+    if (!p) {
+      release_path(b, path);
+      return BTREE_ERROR_IO;
+    }
+  }
+}
+
+// upper bound of the deepest page on path: its high key, or NULL at the right
+// edge of the tree; only stable while the tree latch is held alone
+key *path_bound(tree_path *path) {
+  page *p = path->pages[path->depth - 1];
+  return p->next_leaf == NULL_RRN ? NULL : &p->high;
+}
+
+// pops pages off path until the deepest one left covers k; keys come in
+// ascending order and splits only lower high keys, so only those are checked
+void rewind_path(b_tree_buf *b, tree_path *path, key k) {
+  while (path->depth > 1) {
+    page *p = latch(b, path->pages[path->depth - 1], false);
+    bool covers = compare_key(&k, &p->high) < 0;
+    unlatch(b, p);
+    if (covers)
+      return;
+    unpin_page(b, path->pages[--path->depth]);
+  }
+}
+
+void release_path(b_tree_buf *b, tree_path *path) {
+  while (path->depth > 0)
+    unpin_page(b, path->pages[--path->depth]);
+}
+
+// the first key of an empty tree becomes a leaf root; false when another
+// thread planted a root first
+static bool plant_root(b_tree_buf *b, key k, btree_status *status) {
+  pthread_mutex_lock(&b->root_lock);
+  bool planted = !b->root;
+  if (planted) {
+    page *root = new_page(b, alloc_rrn(b));
+    *status = BTREE_ERROR_MEMORY;
+    if (root) {
+      pack_page(b, root, &k, 1, NULL, 0);
+      set_root(b, root);
+      *status = write_index_record(b, root);
+      if (*status >= 0)
+        *status = write_root_rrn(b, root->rrn);
+      unpin_page(b, root);
+    }
+  }
+  pthread_mutex_unlock(&b->root_lock);
+  return planted;
+}
+
+// puts a root above the old one when its level split; false when the root
+// already sits above level, in which case the separator goes to that level
+static bool grow_root(b_tree_buf *b, u8 level, key k, page *right,
+                      btree_status *status) {
+  pthread_mutex_lock(&b->root_lock);
+  bool grown = b->root->level == level;
+  if (grown) {
+    page *root = new_page(b, alloc_rrn(b));
+    *status = BTREE_ERROR_MEMORY;
+    if (root) {
+      u32 children[2] = {b->root->rrn, right->rrn};
+      root->leaf = false;
+      root->level = level + 1;
+      pack_page(b, root, &k, 1, children, 2);
+
+      *status = write_index_record(b, root);
+      set_root(b, root);
+      unpin_page(b, root);
+      if (*status >= 0)
+        *status = write_root_rrn(b, root->rrn);
+    }
+  }
+  pthread_mutex_unlock(&b->root_lock);
+  return grown;
+}
+
+// Lehman-Yao insert: the leaf is latched alone, and a split releases each
+// page before latching its parent, so inserts only contend on the pages
+// they modify; readers that reach a page mid-split move right through it
+static btree_status insert_key(b_tree_buf *b, key new_key) {
+  btree_status status = BTREE_SUCCESS;
+  u32 stack[MAX_HEIGHT];
+  u8 depth = 0;
+  page *p = find_page(b, new_key, 0, true, stack, &depth);
+  if (!p && plant_root(b, new_key, &status))
+    return status;
+  if (!p)
+    p = find_page(b, new_key, 0, true, stack, &depth);
+  if (!p)
+    return BTREE_ERROR_IO;
+
+  int pos;
+  if (search_in_page(p, new_key, &pos) == BTREE_FOUND_KEY) {
+    unlatch_page(b, p);
+    return BTREE_ERROR_DUPLICATE;
+  }
+
+  // each split hands its separator to the page one level up
+  key k = new_key;
+  page *r_child = NULL;
+  while (true) {
+    status = insert_in_page(b, p, k, r_child, pos);
+    if (status != BTREE_ERROR_PAGE_FULL) {
+      if (status == BTREE_INSERTED_IN_PAGE)
+        status = write_index_record(b, p);
+      unlatch_page(b, p);
+      unpin_page(b, r_child);
+      return status < 0 ? status : BTREE_SUCCESS;
+    }
 
-  if (!p->leaf && r_child) {
-    for (int i = p->child_num - 1; i >= pos + 1; i--) {
-      p->children[i + 1] = p->children[i];
+    key promo_key;
+    bool promoted;
+    page *right = r_child;
+    u8 level = p->level;
+    status = b_split(b, p, &right, &promo_key, &k, &promoted);
+    unlatch_page(b, p);
+    unpin_page(b, r_child);
+    if (status < 0)
+      return status;
+    r_child = right;
+    k = promo_key;
+
+    // the parent passed on the way down may have split since, and one that
+    // was not passed at all is reached from the root
+    if (depth > 0) {
+      p = move_right(b, latch(b, load_page(b, stack[--depth]), true), k, true);
+    } else if (grow_root(b, level, k, r_child, &status)) {
+      unpin_page(b, r_child);
+      return status < 0 ? status : BTREE_SUCCESS;
+    } else {
+      p = find_page(b, k, level + 1, true, stack, &depth);
+    }
+
+    if (!p) {
+      unpin_page(b, r_child);
+      return BTREE_ERROR_IO;
     }
-    p->children[pos + 1] = r_child->rrn;
-    p->child_num++;
+    search_in_page(p, k, &pos);
   }
+}
 
-  if (DEBUG) {
-    printf("After insertion - keys: %d, children: %d\n", p->keys_num,
-           p->child_num);
-    printf("Inserted key with data RRN: %hu\n", k.data_register_rrn);
-  }
+// inserts a key built by the caller, as secondary indexes do
+btree_status b_insert_key(b_tree_buf *b, key k) {
+  if (!b)
+    return BTREE_ERROR_INVALID_PAGE;
 
-  return BTREE_INSERTED_IN_PAGE;
+  pthread_rwlock_rdlock(&b->latch);
+  btree_status status = insert_key(b, k);
+  pthread_rwlock_unlock(&b->latch);
+  return commit(b, status);
 }
 
-btree_status b_insert(b_tree_buf *b, io_buf *data, data_record *d, u16 rrn) {
+btree_status b_insert(b_tree_buf *b, io_buf *data, data_record *d, u32 rrn) {
   if (!b || !data || !d)
     return BTREE_ERROR_INVALID_PAGE;
 
   key new_key;
   populate_key(&new_key, d, rrn);
 
-  if (!b->root) {
-    b->root = alloc_page();
-    if (!b->root)
-      return BTREE_ERROR_MEMORY;
-
-    b->root->rrn = get_free_rrn(b->i);
-    if (b->root->rrn < 0) {
-      free(b->root);
-      b->root = NULL;
-      return BTREE_ERROR_IO;
-    }
-
-    b->root->keys[0] = new_key;
-    b->root->keys_num = 1;
-    b->root->leaf = true;
+  // a plate already indexed leaves the secondary indexes as they are
+  unsettle(b);
+  btree_status status = b_insert_key(b, new_key);
+  if (status == BTREE_SUCCESS)
+    status = secondary_insert(b, d, rrn);
+  settle(b);
+  return status;
+}
 
-    return write_index_record(b, b->root);
-  }
+// writes m keys (and m + 1 children on internal pages) over p and as many new
+// right siblings as needed, filling each page in turn; the separator and rrn
+// of each new sibling are left in promo for the parent
+static btree_status spread_page(b_tree_buf *b, page *p, key *keys,
+                                u32 *children, int m, key *promo,
+                                u32 *promo_children, int *promoted) {
+  bool leaf = p->leaf;
+  int entries = leaf ? m : m + 1;
+  btree_status status = shadow_page(b, p);
+  if (status < 0)
+    return status;
 
-  key promo_key;
-  page *r_child = NULL;
-  bool promoted = false;
+  u32 next_leaf = p->next_leaf;
+  key high = p->high;
+  int taken = 0, t = 0;
+  for (; taken < entries && status >= 0; t++) {
+    // on internal pages keys[c] separates child c from the next one
+    int count = bulk_count(b, keys + taken, entries - taken, leaf, 100);
+    page *node = t == 0 ? p : new_page(b, promo_children[t - 1]);
+    if (!node)
+      return BTREE_ERROR_MEMORY;
+    node->leaf = leaf;
+    node->level = p->level;
+    node->high = high;
+
+    // each sibling gets its rrn before the page linking to it is written
+    bool last = taken + count == entries;
+    node->next_leaf = last ? next_leaf : (promo_children[t] = alloc_rrn(b));
+    if (t > 0)
+      promo[t - 1] = leaf ? separator(&keys[taken - 1], &keys[taken])
+                          : keys[taken - 1];
+
+    bool packed = leaf ? pack_page(b, node, keys + taken, count, NULL, 0)
+                       : pack_page(b, node, keys + taken, count - 1,
+                                   children + taken, count);
+    taken += count;
+    // the key between two internal siblings moves up instead
+    if (!last)
+      node->high = leaf ? separator(&keys[taken - 1], &keys[taken])
+                        : keys[taken - 1];
+
+    status = packed ? write_index_record(b, node) : BTREE_ERROR_PAGE_FULL;
+    if (t > 0)
+      unpin_page(b, node);
+  }
+  *promoted = t - 1;
+  return status;
+}
 
-  btree_status status =
-      insert_key(b, b->root, new_key, &promo_key, &r_child, &promoted);
+btree_status b_insert_batch(b_tree_buf *b, io_buf *data, data_record *d,
+                            u32 *rrns, size_t n) {
+  if (!b || !data || (n > 0 && (!d || !rrns)))
+    return BTREE_ERROR_INVALID_PAGE;
+  if (n == 0)
+    return BTREE_SUCCESS;
 
-  if (status < 0) {
-    return status;
+  // a level takes the keys of one page and at most one sibling per key
+  size_t cap = page_capacity(b);
+  size_t room = n + 2 * cap + 2;
+  key *keys = malloc(sizeof(key) * n);
+  u32 *rows = malloc(sizeof(u32) * n);
+  key *held = malloc(sizeof(key) * cap);
+  key *merged = malloc(sizeof(key) * room);
+  u32 *merged_children = malloc(sizeof(u32) * room);
+  key *promo = malloc(sizeof(key) * room);
+  u32 *promo_children = malloc(sizeof(u32) * room);
+  if (!keys || !rows || !held || !merged || !merged_children || !promo ||
+      !promo_children) {
+    free(keys);
+    free(rows);
+    free(held);
+    free(merged);
+    free(merged_children);
+    free(promo);
+    free(promo_children);
+    return BTREE_ERROR_MEMORY;
   }
 
-  if (promoted) {
-    page *new_root = alloc_page();
-    if (!new_root)
-      return BTREE_ERROR_MEMORY;
+  // keys sort by plate alone, so each carries its row through the sort;
+  // rows[i] is then the row of keys[i], or NULL_RRN once it is skipped
+  for (size_t i = 0; i < n; i++)
+    populate_key(&keys[i], &d[i], (u32)i);
+  qsort(keys, n, sizeof(key), compare_keys);
+  for (size_t i = 0; i < n; i++) {
+    rows[i] = keys[i].data_register_rrn;
+    keys[i].data_register_rrn = rrns[rows[i]];
+  }
+  unsettle(b);
+
+  // the whole batch is redone after a crash or not at all
+  pthread_rwlock_wrlock(&b->latch);
+  btree_status status = wal_append(b->wal, WAL_BEGIN, NULL_RRN, NULL, 0);
+  size_t i = 0;
+  if (!b->root && status == BTREE_SUCCESS) {
+    status = insert_key(b, keys[0]);
+    i = 1;
+  }
+
+  // one descent per leaf: every key below the leaf's upper bound is merged
+  // in, then the pages that overflow are split along the path in one go
+  while (i < n && status >= 0) {
+    tree_path path;
+    status = descend(b, keys[i], &path);
+    if (status == BTREE_FOUND_KEY) {
+      if (DEBUG)
+        printf("@Duplicate key %s skipped on batch insert\n", keys[i].id);
+      release_path(b, &path);
+      status = BTREE_SUCCESS;
+      rows[i++] = NULL_RRN;
+      continue;
+    }
+    if (status < 0)
+      break;
 
-    new_root->rrn = get_free_rrn(b->i);
-    if (new_root->rrn < 0) {
-      free(new_root);
-      return BTREE_ERROR_IO;
+    key *bound = path_bound(&path);
+    page *leaf = path.pages[path.depth - 1];
+    unpack_keys(leaf, held);
+    int m = 0, a = 0;
+    while (a < leaf->keys_num ||
+           (i < n && (!bound || compare_key(&keys[i], bound) < 0))) {
+      bool from_batch =
+          i < n && (!bound || compare_key(&keys[i], bound) < 0) &&
+          (a == leaf->keys_num || compare_key(&keys[i], &held[a]) <= 0);
+      if (!from_batch) {
+        merged[m++] = held[a++];
+      } else if ((a < leaf->keys_num &&
+                  compare_key(&keys[i], &held[a]) == 0) ||
+                 (m > 0 && compare_key(&keys[i], &merged[m - 1]) == 0)) {
+        if (DEBUG)
+          printf("@Duplicate key %s skipped on batch insert\n", keys[i].id);
+        rows[i++] = NULL_RRN;
+      } else {
+        merged[m++] = keys[i++];
+      }
+    }
+
+    int promoted = 0;
+    status = spread_page(b, leaf, merged, NULL, m, promo, promo_children,
+                         &promoted);
+
+    for (int l = path.depth - 2; l >= 0 && promoted > 0 && status >= 0; l--) {
+      page *p = path.pages[l];
+      int slot = path.slots[l];
+      u32 *children = page_children(b, p);
+
+      unpack_keys(p, held);
+      memcpy(merged, held, sizeof(key) * slot);
+      memcpy(merged + slot, promo, sizeof(key) * promoted);
+      memcpy(merged + slot + promoted, held + slot,
+             sizeof(key) * (p->keys_num - slot));
+      memcpy(merged_children, children, sizeof(u32) * (slot + 1));
+      memcpy(merged_children + slot + 1, promo_children,
+             sizeof(u32) * promoted);
+      memcpy(merged_children + slot + 1 + promoted, children + slot + 1,
+             sizeof(u32) * (p->child_num - slot - 1));
+
+      status = spread_page(b, p, merged, merged_children,
+                           p->keys_num + promoted, promo, promo_children,
+                           &promoted);
     }
 
-    new_root->leaf = false;
-    new_root->keys[0] = promo_key;
-    new_root->keys_num = 1;
-    new_root->children[0] = b->root->rrn;
-    new_root->children[1] = r_child->rrn;
-    new_root->child_num = 2;
+    // the root split: grow new roots until one holds every separator
+    while (promoted > 0 && status >= 0) {
+      page *root = new_page(b, alloc_rrn(b));
+      if (!root) {
+        status = BTREE_ERROR_MEMORY;
+        break;
+      }
+      root->leaf = false;
+      root->level = b->root->level + 1;
+      memcpy(merged, promo, sizeof(key) * promoted);
+      merged_children[0] = b->root->rrn;
+      memcpy(merged_children + 1, promo_children, sizeof(u32) * promoted);
+
+      status = spread_page(b, root, merged, merged_children, promoted, promo,
+                           promo_children, &promoted);
+      set_root(b, root);
+      unpin_page(b, root);
+      if (status >= 0)
+        status = write_root_rrn(b, root->rrn);
+    }
 
-    b->root = new_root;
+    release_path(b, &path);
+  }
+  btree_status logged = wal_append(b->wal, WAL_END, NULL_RRN, NULL, 0);
+  pthread_rwlock_unlock(&b->latch);
+
+  free(keys);
+  free(held);
+  free(merged);
+  free(merged_children);
+  free(promo);
+  free(promo_children);
+  if (status >= 0 && logged < 0)
+    status = logged;
+  status = commit(b, status < 0 ? status : BTREE_SUCCESS);
+
+  // right after the group commits, the rows it added, and only those, go
+  // into the secondary indexes
+  for (size_t i = 0; i < n && status == BTREE_SUCCESS; i++) {
+    if (rows[i] != NULL_RRN)
+      status = secondary_insert(b, &d[rows[i]], rrns[rows[i]]);
+  }
+  free(rows);
+  settle(b);
+  return status;
+}
 
-    btree_status write_status = write_root_rrn(b, b->root->rrn);
-    if (write_status < 0)
-      return write_status;
+// bytes the separator between keys[i - 1] and keys[i] keeps
+static int separator_len(const key *keys, int i) {
+  bool plates = all_plates(keys + i - 1, 2);
+  return shared_bytes(key_value(&keys[i - 1], plates),
+                      key_value(&keys[i], plates), TAMANHO_PLACA) + 1;
+}
 
-    write_status = write_index_record(b, b->root);
-    if (write_status < 0)
-      return write_status;
+// where n sorted keys are cut into two pages that both fit, as near the middle
+// as possible: a leaf keeps keys[0..split) and an internal page hands
+// keys[split] up; -1 when no cut fits. A leaf may cut up to a sixteenth of
+// its keys off the middle where the separator comes out shorter
+static int split_point(b_tree_buf *b, const key *keys, int n, bool leaf) {
+  int last = leaf ? n - 1 : n - 2;
+  int slack = leaf ? n / 16 : 0, best = -1;
+  for (int d = 0; n / 2 - d >= 1 || n / 2 + d <= last; d++) {
+    if (best >= 0 && d > slack)
+      break;
+    for (int side = d ? -1 : 1; side <= 1; side += 2) {
+      int split = n / 2 + side * d;
+      if (split < 1 || split > last)
+        continue;
+      bool fit = leaf ? keys_fit(b, keys, split, 0) &&
+                            keys_fit(b, keys + split, n - split, 0)
+                      : keys_fit(b, keys, split, split + 1) &&
+                            keys_fit(b, keys + split + 1, n - split - 1,
+                                     n - split);
+      if (fit && (best < 0 || (leaf && separator_len(keys, split) <
+                                           separator_len(keys, best))))
+        best = split;
+    }
   }
-
-  return BTREE_SUCCESS;
+  return best;
 }
 
 btree_status b_split(b_tree_buf *b, page *p, page **r_child, key *promo_key,
                      key *incoming_key, bool *promoted) {
   if (!b || !p || !r_child || !promo_key || !incoming_key)
     return BTREE_ERROR_INVALID_PAGE;
+  if (shadow_page(b, p) < 0)
+    return BTREE_ERROR_MEMORY;
 
-  key temp_keys[ORDER];
-  u16 temp_children[ORDER + 1];
-
-  memset(temp_keys, 0, sizeof(temp_keys));
-  memset(temp_children, 0xFF, sizeof(temp_children));
-
-  for (int i = 0; i < p->keys_num; i++) {
-    temp_keys[i] = p->keys[i];
-  }
+  int n = p->keys_num, c = p->child_num;
+  scratch *sc = take_scratch(b);
+  if (!sc)
+    return BTREE_ERROR_MEMORY;
+  key *temp_keys = sc->keys;
+  u32 *temp_children = sc->children;
 
-  if (!p->leaf) {
-    for (int i = 0; i <= p->child_num; i++) {
-      temp_children[i] = p->children[i];
-    }
-  }
+  unpack_keys(p, temp_keys);
+  memcpy(temp_children, page_children(b, p), sizeof(u32) * c);
 
-  int pos = p->keys_num - 1;
-  while (pos >= 0 && strcmp(temp_keys[pos].id, incoming_key->id) > 0) {
+  int pos = n - 1;
+  while (pos >= 0 && compare_key(&temp_keys[pos], incoming_key) > 0) {
     temp_keys[pos + 1] = temp_keys[pos];
     if (!p->leaf) {
       temp_children[pos + 2] = temp_children[pos + 1];
@@ -460,305 +2186,453 @@ btree_status b_split(b_tree_buf *b, page *p, page **r_child, key *promo_key,
   }
 
   temp_keys[pos + 1] = *incoming_key;
+  n++;
   if (!p->leaf && *r_child) {
     temp_children[pos + 2] = (*r_child)->rrn;
+    c++;
   }
 
-  page *new_page = alloc_page();
-  if (!new_page)
-    return BTREE_ERROR_MEMORY;
-
-  new_page->rrn = get_free_rrn(b->i);
-  if (new_page->rrn == (u16)-1) {
-    free(new_page);
-    return BTREE_ERROR_IO;
+  int split = split_point(b, temp_keys, n, p->leaf);
+  if (split < 0) {
+    give_scratch(b, sc);
+    puts("!!Error: keys do not fit in two pages");
+    return BTREE_ERROR_PAGE_FULL;
   }
 
-  int split = (ORDER - 1) / 2;
+  u32 new_rrn = alloc_rrn(b);
+  page *right = new_rrn == NULL_RRN ? NULL : new_page(b, new_rrn);
+  if (!right) {
+    give_scratch(b, sc);
+    return new_rrn == NULL_RRN ? BTREE_ERROR_IO : BTREE_ERROR_MEMORY;
+  }
 
+  right->leaf = p->leaf;
+  *promo_key = p->leaf ? separator(&temp_keys[split - 1], &temp_keys[split])
+                       : temp_keys[split];
   if (p->leaf) {
-    p->keys_num = split + 1;
-    new_page->keys_num = ORDER - (split + 1);
-    new_page->leaf = true;
-
-    for (int i = 0; i < p->keys_num; i++) {
-      p->keys[i] = temp_keys[i];
-    }
-
-    for (int i = 0; i < new_page->keys_num; i++) {
-      new_page->keys[i] = temp_keys[i + split + 1];
-    }
-
-    new_page->next_leaf = p->next_leaf;
-    p->next_leaf = new_page->rrn;
-
-    *promo_key = new_page->keys[0];
+    pack_page(b, p, temp_keys, split, NULL, 0);
+    pack_page(b, right, temp_keys + split, n - split, NULL, 0);
   } else {
-    p->keys_num = split;
-    new_page->keys_num = ORDER - split - 1;
-    new_page->leaf = false;
-
-    for (int i = 0; i < p->keys_num; i++) {
-      p->keys[i] = temp_keys[i];
-    }
-
-    *promo_key = temp_keys[split];
-
-    for (int i = 0; i < new_page->keys_num; i++) {
-      new_page->keys[i] = temp_keys[i + split + 1];
-    }
-
-    for (int i = 0; i <= p->keys_num; i++) {
-      p->children[i] = temp_children[i];
-    }
+    pack_page(b, p, temp_keys, split, temp_children, split + 1);
+    pack_page(b, right, temp_keys + split + 1, n - split - 1,
+              temp_children + split + 1, c - split - 1);
+  }
 
-    for (int i = 0; i <= new_page->keys_num; i++) {
-      new_page->children[i] = temp_children[i + split + 1];
-    }
+  // right takes over the upper part of p's range and its place in the level
+  right->level = p->level;
+  right->high = p->high;
+  right->next_leaf = p->next_leaf;
+  p->high = *promo_key;
+  p->next_leaf = right->rrn;
 
-    p->child_num = p->keys_num + 1;
-    new_page->child_num = new_page->keys_num + 1;
-  }
+  give_scratch(b, sc);
 
   btree_status status;
-  if ((status = write_index_record(b, p)) != BTREE_SUCCESS) {
-    free(new_page);
+  if ((status = write_index_record(b, right)) != BTREE_SUCCESS) {
+    unpin_page(b, right);
     return status;
   }
 
-  if ((status = write_index_record(b, new_page)) != BTREE_SUCCESS) {
-    free(new_page);
+  if ((status = write_index_record(b, p)) != BTREE_SUCCESS) {
+    unpin_page(b, right);
     return status;
   }
 
-  *r_child = new_page;
+  *r_child = right;
   *promoted = true;
 
   return BTREE_PROMOTION;
 }
-btree_status insert_key(b_tree_buf *b, page *p, key k, key *promo_key,
-                        page **r_child, bool *promoted) {
-  if (!b || !promo_key || !p)
-    return BTREE_ERROR_INVALID_PAGE;
-
-  int pos;
-  btree_status status = search_in_page(p, k, &pos);
-  if (status == BTREE_FOUND_KEY)
-    return BTREE_ERROR_DUPLICATE;
 
-  if (!p->leaf) {
-    page *child = load_page(b, p->children[pos]);
-    if (!child)
-      return BTREE_ERROR_IO;
+// takes the key at pos out of leaf p and marks its data record as deleted;
+// the record as it was is left in gone, with its rrn in gone_rrn, for the
+// secondary indexes to drop once the latches are released
+static btree_status drop_key(b_tree_buf *b, page *p, int pos, io_buf *data,
+                             free_rrn_list *ld, data_record *gone,
+                             u32 *gone_rrn) {
+  if (DEBUG)
+    printf("@Removing key from leaf page RRN: %u at position: %d\n", p->rrn,
+           pos);
+  btree_status status = shadow_page(b, p);
+  if (status < 0)
+    return status;
+  u32 data_rrn = page_key(p, pos).data_register_rrn;
 
-    key temp_key;
-    page *temp_child = NULL;
-    status = insert_key(b, child, k, &temp_key, &temp_child, promoted);
+  // the keys left still share the prefix and fit the width
+  u8 *s = page_slot(p, pos);
+  memmove(s, s + slot_size(p), (p->keys_num - pos - 1) * slot_size(p));
+  p->keys_num--;
 
-    if (child != b->root && !queue_search(b->q, child->rrn)) {
-      clear_page(child);
-    }
+  // secondary indexes leave the data file alone
+  if (data_rrn != NULL_RRN && data) {
+    if (load_data_record_into(data, data_rrn, gone) == IO_SUCCESS)
+      *gone_rrn = data_rrn;
 
-    if (status == BTREE_PROMOTION) {
-      k = temp_key;
-      *r_child = temp_child;
-      if (p->keys_num < ORDER - 1) {
-        *promoted = false;
-        status = insert_in_page(p, k, temp_child, pos);
-        if (status == BTREE_INSERTED_IN_PAGE) {
-          return write_index_record(b, p);
-        }
-        return status;
-      }
-      return b_split(b, p, r_child, promo_key, &k, promoted);
-    }
-    return status;
+    data_record empty_record;
+    memset(&empty_record, '*', sizeof(data_record));
+    write_data_record(data, &empty_record, data_rrn);
+    if (ld)
+      insert_list(ld, data_rrn);
   }
+  return write_index_record(b, p);
+}
 
-  if (p->keys_num < ORDER - 1) {
-    *promoted = false;
-    status = insert_in_page(p, k, NULL, pos);
-    if (status == BTREE_INSERTED_IN_PAGE) {
-      return write_index_record(b, p);
-    }
-    return status;
-  }
+// removes k under the shared tree latch when its leaf keeps enough keys, so
+// no other page changes; false hands the removal over to remove_key
+static bool remove_in_leaf(b_tree_buf *b, io_buf *data, free_rrn_list *ld,
+                           key k, data_record *gone, u32 *gone_rrn,
+                           btree_status *status) {
+  page *leaf = find_page(b, k, 0, true, NULL, NULL);
+  if (!leaf)
+    return false;
+
+  int pos;
+  bool found = search_in_page(leaf, k, &pos) == BTREE_FOUND_KEY;
+  bool done = !found || !page_short(b, leaf, 1);
+  if (!found)
+    *status = BTREE_NOT_FOUND_KEY;
+  else if (done)
+    *status = drop_key(b, leaf, pos, data, ld, gone, gone_rrn);
+  unlatch_page(b, leaf);
+  return done;
+}
 
-  return b_split(b, p, r_child, promo_key, &k, promoted);
+static btree_status remove_key(b_tree_buf *b, io_buf *data,
+                               free_rrn_list *ld, key k, data_record *gone,
+                               u32 *gone_rrn) {
+  tree_path path;
+  btree_status status = descend(b, k, &path);
+  if (status != BTREE_FOUND_KEY) {
+    if (DEBUG)
+      puts("@Key not found");
+    release_path(b, &path);
+    return status < 0 ? status : BTREE_NOT_FOUND_KEY;
+  }
+
+  page *p = path.pages[path.depth - 1];
+  status = drop_key(b, p, path.slots[path.depth - 1], data, ld, gone,
+                    gone_rrn);
+  // the last key is gone: the root leaf is freed and the header left
+  // without a root, in the group of the removal, as grow_root does it
+  if (status >= 0 && p == b->root && p->keys_num == 0) {
+    release_path(b, &path);
+    release_rrn(b, p->rrn);
+    drop_page(b, p);
+    set_root(b, NULL);
+    status = write_root_rrn(b, NULL_RRN);
+    return status < 0 ? status : BTREE_SUCCESS;
+  }
+
+  if (status >= 0)
+    status = handle_underflow(b, &path);
+  release_path(b, &path);
+  return status < 0 ? status : BTREE_SUCCESS;
 }
 
-btree_status b_remove(b_tree_buf *b, io_buf *data, char *key_id) {
-  if (!b || !b->root || !data || !key_id)
+btree_status b_remove(b_tree_buf *b, io_buf *data, free_rrn_list *ld,
+                      char *key_id) {
+  if (!b || !data || !key_id)
     return BTREE_ERROR_INVALID_PAGE;
 
   if (DEBUG)
     printf("@Removing key: %s\n", key_id);
 
-  u16 pos;
-  page *p = b_search(b, key_id, &pos);
-  if (!p || strcmp(p->keys[pos].id, key_id) != 0) {
-    if (DEBUG)
-      puts("@Key not found");
-    return BTREE_NOT_FOUND_KEY;
-  }
+  key k;
+  memset(&k, 0, sizeof(key));
+  memcpy(k.id, key_id, strnlen(key_id, TAMANHO_PLACA - 1));
+  return b_remove_key(b, data, ld, k);
+}
 
-  if (p->leaf) {
-    if (DEBUG)
-      printf("@Removing key from leaf page RRN: %hu at position: %hu\n", p->rrn,
-             pos);
-    u16 data_rrn = p->keys[pos].data_register_rrn;
-
-    for (int i = pos; i < p->keys_num - 1; i++)
-      p->keys[i] = p->keys[i + 1];
-    p->keys_num--;
-
-    if (data_rrn != (u16)-1) {
-      if (fseek(data->fp,
-                data->hr->header_size + (data_rrn * sizeof(data_record)),
-                SEEK_SET) == 0) {
-        data_record empty_record;
-        memset(&empty_record, '*', sizeof(data_record));
-        fwrite(&empty_record, sizeof(data_record), 1, data->fp);
-        fflush(data->fp);
-        insert_list(b->i, data_rrn);
-      }
-    }
+// removes k; without data, as for secondary indexes, the record it leads to
+// is neither erased nor freed
+btree_status b_remove_key(b_tree_buf *b, io_buf *data, free_rrn_list *ld,
+                          key k) {
+  if (!b)
+    return BTREE_ERROR_INVALID_PAGE;
 
-    if (p == b->root && p->keys_num == 0) {
-      clear_page(b->root);
-      b->root = NULL;
-      return BTREE_SUCCESS;
+  btree_status status = BTREE_SUCCESS;
+  data_record gone;
+  u32 gone_rrn = NULL_RRN;
+  unsettle(b);
+  pthread_rwlock_rdlock(&b->latch);
+  bool done = remove_in_leaf(b, data, ld, k, &gone, &gone_rrn, &status);
+  pthread_rwlock_unlock(&b->latch);
+
+  // pages are merged or rebalanced with every other thread kept out, and
+  // logged as one group so a crash never leaves half a rebalance
+  if (!done) {
+    pthread_rwlock_wrlock(&b->latch);
+    status = wal_append(b->wal, WAL_BEGIN, NULL_RRN, NULL, 0);
+    if (status == BTREE_SUCCESS)
+      status = remove_key(b, data, ld, k, &gone, &gone_rrn);
+    btree_status logged = wal_append(b->wal, WAL_END, NULL_RRN, NULL, 0);
+    pthread_rwlock_unlock(&b->latch);
+    if (status >= 0 && logged < 0)
+      status = logged;
+  }
+  status = commit(b, status);
+
+  // the secondary indexes are only touched once b is unlatched
+  if (status >= 0 && gone_rrn != NULL_RRN) {
+    btree_status dropped = secondary_remove(b, &gone, gone_rrn);
+    if (dropped < 0) {
+      puts("!!Error: secondary indexes still hold a removed record");
+      status = dropped;
     }
+  }
+  settle(b);
+  return status;
+}
 
-    btree_status status = write_index_record(b, p);
-    if (status < 0)
-      return status;
-
-    if (p != b->root && p->keys_num < (ORDER - 1) / 2) {
-      if (DEBUG)
-        puts("@Leaf underflow detected");
+btree_status handle_underflow(b_tree_buf *b, tree_path *path) {
+  if (!b || !path || path->depth == 0)
+    return BTREE_ERROR_INVALID_PAGE;
 
-      page *left = get_sibling(b, p, true);
-      if (left && left->keys_num > (ORDER - 1) / 2) {
-        return redistribute(b, left, p, true);
-      }
+  btree_status status = BTREE_SUCCESS;
 
-      page *right = get_sibling(b, p, false);
-      if (right && right->keys_num > (ORDER - 1) / 2) {
-        return redistribute(b, right, p, false);
-      }
+  for (int level = path->depth - 1; level > 0 && status >= 0; level--) {
+    page *p = path->pages[level];
+    if (!page_short(b, p, 0))
+      break;
 
-      if (left) {
-        return merge(b, left, p);
-      } else if (right) {
-        return merge(b, p, right);
-      }
+    if (DEBUG)
+      printf("@Underflow in page RRN: %u\n", p->rrn);
+
+    page *parent = path->pages[level - 1];
+    int slot = path->slots[level - 1];
+    u32 *children = page_children(b, parent);
+
+    // siblings that fit on one page merge however many keys they hold,
+    // otherwise one with keys to spare lends p one
+    page *left = slot > 0 ? load_page(b, children[slot - 1]) : NULL;
+    page *right = NULL;
+    status = left ? merge(b, parent, slot - 1, left, p) : BTREE_ERROR_PAGE_FULL;
+    if (status == BTREE_ERROR_PAGE_FULL && slot < parent->child_num - 1 &&
+        (right = load_page(b, children[slot + 1])))
+      status = merge(b, parent, slot, p, right);
+    if (status == BTREE_ERROR_PAGE_FULL && left && !page_short(b, left, 1))
+      status = redistribute(b, parent, slot, left, p, true);
+    else if (status == BTREE_ERROR_PAGE_FULL && right &&
+             !page_short(b, right, 1))
+      status = redistribute(b, parent, slot, right, p, false);
+    if (!left && !right)
+      status = BTREE_ERROR_IO;
+
+    unpin_page(b, left);
+    unpin_page(b, right);
+
+    // keys sharing less than the pages they move to can leave no room for
+    // them; the page then stays short of keys, which searches do not mind
+    if (status == BTREE_ERROR_PAGE_FULL) {
+      status = BTREE_SUCCESS;
+      break;
     }
-
-    return BTREE_SUCCESS;
   }
 
+  // a root left without separators hands over to its only child
+  page *root = path->pages[0];
+  if (status < 0 || root != b->root || root->leaf || root->keys_num > 0)
+    return status;
+
+  page *child = load_page(b, page_children(b, root)[0]);
+  if (!child)
+    return BTREE_ERROR_IO;
+
   if (DEBUG)
-    puts("@Key found in internal node - not removing");
-  return BTREE_SUCCESS;
+    printf("@Root RRN: %u collapsed into RRN: %u\n", root->rrn, child->rrn);
+
+  status = shadow_page(b, root);
+  if (status < 0) {
+    unpin_page(b, child);
+    return status;
+  }
+  release_rrn(b, root->rrn);
+  drop_page(b, root);
+  set_root(b, child);
+  unpin_page(b, child);
+  return write_root_rrn(b, child->rrn);
 }
 
-btree_status redistribute(b_tree_buf *b, page *donor, page *receiver,
-                          bool from_left) {
-  if (!b || !donor || !receiver)
+btree_status redistribute(b_tree_buf *b, page *parent, int slot, page *donor,
+                          page *receiver, bool from_left) {
+  if (!b || !parent || !donor || !receiver)
     return BTREE_ERROR_INVALID_PAGE;
+  if (shadow_page(b, donor) < 0 || shadow_page(b, receiver) < 0 ||
+      shadow_page(b, parent) < 0)
+    return BTREE_ERROR_MEMORY;
 
+  scratch *sc = take_scratch(b);
+  if (!sc)
+    return BTREE_ERROR_MEMORY;
+  int cap = sc->cap;
+  key *keys = sc->keys;
+  u32 *children = sc->children;
+
+  key *p_keys = keys, *d_keys = keys + cap, *r_keys = keys + 2 * cap;
+  u32 *d_children = children, *r_children = children + cap + 1;
+  int dn = donor->keys_num, rn = receiver->keys_num;
+  int dc = donor->child_num, rc = receiver->child_num;
+  unpack_keys(parent, p_keys);
+  unpack_keys(donor, d_keys);
+  unpack_keys(receiver, r_keys);
+  memcpy(d_children, page_children(b, donor), sizeof(u32) * dc);
+  memcpy(r_children, page_children(b, receiver), sizeof(u32) * rc);
+
+  // leaves move a key and give the parent a new separator for it, internal
+  // pages rotate it through the separator between the two siblings
   if (from_left) {
-    for (int i = receiver->keys_num; i > 0; i--)
-      receiver->keys[i] = receiver->keys[i - 1];
-    receiver->keys[0] = donor->keys[donor->keys_num - 1];
-    donor->keys_num--;
-    receiver->keys_num++;
+    memmove(r_keys + 1, r_keys, sizeof(key) * rn);
+    if (receiver->leaf) {
+      r_keys[0] = d_keys[dn - 1];
+      p_keys[slot - 1] = separator(&d_keys[dn - 2], &r_keys[0]);
+    } else {
+      memmove(r_children + 1, r_children, sizeof(u32) * rc);
+      r_keys[0] = p_keys[slot - 1];
+      r_children[0] = d_children[dc - 1];
+      p_keys[slot - 1] = d_keys[dn - 1];
+      dc--;
+      rc++;
+    }
+    dn--;
+    rn++;
   } else {
-    receiver->keys[receiver->keys_num] = donor->keys[0];
-    receiver->keys_num++;
-
-    for (int i = 0; i < donor->keys_num - 1; i++) {
-      donor->keys[i] = donor->keys[i + 1];
+    if (receiver->leaf) {
+      r_keys[rn] = d_keys[0];
+    } else {
+      r_keys[rn] = p_keys[slot];
+      r_children[rc++] = d_children[0];
+      p_keys[slot] = d_keys[0];
+      memmove(d_children, d_children + 1, sizeof(u32) * (dc - 1));
+      dc--;
     }
-    donor->keys_num--;
-  }
+    rn++;
+    memmove(d_keys, d_keys + 1, sizeof(key) * (dn - 1));
+    dn--;
+    if (receiver->leaf)
+      p_keys[slot] = separator(&r_keys[rn - 1], &d_keys[0]);
+  }
+
+  // a separator sharing less with its neighbours may not fit the parent
+  btree_status status = BTREE_ERROR_PAGE_FULL;
+  if (keys_fit(b, p_keys, parent->keys_num, parent->child_num) &&
+      keys_fit(b, d_keys, dn, dc) && keys_fit(b, r_keys, rn, rc)) {
+    pack_page(b, parent, p_keys, parent->keys_num, page_children(b, parent),
+              parent->child_num);
+    pack_page(b, donor, d_keys, dn, d_children, dc);
+    pack_page(b, receiver, r_keys, rn, r_children, rc);
+    if (from_left)
+      donor->high = p_keys[slot - 1];
+    else
+      receiver->high = p_keys[slot];
+    status = BTREE_SUCCESS;
+  }
+  give_scratch(b, sc);
+  if (status < 0)
+    return status;
+
+  status = write_index_record(b, donor);
+  if (status < 0)
+    return status;
 
-  btree_status status = write_index_record(b, donor);
+  status = write_index_record(b, receiver);
   if (status < 0)
     return status;
 
-  return write_index_record(b, receiver);
+  return write_index_record(b, parent);
 }
 
-btree_status merge(b_tree_buf *b, page *left, page *right) {
-  if (!b || !left || !right)
+btree_status merge(b_tree_buf *b, page *parent, int slot, page *left,
+                   page *right) {
+  if (!b || !parent || !left || !right)
     return BTREE_ERROR_INVALID_PAGE;
+  if (shadow_page(b, left) < 0 || shadow_page(b, right) < 0 ||
+      shadow_page(b, parent) < 0)
+    return BTREE_ERROR_MEMORY;
 
-  for (int i = 0; i < right->keys_num; i++) {
-    left->keys[left->keys_num + i] = right->keys[i];
-  }
-  left->keys_num += right->keys_num;
+  // left takes its own keys, the separator and those of right
+  scratch *sc = take_scratch(b);
+  if (!sc)
+    return BTREE_ERROR_MEMORY;
+  int cap = sc->cap;
+  key *keys = sc->keys;
+  u32 *children = sc->children;
+
+  key *p_keys = keys, *l_keys = keys + cap;
+  u32 *p_children = children, *l_children = children + cap + 1;
+  int ln = left->keys_num, lc = left->child_num;
+  int pn = parent->keys_num, pc = parent->child_num;
+  unpack_keys(parent, p_keys);
+  unpack_keys(left, l_keys);
+  memcpy(p_children, page_children(b, parent), sizeof(u32) * pc);
+  memcpy(l_children, page_children(b, left), sizeof(u32) * lc);
+
+  // the separator comes down between the two halves of internal pages
+  if (!left->leaf)
+    l_keys[ln++] = p_keys[slot];
+  unpack_keys(right, l_keys + ln);
+  ln += right->keys_num;
+  memcpy(l_children + lc, page_children(b, right),
+         sizeof(u32) * right->child_num);
+  lc += right->child_num;
+
+  memmove(p_keys + slot, p_keys + slot + 1, sizeof(key) * (pn - slot - 1));
+  memmove(p_children + slot + 1, p_children + slot + 2,
+          sizeof(u32) * (pc - slot - 2));
+  pn--;
+  pc--;
+
+  // halves that share little may not fit one page; both stay as they are
+  btree_status status = BTREE_ERROR_PAGE_FULL;
+  if (pack_page(b, left, l_keys, ln, l_children, lc)) {
+    pack_page(b, parent, p_keys, pn, p_children, pc);
+    left->next_leaf = right->next_leaf;
+    left->high = right->high;
+    status = BTREE_SUCCESS;
+  }
+  give_scratch(b, sc);
+  if (status < 0)
+    return status;
 
-  left->next_leaf = right->next_leaf;
+  status = write_index_record(b, left);
+  if (status < 0)
+    return status;
 
-  btree_status status = write_index_record(b, left);
+  status = write_index_record(b, parent);
   if (status < 0)
     return status;
 
-  insert_list(b->i, right->rrn);
+  release_rrn(b, right->rrn);
+  drop_page(b, right);
 
   return BTREE_SUCCESS;
 }
 
-page *get_sibling(b_tree_buf *b, page *p, bool left) {
-  if (!b || !p || !b->root)
-    return NULL;
-
-  page *parent = find_parent(b, b->root, p);
-  if (!parent)
-    return NULL;
-
-  int pos;
-  for (pos = 0; pos <= parent->child_num; pos++) {
-    if (parent->children[pos] == p->rrn)
-      break;
-  }
-
-  if (left && pos > 0) {
-    return load_page(b, parent->children[pos - 1]);
-  } else if (!left && pos < parent->child_num - 1) {
-    return load_page(b, parent->children[pos + 1]);
-  }
-
-  return NULL;
-}
-
-void print_page(page *p) {
-  if (!p) {
+void print_page(b_tree_buf *b, page *p) {
+  if (!b || !p) {
     puts("!!Página nula");
     return;
   }
 
-  printf("RRN: %hu | Folha: %d | Chaves: %d | Filhos: %d\n", p->rrn, p->leaf,
+  printf("RRN: %u | Folha: %d | Chaves: %d | Filhos: %d\n", p->rrn, p->leaf,
          p->keys_num, p->child_num);
 
   printf("Chaves: ");
   for (int i = 0; i < p->keys_num; i++) {
-    printf("[%s]", p->keys[i].id);
+    key k = page_key(p, i);
+    printf("[%.*s]", TAMANHO_PLACA, k.id);
   }
   printf("\n");
 
   if (!p->leaf) {
     printf("RRNs filhos: ");
     for (int i = 0; i < p->child_num; i++) {
-      printf("%hu ", p->children[i]);
+      printf("%u ", page_children(b, p)[i]);
     }
     printf("\n");
   }
 
   if (p->leaf) {
-    printf("Próxima folha: %hu\n", p->next_leaf);
+    printf("Próxima folha: %u\n", p->next_leaf);
   }
 }
 
@@ -779,17 +2653,25 @@ int write_index_header(io_buf *io) {
     return BTREE_ERROR_INVALID_PAGE;
   }
 
-  size_t free_rrn_len = strlen(io->br->free_rrn_address) + 1;
-  io->br->header_size = sizeof(u16) * 3 + free_rrn_len;
+  io->br->header_size = index_header_size(io->br->free_rrn_address);
+  size_t free_rrn_len = io->br->header_size - INDEX_FIXED_HEADER;
+  char free_rrn_address[MAX_ADDRESS] = {0};
+  strncpy(free_rrn_address, io->br->free_rrn_address, MAX_ADDRESS - 1);
 
   fseek(io->fp, 0, SEEK_SET);
 
-  if (fwrite(&io->br->root_rrn, sizeof(u16), 1, io->fp) != 1) {
+  u32 magic = INDEX_MAGIC;
+  if (fwrite(&magic, sizeof(u32), 1, io->fp) != 1) {
+    puts("!!Error while writing magic");
+    return BTREE_ERROR_IO;
+  }
+
+  if (fwrite(&io->br->root_rrn, sizeof(u32), 1, io->fp) != 1) {
     puts("!!Error while writing root_rrn");
     return BTREE_ERROR_IO;
   }
 
-  if (fwrite(&io->br->page_size, sizeof(u16), 1, io->fp) != 1) {
+  if (fwrite(&io->br->page_size, sizeof(u32), 1, io->fp) != 1) {
     puts("!!Error while writing page_size");
     return BTREE_ERROR_IO;
   }
@@ -799,81 +2681,123 @@ int write_index_header(io_buf *io) {
     return BTREE_ERROR_IO;
   }
 
-  if (fwrite(io->br->free_rrn_address, free_rrn_len, 1, io->fp) != 1) {
+  if (fwrite(&io->br->order, sizeof(u16), 1, io->fp) != 1) {
+    puts("!!Error while writing order");
+    return BTREE_ERROR_IO;
+  }
+
+  if (fwrite(free_rrn_address, free_rrn_len, 1, io->fp) != 1) {
     puts("!!Error while writing free_rrn_address");
     return BTREE_ERROR_IO;
   }
 
   if (DEBUG) {
-    printf("@Successfully written on index: root_rrn: %hu, page_size: %hu, "
-           "size: %hu, "
+    printf("@Successfully written on index: root_rrn: %u, page_size: %u, "
+           "size: %hu, order: %hu, "
            "free_rrn_address: %s\n",
            io->br->root_rrn, io->br->page_size, io->br->header_size,
-           io->br->free_rrn_address);
+           io->br->order, io->br->free_rrn_address);
   }
 
   fflush(io->fp);
   return BTREE_SUCCESS;
 }
 
-void load_index_header(io_buf *io) {
+int load_index_header(io_buf *io) {
   if (!io || !io->fp) {
     puts("!!Invalid IO buffer or file pointer");
-    return;
+    return BTREE_ERROR_IO;
   }
 
   if (!io->br) {
     io->br = malloc(sizeof(index_header_record));
     if (!io->br) {
       puts("!!Memory allocation error");
-      return;
+      return BTREE_ERROR_MEMORY;
     }
     memset(io->br, 0, sizeof(index_header_record));
   }
 
   fseek(io->fp, 0, SEEK_SET);
 
-  if (fread(&io->br->root_rrn, sizeof(u16), 1, io->fp) != 1) {
-    puts("!!Error reading root_rrn");
-    return;
+  u32 magic;
+  if (fread(&magic, sizeof(u32), 1, io->fp) != 1) {
+    puts("!!Error reading magic");
+    return BTREE_ERROR_IO;
   }
 
-  if (fread(&io->br->page_size, sizeof(u16), 1, io->fp) != 1) {
-    puts("!!Error reading page_size");
-    return;
+  index_header_record h;
+  if (fread(&h.root_rrn, sizeof(u32), 1, io->fp) != 1 ||
+      fread(&h.page_size, sizeof(u32), 1, io->fp) != 1 ||
+      fread(&h.header_size, sizeof(u16), 1, io->fp) != 1 ||
+      fread(&h.order, sizeof(u16), 1, io->fp) != 1) {
+    puts("!!Error reading root_rrn, page_size, size or order");
+    return BTREE_ERROR_IO;
   }
 
-  if (fread(&io->br->header_size, sizeof(u16), 1, io->fp) != 1) {
-    puts("!!Error reading size");
-    return;
+  printf("root_rrn: %u, page_size: %u, size: %hu, order: %hu\n", h.root_rrn,
+         h.page_size, h.header_size, h.order);
+
+  if (magic == OLD_INDEX_MAGIC) {
+    puts("!!Error: index pages have no high keys, run B-PLUS-TREE_migrate");
+    io->br->page_size = 0;
+    return BTREE_ERROR_INVALID_PAGE;
+  }
+  if (magic == PLAIN_INDEX_MAGIC) {
+    puts("!!Error: index pages hold full keys, run B-PLUS-TREE_migrate");
+    io->br->page_size = 0;
+    return BTREE_ERROR_INVALID_PAGE;
+  }
+  if (magic == PACKED_INDEX_MAGIC) {
+    puts("!!Error: internal index pages hold data rrns, run "
+         "B-PLUS-TREE_migrate");
+    io->br->page_size = 0;
+    return BTREE_ERROR_INVALID_PAGE;
+  }
+  if (magic == SLIM_INDEX_MAGIC) {
+    puts("!!Error: index pages store no plate codes, run B-PLUS-TREE_migrate");
+    io->br->page_size = 0;
+    return BTREE_ERROR_INVALID_PAGE;
   }
 
-  printf("root_rrn: %hu, page_size: %hu, size: %hu\n", io->br->root_rrn,
-         io->br->page_size, io->br->header_size);
+  // indexes with 16-bit rrns have no magic and go through B-PLUS-TREE_migrate
+  if (magic != INDEX_MAGIC || !valid_order(h.order) ||
+      h.page_size != order_page_size(h.order) ||
+      h.header_size <= INDEX_FIXED_HEADER || h.header_size > MAX_ADDRESS) {
+    puts("!!Error: index file has an unknown page layout");
+    io->br->page_size = 0;
+    return BTREE_ERROR_INVALID_PAGE;
+  }
+  io->br->root_rrn = h.root_rrn;
+  io->br->page_size = h.page_size;
+  io->br->header_size = h.header_size;
+  io->br->order = h.order;
 
-  size_t rrn_len = io->br->header_size - (3 * sizeof(u16));
+  size_t rrn_len = io->br->header_size - INDEX_FIXED_HEADER;
 
-  io->br->free_rrn_address = malloc(rrn_len + 1);
   if (!io->br->free_rrn_address) {
-    puts("!!Memory allocation error for free_rrn_address");
-    return;
+    io->br->free_rrn_address = malloc(MAX_ADDRESS);
+    if (!io->br->free_rrn_address) {
+      puts("!!Memory allocation error for free_rrn_address");
+      return BTREE_ERROR_MEMORY;
+    }
   }
 
   if (fread(io->br->free_rrn_address, rrn_len, 1, io->fp) != 1) {
     puts("!!Error reading free_rrn_address");
-    free(io->br->free_rrn_address);
-    io->br->free_rrn_address = NULL;
-    return;
+    io->br->free_rrn_address[0] = '\0';
+    return BTREE_ERROR_IO;
   }
   io->br->free_rrn_address[rrn_len] = '\0';
 
   if (DEBUG) {
     puts("@Index header Record Loaded");
-    printf("-->index_header: root_rrn: %hu page_size: %hu size: %hu "
-           "free_rrn_list: %s\n",
+    printf("-->index_header: root_rrn: %u page_size: %u size: %hu "
+           "order: %hu free_rrn_list: %s\n",
            io->br->root_rrn, io->br->page_size, io->br->header_size,
-           io->br->free_rrn_address);
+           io->br->order, io->br->free_rrn_address);
   }
+  return BTREE_SUCCESS;
 }
 
 btree_status write_index_record(b_tree_buf *b, page *p) {
@@ -883,35 +2807,66 @@ btree_status write_index_record(b_tree_buf *b, page *p) {
   if (DEBUG) {
     puts("////////");
     puts("@Writting following page: ");
-    print_page(p);
+    print_page(b, p);
   }
 
-  int byte_offset = b->io->br->header_size + (b->io->br->page_size * p->rrn);
+  // the page image is logged under the latch its writer holds, so the log
+  // has every page's images in the order they were made
+  btree_status status =
+      wal_append(b->wal, WAL_PAGE, p->rrn, p, b->io->br->page_size);
+  if (status != BTREE_SUCCESS)
+    return status;
+
+  // pages cached in the pool reach the disk on eviction or on b_flush, and
+  // mapped pages, only used without a log, are already modified in place
+  if (set_dirty(b, p, wal_tail(b->wal)) || in_map(b->io, p))
+    return BTREE_SUCCESS;
+
+  // a page written through must not reach the disk before its record
+  status = wal_commit(b->wal);
+  if (status == BTREE_SUCCESS)
+    status = write_page(b, p);
+  if (status == BTREE_SUCCESS)
+    fflush(b->io->fp);
+  return status;
+}
 
-  if (fseek(b->io->fp, byte_offset, SEEK_SET)) {
-    puts("!!Error: could not fseek");
+btree_status write_page(b_tree_buf *b, page *p) {
+  if (!b || !b->io || !b->io->fp || !p)
     return BTREE_ERROR_IO;
-  }
 
-  size_t written = fwrite(p, b->io->br->page_size, 1, b->io->fp);
-  if (written != 1) {
+  u64 byte_offset = page_offset(b, p->rrn);
+
+  // pages go around stdio so readers using pread always see them
+  ssize_t written = pwrite(fileno(b->io->fp), p, b->io->br->page_size,
+                           byte_offset);
+  if (written != (ssize_t)b->io->br->page_size) {
     puts("!!Error: could not write page");
     return BTREE_ERROR_IO;
   }
 
-  fflush(b->io->fp);
-
   if (DEBUG) {
-    printf("@Successfully wrote page %hu at offset %d\n", p->rrn, byte_offset);
-  }
-
-  if (!queue_search(b->q, p->rrn)) {
-    push_page(b, p);
+    printf("@Successfully wrote page %u at offset %lu\n", p->rrn,
+           (unsigned long)byte_offset);
   }
 
   return BTREE_SUCCESS;
 }
 
+btree_status b_flush(b_tree_buf *b) {
+  if (!b || !b->io || !b->io->fp)
+    return BTREE_ERROR_IO;
+
+  pthread_rwlock_wrlock(&b->latch);
+  btree_status status = flush_index(b);
+  pthread_rwlock_unlock(&b->latch);
+  for (int f = 0; f < SECONDARY_FIELDS && status >= 0; f++) {
+    if (b->secondary[f])
+      status = b_flush(b->secondary[f]);
+  }
+  return status;
+}
+
 void create_index_file(io_buf *io, const char *file_name) {
   if (!io || !file_name) {
     puts("!!Invalid io buffer or file name");
@@ -971,9 +2926,18 @@ void create_index_file(io_buf *io, const char *file_name) {
     strcpy(dot, ".hlp");
   }
 
-  load_index_header(io);
+  int status = load_index_header(io);
+  if (status == BTREE_ERROR_INVALID_PAGE) {
+    printf("!!Error: run B-PLUS-TREE_migrate on %s or remove it to rebuild "
+           "the index\n",
+           io->address);
+    fclose(io->fp);
+    io->fp = NULL;
+    return;
+  }
 
-  if (strcmp(io->br->free_rrn_address, list_name) != 0) {
+  // an existing index keeps the list named in its header, even if renamed
+  if (status != BTREE_SUCCESS) {
     strcpy(io->br->free_rrn_address, list_name);
     populate_index_header(io->br, list_name);
     write_index_header(io);
@@ -984,46 +2948,22 @@ void create_index_file(io_buf *io, const char *file_name) {
   }
 }
 
-page *alloc_page(void) {
+page *alloc_page(b_tree_buf *b) {
   page *p = NULL;
-  if (posix_memalign((void **)&p, sizeof(void *), sizeof(page)) != 0) {
+  if (posix_memalign((void **)&p, sizeof(void *), b->io->br->page_size) != 0) {
     puts("!!Erro: falha na alocação da página");
     return NULL;
   }
 
-  memset(p, 0, sizeof(page));
-  p->leaf = true;
-  p->next_leaf = (u16)-1;
-
-  for (int i = 0; i < ORDER; i++) {
-    p->children[i] = (u16)-1;
-  }
-
+  init_page(b, p);
   return p;
 }
 
-void clear_all_pages(void) {
-  if (!g_allocated)
-    return;
-
-  if (DEBUG)
-    puts("clearing pages:");
-
-  for (int i = 0; i < g_n; i++) {
-    if (g_allocated[i]) {
-      if (DEBUG)
-        printf("%hu\t", g_allocated[i]->rrn);
-      free(g_allocated[i]);
-      g_allocated[i] = NULL;
-    }
-  }
-
-  free(g_allocated);
-  g_allocated = NULL;
-  g_n = 0;
-
-  if (DEBUG)
-    puts("");
+void init_page(b_tree_buf *b, page *p) {
+  memset(p, 0, b->io->br->page_size);
+  p->leaf = true;
+  p->next_leaf = NULL_RRN;
+  set_max_key(&p->high);
 }
 
 void clear_page(page *page) {
@@ -1035,55 +2975,3 @@ void clear_page(page *page) {
   }
   puts("Error while freeing page");
 }
-
-void track_page(page *p) {
-  if (!p)
-    return;
-
-  if (!g_allocated) {
-    g_allocated = malloc(sizeof(page *));
-    if (!g_allocated)
-      return;
-    g_n = 0;
-  } else {
-    page **tmp = realloc(g_allocated, sizeof(page *) * (g_n + 1));
-    if (!tmp)
-      return;
-    g_allocated = tmp;
-  }
-
-  g_allocated[g_n++] = p;
-}
-
-page *find_parent(b_tree_buf *b, page *current, page *target) {
-  if (!b || !current || !target)
-    return NULL;
-
-  if (target == b->root)
-    return NULL;
-
-  for (int i = 0; i < current->child_num; i++) {
-    if (current->children[i] == target->rrn) {
-      return current;
-    }
-  }
-
-  if (!current->leaf) {
-    for (int i = 0; i < current->child_num; i++) {
-      page *child = load_page(b, current->children[i]);
-      if (!child)
-        continue;
-
-      page *result = find_parent(b, child, target);
-
-      if (child != b->root && !queue_search(b->q, child->rrn)) {
-        clear_page(child);
-      }
-
-      if (result)
-        return result;
-    }
-  }
-
-  return NULL;
-}
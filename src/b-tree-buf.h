@@ -7,65 +7,154 @@ b_tree_buf *alloc_tree_buf(void);
 
 void build_tree(b_tree_buf *b, io_buf *data, int n);
 
-btree_status handle_underflow(b_tree_buf *b, page *p);
+btree_status b_bulk_load(b_tree_buf *b, io_buf *data, int n, u8 fill_percent);
 
-page *get_sibling(b_tree_buf *b, page *p, bool left);
+btree_status b_bulk_build(b_tree_buf *b, const key *keys, int n,
+                          u8 fill_percent);
 
-page *find_parent(b_tree_buf *b, page *current, page *target);
+void populate_key(key *k, data_record *d, u32 rrn);
 
-btree_status b_insert(b_tree_buf *b, io_buf *data, data_record *d, u16 rrn);
+btree_status handle_underflow(b_tree_buf *b, tree_path *path);
 
-btree_status insert_key(b_tree_buf *b, page *p, key k, key *promo_key,
-                        page **r_child, bool *promoted);
+btree_status descend(b_tree_buf *b, key k, tree_path *path);
+
+btree_status resume_descent(b_tree_buf *b, key k, tree_path *path);
+
+key *path_bound(tree_path *path);
+
+void rewind_path(b_tree_buf *b, tree_path *path, key k);
+
+void release_path(b_tree_buf *b, tree_path *path);
+
+btree_status b_insert(b_tree_buf *b, io_buf *data, data_record *d, u32 rrn);
+
+btree_status b_insert_key(b_tree_buf *b, key k);
+
+btree_status b_insert_batch(b_tree_buf *b, io_buf *data, data_record *d,
+                            u32 *rrns, size_t n);
 
 btree_status b_split(b_tree_buf *b, page *p, page **r_child, key *promo_key,
                      key *incoming_key, bool *promoted);
 
-btree_status insert_in_page(page *p, key k, page *r_child, int pos);
+btree_status insert_in_page(b_tree_buf *b, page *p, key k, page *r_child,
+                            int pos);
 
 void create_index_file(io_buf *io, const char *file_name);
 
 void clear_tree_buf(b_tree_buf *b);
 
-int write_root_rrn(b_tree_buf *b, u16 rrn);
+int write_root_rrn(b_tree_buf *b, u32 rrn);
 
 page *b_search(b_tree_buf *b, const char *s, u16 *return_pos);
 
+size_t b_search_many(b_tree_buf *b, const char **plates, size_t n,
+                     u32 *out_rrns);
+
 void b_range_search(b_tree_buf *b, io_buf *data, key_range *range);
 
-u16 search_key(b_tree_buf *b, page *p, key key, u16 *found_pos,
-               page **return_page);
+bt_cursor *bt_cursor_open(b_tree_buf *b, const char *start, const char *end);
+
+bt_cursor *bt_cursor_open_bits(b_tree_buf *b, u64 from, u64 end);
+
+bool bt_cursor_next(bt_cursor *c, key *out);
+
+bool bt_cursor_next_record(bt_cursor *c, io_buf *data, data_record *dst);
+
+int bt_cursor_next_batch(bt_cursor *c, io_buf *data, key *keys,
+                         data_record *records, int max);
+
+void bt_cursor_close(bt_cursor *c);
+
+bt_snapshot *bt_snapshot_open(b_tree_buf *b);
+
+void bt_snapshot_close(bt_snapshot *s);
+
+bt_cursor *bt_cursor_open_snapshot(bt_snapshot *s, const char *start,
+                                   const char *end);
 
 int search_in_page(page *page, key key, int *return_pos);
 
-btree_status b_remove(b_tree_buf *b, io_buf *data, char *key_id);
+int lower_bound(const page *p, u64 target);
+
+u64 key_norm(const char *id);
+
+u64 key_bits(const key *k);
+
+void set_max_key(key *k);
+
+int compare_key(const key *a, const key *b);
+
+key separator(const key *lo, const key *hi);
 
-btree_status remove_key(b_tree_buf *b, page *p, key k, bool *merged);
+bool plate_code(u64 bits, u64 *code);
 
-btree_status redistribute(b_tree_buf *b, page *donor, page *receiver, bool from_left);
+u64 plate_bits(u64 code);
 
-btree_status merge(b_tree_buf *b, page *left, page *right);
+btree_status b_remove(b_tree_buf *b, io_buf *data, free_rrn_list *ld,
+                      char *key_id);
 
-void print_page(page *page);
+btree_status b_remove_key(b_tree_buf *b, io_buf *data, free_rrn_list *ld,
+                          key k);
 
-page *load_page(b_tree_buf *b, u16 rrn);
+btree_status b_update(b_tree_buf *b, io_buf *data, data_record *d);
+
+btree_status redistribute(b_tree_buf *b, page *parent, int slot, page *donor,
+                          page *receiver, bool from_left);
+
+btree_status merge(b_tree_buf *b, page *parent, int slot, page *left,
+                   page *right);
+
+void print_page(b_tree_buf *b, page *page);
+
+void prefetch_pages(b_tree_buf *b, u32 rrn, u32 count);
+
+page *load_page(b_tree_buf *b, u32 rrn);
 
 void populate_index_header(index_header_record *bh, const char *file_name);
 
-void load_index_header(io_buf *io);
+bool valid_order(u32 order);
+
+u32 order_page_size(u32 order);
+
+u32 page_order(u32 page_size);
+
+u16 index_header_size(const char *free_rrn_address);
+
+u32 *page_children(b_tree_buf *b, page *p);
+
+int page_capacity(b_tree_buf *b);
+
+u64 page_key_bits(const page *p, int i);
+
+key page_key(const page *p, int i);
+
+void unpack_keys(const page *p, key *keys);
+
+bool keys_fit(b_tree_buf *b, const key *keys, int n, int c);
+
+bool pack_page(b_tree_buf *b, page *p, const key *keys, int n,
+               const u32 *children, int c);
+
+u64 page_offset(b_tree_buf *b, u32 rrn);
+
+int load_index_header(io_buf *io);
 
 int write_index_header(io_buf *io);
 
 int write_index_record(b_tree_buf *b, page *p);
 
-page *alloc_page(void);
+btree_status write_page(b_tree_buf *b, page *p);
 
-page *new_page(u16 rrn);
+btree_status b_flush(b_tree_buf *b);
 
-void clear_page(page *page);
+page *alloc_page(b_tree_buf *b);
+
+page *new_page(b_tree_buf *b, u32 rrn);
 
-void clear_all_pages(void);
+void set_root(b_tree_buf *b, page *p);
 
-void track_page(page *p);
+void init_page(b_tree_buf *b, page *p);
+
+void clear_page(page *page);
 
 #endif
@@ -0,0 +1,509 @@
+#include "buffer-pool.h"
+#include "b-tree-buf.h"
+#include "wal.h"
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static u32 pool_bucket(buffer_pool *bp, u32 rrn) {
+  return (rrn * 2654435761u) & (bp->buckets - 1);
+}
+
+static page *frame_page(buffer_pool *bp, i32 f) {
+  return (page *)(bp->pages + (size_t)f * bp->stride);
+}
+
+static i32 frame_of(buffer_pool *bp, page *p) {
+  const u8 *q = (const u8 *)p;
+  if (!bp || !p || !bp->pages || q < bp->pages ||
+      q >= bp->pages + (size_t)bp->capacity * bp->stride)
+    return -1;
+  return (i32)((q - bp->pages) / bp->stride);
+}
+
+static void free_frames(buffer_pool *bp) {
+  if (bp->mapped)
+    munmap(bp->pages, bp->mapped);
+  else
+    free(bp->pages);
+  bp->pages = NULL;
+  bp->mapped = 0;
+}
+
+// frames are sized by the page size of the index, which is only known once
+// its header is loaded, so they are allocated on the first claim
+static int alloc_frames(buffer_pool *bp, u32 page_size) {
+  u32 stride = (page_size + sizeof(void *) - 1) & ~(u32)(sizeof(void *) - 1);
+  if (stride == 0) {
+    puts("!!Error: page size == 0");
+    return BTREE_ERROR_INVALID_PAGE;
+  }
+  if (stride == bp->stride)
+    return BTREE_SUCCESS;
+  if (bp->used > 0) {
+    puts("!!Error: buffer pool holds pages of another size");
+    return BTREE_ERROR_INVALID_PAGE;
+  }
+
+  // a pool of huge pages takes one tlb entry per 2 MB of frames; those are
+  // only backed in whole aligned extents, so a huge page more is mapped and
+  // trimmed down to an aligned start
+  size_t bytes = (size_t)stride * bp->capacity, mapped = 0;
+  u8 *pages = NULL;
+  if (bytes >= HUGE_PAGE) {
+    mapped = (bytes + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+    u8 *raw = mmap(NULL, mapped + HUGE_PAGE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw != MAP_FAILED) {
+      size_t head = (HUGE_PAGE - (uintptr_t)raw % HUGE_PAGE) % HUGE_PAGE;
+      if (head > 0)
+        munmap(raw, head);
+      if (head < HUGE_PAGE)
+        munmap(raw + head + mapped, HUGE_PAGE - head);
+      pages = raw + head;
+#ifdef MADV_HUGEPAGE
+      madvise(pages, mapped, MADV_HUGEPAGE);
+#endif
+    }
+  }
+  if (!pages) {
+    mapped = 0;
+    if (posix_memalign((void **)&pages, sizeof(void *), bytes) != 0) {
+      puts("!!Error: Memory allocation failed");
+      return BTREE_ERROR_MEMORY;
+    }
+  }
+
+  free_frames(bp);
+  bp->pages = pages;
+  bp->mapped = mapped;
+  bp->stride = stride;
+  return BTREE_SUCCESS;
+}
+
+static void unlink_frame(buffer_pool *bp, i32 f) {
+  i32 *link = &bp->table[pool_bucket(bp, bp->frames[f].rrn)];
+  while (*link != -1) {
+    if (*link == f) {
+      *link = bp->frames[f].next;
+      break;
+    }
+    link = &bp->frames[*link].next;
+  }
+  bp->frames[f].next = -1;
+  bp->frames[f].used = false;
+  bp->frames[f].dirty = false;
+  bp->used--;
+}
+
+buffer_pool *alloc_buffer_pool(u32 capacity) {
+  if (capacity < MIN_POOL_FRAMES) {
+    printf("!!Error: pool needs at least %d frames\n", MIN_POOL_FRAMES);
+    return NULL;
+  }
+
+  buffer_pool *bp = malloc(sizeof(buffer_pool));
+  if (!bp) {
+    puts("!!Error: Memory allocation failed");
+    return NULL;
+  }
+
+  bp->buckets = 1;
+  while (bp->buckets < capacity)
+    bp->buckets <<= 1;
+
+  bp->capacity = capacity;
+  bp->used = 0;
+  bp->hand = 0;
+  bp->evicting = 0;
+  bp->frames = calloc(capacity, sizeof(frame));
+  bp->table = malloc(sizeof(i32) * bp->buckets);
+  bp->pages = NULL;
+  bp->mapped = 0;
+  bp->stride = 0;
+
+  if (!bp->frames || !bp->table) {
+    puts("!!Error: Memory allocation failed");
+    free(bp->frames);
+    free(bp->table);
+    free(bp);
+    return NULL;
+  }
+
+  memset(bp->table, 0xFF, sizeof(i32) * bp->buckets);
+  for (u32 f = 0; f < capacity; f++)
+    bp->frames[f].next = -1;
+  pthread_mutex_init(&bp->lock, NULL);
+  pthread_cond_init(&bp->loaded, NULL);
+
+  if (DEBUG)
+    printf("@Allocated buffer pool with %u frames\n", capacity);
+  return bp;
+}
+
+void clear_buffer_pool(buffer_pool *bp) {
+  if (!bp) {
+    puts("!!Error: NULL buffer pool pointer");
+    return;
+  }
+
+  pthread_mutex_destroy(&bp->lock);
+  pthread_cond_destroy(&bp->loaded);
+  free(bp->frames);
+  free(bp->table);
+  free_frames(bp);
+  free(bp);
+
+  if (DEBUG)
+    puts("@Buffer pool cleared");
+}
+
+static int resize_pool(b_tree_buf *b, u32 capacity) {
+  // the root pin is the only one allowed to outlive a resize
+  page *root = b->root;
+  for (u32 f = 0; f < b->pool->capacity; f++) {
+    u16 pins = b->pool->frames[f].pins;
+    if (root && frame_page(b->pool, f) == root)
+      pins--;
+    if (pins > 0) {
+      puts("!!Error: cannot resize a pool with pinned pages");
+      return BTREE_ERROR_INVALID_PAGE;
+    }
+  }
+
+  buffer_pool *bp = alloc_buffer_pool(capacity);
+  if (!bp)
+    return BTREE_ERROR_MEMORY;
+
+  btree_status status = flush_pool(b);
+  if (status != BTREE_SUCCESS) {
+    clear_buffer_pool(bp);
+    return status;
+  }
+
+  u32 root_rrn = root ? root->rrn : 0;
+  set_root(b, NULL);
+  clear_buffer_pool(b->pool);
+  b->pool = bp;
+
+  if (root) {
+    root = load_page(b, root_rrn);
+    set_root(b, root);
+    unpin_page(b, root);
+  }
+  return BTREE_SUCCESS;
+}
+
+int set_pool_capacity(b_tree_buf *b, u32 capacity) {
+  if (!b || !b->pool)
+    return BTREE_ERROR_INVALID_PAGE;
+
+  pthread_rwlock_wrlock(&b->latch);
+  int status = resize_pool(b, capacity);
+  pthread_rwlock_unlock(&b->latch);
+  return status;
+}
+
+void print_pool(b_tree_buf *b) {
+  buffer_pool *bp = b ? b->pool : NULL;
+  if (!bp) {
+    fprintf(stderr, "!!Error: NULL buffer pool pointer\n");
+    return;
+  }
+
+  printf("Buffer pool: %u/%u frames in use\n", bp->used, bp->capacity);
+  for (u32 f = 0; f < bp->capacity; f++) {
+    if (!bp->frames[f].used)
+      continue;
+    printf("Frame %u (RRN: %u, pins: %hu%s) ", f, bp->frames[f].rrn,
+           bp->frames[f].pins, bp->frames[f].dirty ? ", dirty" : "");
+    print_page(b, frame_page(bp, f));
+  }
+}
+
+// frame holding rrn or -1, waiting out a read or a write back in progress;
+// bp->lock is held
+static i32 find_frame(buffer_pool *bp, u32 rrn) {
+  while (true) {
+    i32 f = bp->table[pool_bucket(bp, rrn)];
+    while (f != -1 && bp->frames[f].rrn != rrn)
+      f = bp->frames[f].next;
+    if (f == -1 || (!bp->frames[f].loading && !bp->frames[f].evicting))
+      return f;
+    pthread_cond_wait(&bp->loaded, &bp->lock);
+  }
+}
+
+page *pool_search(buffer_pool *bp, u32 rrn) {
+  if (!bp)
+    return NULL;
+
+  pthread_mutex_lock(&bp->lock);
+  i32 f = find_frame(bp, rrn);
+  if (f != -1) {
+    bp->frames[f].pins++;
+    bp->frames[f].ref = true;
+    if (DEBUG)
+      printf("@Page with RRN %u found in pool\n", rrn);
+  }
+  pthread_mutex_unlock(&bp->lock);
+  return f == -1 ? NULL : frame_page(bp, f);
+}
+
+// CLOCK: sweep past pinned frames and clear reference bits until an unpinned,
+// unreferenced frame turns up; two full turns without one means all are pinned
+static i32 pick_victim(buffer_pool *bp) {
+  for (u32 step = 0; step < bp->capacity * 2; step++) {
+    u32 f = bp->hand;
+    bp->hand = (bp->hand + 1) % bp->capacity;
+
+    if (bp->frames[f].pins > 0)
+      continue;
+    if (!bp->frames[f].used)
+      return f;
+    if (bp->frames[f].ref) {
+      bp->frames[f].ref = false;
+      continue;
+    }
+    return f;
+  }
+  return -1;
+}
+
+// writes back the dirty page of unpinned frame f, dropping bp->lock around
+// the log sync and the write; the frame stays pinned so no other claim takes
+// it, and threads wanting its page wait for the write, so nothing changes
+// the page under it
+static btree_status write_back(b_tree_buf *b, i32 f) {
+  buffer_pool *bp = b->pool;
+  u64 lsn = bp->frames[f].lsn;
+  bp->frames[f].pins++;
+  bp->frames[f].evicting = true;
+  bp->evicting++;
+  pthread_mutex_unlock(&bp->lock);
+
+  // a dirty page only goes out once the log holds its image for good
+  btree_status status = wal_sync(b->wal, lsn);
+  if (status == BTREE_SUCCESS)
+    status = write_page(b, frame_page(bp, f));
+
+  pthread_mutex_lock(&bp->lock);
+  bp->frames[f].pins--;
+  bp->frames[f].evicting = false;
+  bp->evicting--;
+  if (status == BTREE_SUCCESS)
+    bp->frames[f].dirty = false;
+  else
+    printf("!!Error: could not write back page %u\n", bp->frames[f].rrn);
+  pthread_cond_broadcast(&bp->loaded);
+  return status;
+}
+
+// pinned frame for rrn; when claimed comes back true the frame is new and
+// other threads wait on it until the caller fills it and calls pool_loaded
+page *pool_claim(b_tree_buf *b, u32 rrn, bool *claimed) {
+  if (!b || !b->pool)
+    return NULL;
+
+  buffer_pool *bp = b->pool;
+  pthread_mutex_lock(&bp->lock);
+  *claimed = false;
+
+  i32 f;
+  while (true) {
+    f = find_frame(bp, rrn);
+    if (f != -1) {
+      bp->frames[f].pins++;
+      bp->frames[f].ref = true;
+      pthread_mutex_unlock(&bp->lock);
+      return frame_page(bp, f);
+    }
+
+    if (alloc_frames(bp, b->io->br->page_size) != BTREE_SUCCESS) {
+      pthread_mutex_unlock(&bp->lock);
+      return NULL;
+    }
+
+    f = pick_victim(bp);
+    if (f == -1) {
+      pthread_mutex_unlock(&bp->lock);
+      puts("!!Error: every frame in the buffer pool is pinned");
+      return NULL;
+    }
+    if (!bp->frames[f].used || !bp->frames[f].dirty)
+      break;
+
+    if (write_back(b, f) != BTREE_SUCCESS) {
+      pthread_mutex_unlock(&bp->lock);
+      return NULL;
+    }
+    // rrn may have been claimed by another thread while the lock was let go
+    // for the write, so the lookup starts over
+  }
+
+  if (bp->frames[f].used) {
+    if (DEBUG)
+      printf("@Evicting page %u from frame %d\n", bp->frames[f].rrn, f);
+    unlink_frame(bp, f);
+  }
+
+  u32 bucket = pool_bucket(bp, rrn);
+  bp->frames[f].rrn = rrn;
+  bp->frames[f].pins = 1;
+  bp->frames[f].ref = true;
+  bp->frames[f].used = true;
+  bp->frames[f].loading = true;
+  bp->frames[f].next = bp->table[bucket];
+  bp->table[bucket] = f;
+  bp->used++;
+  pthread_mutex_unlock(&bp->lock);
+
+  *claimed = true;
+  return frame_page(bp, f);
+}
+
+// ends the load of a claimed frame; a failed one is forgotten so the next
+// thread to want the page reads it again
+void pool_loaded(b_tree_buf *b, page *p, bool ok) {
+  buffer_pool *bp = b ? b->pool : NULL;
+  if (!bp)
+    return;
+
+  pthread_mutex_lock(&bp->lock);
+  i32 f = frame_of(bp, p);
+  if (f != -1) {
+    bp->frames[f].loading = false;
+    if (!ok && bp->frames[f].used) {
+      unlink_frame(bp, f);
+      bp->frames[f].ref = false;
+    }
+  }
+  pthread_cond_broadcast(&bp->loaded);
+  pthread_mutex_unlock(&bp->lock);
+}
+
+void pin_page(b_tree_buf *b, page *p) {
+  buffer_pool *bp = b ? b->pool : NULL;
+  if (!bp)
+    return;
+
+  pthread_mutex_lock(&bp->lock);
+  i32 f = frame_of(bp, p);
+  if (f != -1)
+    bp->frames[f].pins++;
+  pthread_mutex_unlock(&bp->lock);
+}
+
+void unpin_page(b_tree_buf *b, page *p) {
+  buffer_pool *bp = b ? b->pool : NULL;
+  if (!bp || !p)
+    return;
+
+  pthread_mutex_lock(&bp->lock);
+  i32 f = frame_of(bp, p);
+  if (f != -1 && bp->frames[f].pins == 0)
+    printf("!!Error: page %u unpinned more times than pinned\n", p->rrn);
+  else if (f != -1)
+    bp->frames[f].pins--;
+  pthread_mutex_unlock(&bp->lock);
+}
+
+// forgets the cached copy of a page, its frame is reused once unpinned
+void drop_page(b_tree_buf *b, page *p) {
+  buffer_pool *bp = b ? b->pool : NULL;
+  if (!bp)
+    return;
+
+  pthread_mutex_lock(&bp->lock);
+  i32 f = frame_of(bp, p);
+  if (f != -1 && bp->frames[f].used) {
+    unlink_frame(bp, f);
+    bp->frames[f].ref = false;
+  }
+  pthread_mutex_unlock(&bp->lock);
+}
+
+bool set_dirty(b_tree_buf *b, page *p, u64 lsn) {
+  buffer_pool *bp = b ? b->pool : NULL;
+  if (!bp)
+    return false;
+
+  pthread_mutex_lock(&bp->lock);
+  i32 f = frame_of(bp, p);
+  bool cached = f != -1 && bp->frames[f].used;
+  if (cached) {
+    bp->frames[f].dirty = true;
+    bp->frames[f].lsn = lsn;
+  }
+  pthread_mutex_unlock(&bp->lock);
+  return cached;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  u64 ra = *(const u64 *)a, rb = *(const u64 *)b;
+  return (ra > rb) - (ra < rb);
+}
+
+// writes every dirty page in RRN order; runs of consecutive RRNs go out with
+// a single pwritev
+btree_status flush_pool(b_tree_buf *b) {
+  if (!b || !b->pool)
+    return BTREE_ERROR_INVALID_PAGE;
+
+  buffer_pool *bp = b->pool;
+  u64 *dirty = malloc(sizeof(u64) * bp->capacity);
+  struct iovec *iov = malloc(sizeof(struct iovec) * FLUSH_RUN);
+  if (!dirty || !iov) {
+    free(dirty);
+    free(iov);
+    return BTREE_ERROR_MEMORY;
+  }
+
+  pthread_mutex_lock(&bp->lock);
+
+  // the checkpoint after this flush must not run ahead of an eviction
+  while (bp->evicting > 0)
+    pthread_cond_wait(&bp->loaded, &bp->lock);
+
+  // rrn in the high half, frame in the low half, so sorting orders by rrn
+  u32 n = 0;
+  for (u32 f = 0; f < bp->capacity; f++) {
+    if (bp->frames[f].used && bp->frames[f].dirty)
+      dirty[n++] = ((u64)bp->frames[f].rrn << 32) | f;
+  }
+
+  qsort(dirty, n, sizeof(u64), compare_u64);
+
+  btree_status status = n > 0 ? wal_commit(b->wal) : BTREE_SUCCESS;
+  u32 size = b->io->br->page_size;
+  for (u32 i = 0; i < n && status == BTREE_SUCCESS;) {
+    u32 run = 0;
+    while (i + run < n && run < FLUSH_RUN &&
+           (dirty[i + run] >> 32) == (dirty[i] >> 32) + run) {
+      iov[run].iov_base = frame_page(bp, (u32)dirty[i + run]);
+      iov[run].iov_len = size;
+      run++;
+    }
+
+    ssize_t written = pwritev(fileno(b->io->fp), iov, run,
+                              page_offset(b, dirty[i] >> 32));
+    if (written != (ssize_t)size * run) {
+      puts("!!Error: could not write back dirty pages");
+      status = BTREE_ERROR_IO;
+      break;
+    }
+    for (u32 k = 0; k < run; k++)
+      bp->frames[(u32)dirty[i + k]].dirty = false;
+    i += run;
+  }
+
+  pthread_mutex_unlock(&bp->lock);
+
+  if (DEBUG)
+    printf("@Flushed %u dirty pages\n", n);
+
+  free(dirty);
+  free(iov);
+  return status;
+}
@@ -0,0 +1,30 @@
+#ifndef _BUFFER_POOL
+#define _BUFFER_POOL
+
+#include "defines.h"
+
+buffer_pool *alloc_buffer_pool(u32 capacity);
+
+void clear_buffer_pool(buffer_pool *bp);
+
+int set_pool_capacity(b_tree_buf *b, u32 capacity);
+
+void print_pool(b_tree_buf *b);
+
+page *pool_search(buffer_pool *bp, u32 rrn);
+
+page *pool_claim(b_tree_buf *b, u32 rrn, bool *claimed);
+
+void pool_loaded(b_tree_buf *b, page *p, bool ok);
+
+void pin_page(b_tree_buf *b, page *p);
+
+void unpin_page(b_tree_buf *b, page *p);
+
+void drop_page(b_tree_buf *b, page *p);
+
+bool set_dirty(b_tree_buf *b, page *p, u64 lsn);
+
+btree_status flush_pool(b_tree_buf *b);
+
+#endif
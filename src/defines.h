@@ -1,6 +1,7 @@
 #ifndef _DEFINES_H
 #define _DEFINES_H
 
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -9,11 +10,24 @@
 #include <string.h>
 
 #define DEBUG 0 // 1 for dev mode, 0 for prod mode
-#define ORDER 5
+
+// order of new indexes; existing ones keep the order stored in their header
+#define DEFAULT_ORDER 5
+#define MIN_ORDER 3
+#define MAX_ORDER 4096
+// non-root pages have at least two children, so 2^32 rrns stay below this
+#define MAX_HEIGHT 40
+
+// percentage of each page filled by the bulk loader
+#define BULK_FILL_PERCENT 100
 
 // in bytes
 #define MAX_ADDRESS 4096
 
+// address space reserved for a file mapping, and the step it grows by
+#define MAP_RESERVE ((size_t)1 << 36)
+#define MAP_EXTENT ((size_t)1 << 18)
+
 // size data record
 #define TAMANHO_PLACA 8
 #define TAMANHO_MODELO 20
@@ -21,8 +35,77 @@
 #define TAMANHO_CATEGORIA 15
 #define TAMANHO_STATUS 16
 
-// queue max
-#define P 5 
+// page latches are striped by rrn; a thread holds at most one at a time, so
+// two pages sharing a stripe never deadlock
+#define PAGE_LATCHES 64
+
+// rrn that points nowhere (no child, no next leaf, no data record)
+#define NULL_RRN ((u32)-1)
+
+// first bytes of files written with 32-bit rrns ("BPI6" and "BRL2" on disk);
+// "BPI5" indexes store no plate codes, "BPI4" ones keep data rrns on
+// internal pages, "BPI3" ones have pages of full keys, "BPI2" ones pages
+// without high keys, and those along with older files without a magic are
+// converted by B-PLUS-TREE_migrate
+#define INDEX_MAGIC 0x36495042u
+#define SLIM_INDEX_MAGIC 0x35495042u
+#define PACKED_INDEX_MAGIC 0x34495042u
+#define PLAIN_INDEX_MAGIC 0x33495042u
+#define OLD_INDEX_MAGIC 0x32495042u
+#define LIST_MAGIC 0x324C5242u
+#define WAL_MAGIC 0x314C5742u
+
+// magic, root_rrn, page_size, header_size and order
+#define INDEX_FIXED_HEADER (sizeof(u32) * 3 + sizeof(u16) * 2)
+
+// page header of "BPI3" to "BPI5" indexes, before pages flagged plate codes
+#define PLAIN_PAGE_HEADER 28
+
+// plate codes take 30 bits; pages keep them in the top bytes of a key value
+// so they share the prefix handling of id bytes
+#define PLATE_CODE_SHIFT 32
+
+// magic and entry count of a free rrn list
+#define LIST_FIXED_HEADER (sizeof(u32) * 2)
+
+// magic and page size of a redo log
+#define WAL_FIXED_HEADER (sizeof(u32) * 2)
+
+// log bytes buffered before they are written out without a sync, and the
+// log size past which an insert or remove checkpoints the index
+#define WAL_BUFFER ((size_t)1 << 20)
+#define WAL_CHECKPOINT ((u64)1 << 24)
+
+// leaf pages a range scan asks the kernel to read ahead of it, and records
+// it fetches from the data file per sorted batch
+#define READAHEAD_LEAVES 16
+#define RANGE_BATCH 64
+
+// a secondary key is the first bytes of its field, in the order the field
+// sorts, followed by the big-endian data rrn, so records sharing a value
+// stay distinct keys; longer values are told apart by reading the record
+#define SECONDARY_VALUE 4
+
+// default and minimum frames in the buffer pool
+#define P 64
+#define MIN_POOL_FRAMES 8
+// most dirty pages written back by one pwritev
+#define FLUSH_RUN 64
+// pools of at least this many bytes of frames are mapped on huge pages,
+// aligned to them; the default pool of P frames stays far below, so it takes
+// -p with HUGE_PAGE / page_size frames or more (512 of 4 KB pages)
+#define HUGE_PAGE (2u << 20)
+
+// default bytes the data record cache may hold, entries included, and the
+// fewest records it keeps when enabled
+#define RECORD_CACHE_BYTES ((size_t)1 << 20)
+#define MIN_CACHE_RECORDS 8
+
+// bytes copied at a time when a header is put in front of a data file
+#define PREPEND_CHUNK ((size_t)1 << 16)
+
+// msync policy of a newly mapped data file
+#define DATA_SYNC DATA_SYNC_ASYNC
 
 typedef uint8_t u8;
 typedef uint16_t u16;
@@ -48,6 +131,50 @@ typedef enum {
   BTREE_ERROR_PAGE_FULL = -5
 } btree_status;
 
+// a page image is applied as is, the rrn of a snapshot copy is freed again;
+// records between WAL_BEGIN and WAL_END are
+// only applied when the log holds the WAL_END
+typedef enum {
+  WAL_PAGE = 1,
+  WAL_ROOT = 2,
+  WAL_FREE = 3,
+  WAL_BEGIN = 4,
+  WAL_END = 5,
+  WAL_SHADOW = 6 // held by a snapshot, which does not outlive a crash
+} wal_type;
+
+// how far a record written through a mapped data file is pushed before
+// write_data_record returns: left to the kernel, handed to it with
+// MS_ASYNC, or on the disk with MS_SYNC
+typedef enum {
+  DATA_SYNC_NONE = 0,
+  DATA_SYNC_ASYNC = 1,
+  DATA_SYNC_RECORD = 2
+} data_sync;
+
+// page layouts B-PLUS-TREE_migrate reads: 16-bit rrns with the order fixed at
+// compile time or stored in the header, 32-bit pages without high keys
+// ("BPI2"), pages of full keys ("BPI3"), packed pages with a data rrn in
+// every slot ("BPI4") and packed pages of id bytes only ("BPI5")
+typedef enum {
+  LAYOUT_NARROW = 0,
+  LAYOUT_ORDERED = 1,
+  LAYOUT_UNLINKED = 2,
+  LAYOUT_PLAIN = 3,
+  LAYOUT_PACKED = 4,
+  LAYOUT_SLIM = 5
+} old_layout;
+
+// fields of data_record with a secondary index, each a tree of its own next
+// to the index of plates
+typedef enum {
+  BY_MARCA = 0,
+  BY_CATEGORIA = 1,
+  BY_STATUS = 2,
+  BY_ANO = 3,
+  SECONDARY_FIELDS = 4
+} secondary_field;
+
 typedef enum {  // not integrated yet
   IO_SUCCESS = 0,
   IO_ERROR = -1
@@ -59,17 +186,27 @@ typedef struct b_tree_buf b_tree_buf;
 typedef struct io_buf io_buf;
 typedef struct index_record index_record;
 typedef struct data_record data_record;
-typedef struct queue queue;
+typedef struct buffer_pool buffer_pool;
+typedef struct record_cache record_cache;
+typedef struct cached_record cached_record;
+typedef struct frame frame;
 typedef struct key key;
 typedef struct key_range key_range;
 typedef struct page page;
 typedef struct app app;
 typedef struct free_rrn_list free_rrn_list;
+typedef struct tree_path tree_path;
+typedef struct bt_cursor bt_cursor;
+typedef struct bt_snapshot bt_snapshot;
+typedef struct wal_record wal_record;
+typedef struct wal wal;
+typedef struct old_index old_index;
+typedef struct scratch scratch;
 
 
 #pragma pack(push, 1)
 struct key {
-  u16 data_register_rrn;
+  u32 data_register_rrn;
   char id[TAMANHO_PLACA];
 };
 #pragma pack(pop)
@@ -79,23 +216,68 @@ struct key_range {
   char end_id[TAMANHO_PLACA];
 };
 
+// a page is this header followed by its child rrns, the bytes every key on
+// it starts with, then a slot per key: the next width bytes and, on leaves,
+// its data rrn. Those bytes are the plate code of each key on pages of
+// plates and its id otherwise. Internal pages hold separators, the shortest
+// keys between two siblings. Keys end in zero bytes past prefix + width, so
+// a page takes more keys the more they share; its size comes from the order
+// stored in the index header, and order - 1 keys of any length always fit.
+// Every page links to its right sibling and holds keys below its high key, so
+// a search that lands on a page split under it moves right to find its key
 #pragma pack(push, 1)
 struct page {
-  key keys[ORDER - 1];
-  u16 rrn;
-  u16 children[ORDER];
-  u16 next_leaf;
-  u8 child_num;
-  u8 keys_num;
+  u32 rrn;
+  u32 next_leaf; // right sibling on every level, the leaf chain at level 0
+  u16 child_num;
+  u16 keys_num;
   u8 leaf;
+  u8 level;  // height above the leaves
+  u8 prefix; // bytes shared by every key on the page
+  u8 width;  // bytes each slot holds after the prefix
+  u8 plates; // every key is a plate and stored as its code
+  u8 pad[3]; // keeps the child rrns 4-byte aligned
+  key high;  // all 0xFF bytes on the rightmost page of a level
+  u8 data[]; // 4-byte aligned, so the child rrns are as well
 };
-
 #pragma pack(pop)
 
-struct queue {
-  queue *next;
-  page *page;
-  u16 counter;
+// pages pinned on the way from the root to a leaf, with the child slot taken
+// in each internal page and the key position in the leaf
+struct tree_path {
+  page *pages[MAX_HEIGHT];
+  u16 slots[MAX_HEIGHT];
+  u8 depth;
+  key hit; // leaf key at the final slot, copied while the leaf was latched
+};
+
+struct frame {
+  u64 lsn; // log bytes that must be durable before the page is written
+  u32 rrn;
+  u16 pins;
+  i32 next; // next frame in the same hash bucket, -1 ends the chain
+  bool used;
+  bool ref;
+  bool dirty;
+  bool loading; // claimed, but its page is still being read
+  bool evicting; // its page is being written back outside the pool lock,
+                 // and it is not handed out until that is done
+};
+
+struct buffer_pool {
+  frame *frames;
+  u8 *pages;  // frame f holds the page at pages + f * stride
+  size_t mapped; // bytes mapped for pages when backed by huge pages, or 0
+  u32 stride; // page size rounded up, 0 until the first page is claimed
+  i32 *table;  // rrn hash -> first frame of the bucket
+  u32 capacity;
+  u32 buckets;
+  u32 used;
+  u32 hand;
+  u32 evicting; // frames being written back outside the lock
+  pthread_mutex_t lock; // guards every field above and the frame headers
+  pthread_cond_t loaded; // broadcast whenever a frame finishes loading or
+                         // being written back
 };
 
 struct data_record {
@@ -108,6 +290,29 @@ struct data_record {
   char status[TAMANHO_STATUS];
 };
 
+struct cached_record {
+  data_record d;
+  u32 rrn;
+  i32 next; // next entry in the same hash bucket, -1 ends the chain
+  bool used;
+  bool ref;
+};
+
+// copies of data records by rrn, evicted by CLOCK; records are written
+// through, so an entry never differs from the file
+struct record_cache {
+  cached_record *entries;
+  i32 *table; // rrn hash -> first entry of the bucket
+  u32 capacity;
+  u32 buckets;
+  u32 used;
+  u32 hand;
+  u64 hits;
+  u64 misses;
+  u64 writes; // records written so far, to tell a read older than a write
+  pthread_mutex_t lock; // guards every field above and the entries
+};
+
 struct data_header_record {
   u16 header_size;
   u16 record_size;
@@ -115,9 +320,10 @@ struct data_header_record {
 };
 
 struct index_header_record {
-  u16 root_rrn;
-  u16 page_size;
+  u32 root_rrn;
+  u32 page_size;
   u16 header_size;
+  u16 order;
   char *free_rrn_address;
 };
 
@@ -126,19 +332,128 @@ struct io_buf {
   FILE *fp;
   data_header_record *hr;
   index_header_record *br;
+  u8 *map;         // start of the file mapping, NULL when not mapped
+  size_t map_size; // bytes of the file currently mapped, read with
+                   // mapped_size as remap_file grows it under other threads
+  bool use_mmap;
+  data_sync sync;            // applies to records written through the map
+  pthread_mutex_t map_lock;  // orders readers catching the mapping up
+  record_cache *cache; // data files only, NULL reads every record from disk
+};
+
+// every record of the redo log starts with this header
+#pragma pack(push, 1)
+struct wal_record {
+  u32 type;
+  u32 rrn; // page written, new root or freed rrn
+  u32 len; // bytes of page image after the header
+  u32 sum; // checksum of the header, with sum zeroed, and the image
+};
+#pragma pack(pop)
+
+// records are appended to buf and reach the file when a commit writes and
+// syncs everything appended so far; commits arriving while one is syncing
+// wait for it and are covered by the next sync together
+struct wal {
+  int fd;
+  u8 *buf;
+  size_t len;
+  size_t cap;
+  u8 *spare; // written by the syncing thread while buf keeps filling
+  size_t spare_cap;
+  u64 appended; // bytes appended since the log was opened
+  u64 durable;  // of those, bytes known to be on disk
+  u64 size;     // bytes in the file
+  u64 syncs;
+  u32 replayed; // records redone when the log was opened
+  bool syncing;
+  bool failed; // a write or sync failed, nothing commits anymore
+  pthread_mutex_t lock;
+  pthread_cond_t synced;
+};
+
+// keys and children of up to three pages, which splits, merges and
+// redistributions unpack to repack them; stored right after the header
+struct scratch {
+  scratch *next;
+  u32 cap; // keys a page can hold, plus one
+  key *keys;     // 3 * cap
+  u32 *children; // 3 * (cap + 1)
 };
 
+// searches, cursors, inserts and removes that stay inside one leaf share
+// latch and coordinate through the page latches; bulk loads, batch inserts,
+// flushes and removes that rebalance pages hold it alone
 struct b_tree_buf {
   page *root;
   io_buf *io;
-  queue *q;
+  buffer_pool *pool;
   free_rrn_list *i;
+  wal *wal; // NULL until open_wal, then every page write is logged
+  bt_snapshot *snapshots; // only linked and unlinked under the exclusive latch
+  pthread_mutex_t snapshot_lock; // guards the tables of the open snapshots
+  scratch *scratch;              // free repack buffers
+  b_tree_buf *secondary[SECONDARY_FIELDS]; // NULL until open_secondary
+  u32 unsettled; // changes whose secondary keys are not in place yet, only
+                 // touched with atomics
+  pthread_mutex_t scratch_lock;  // guards scratch
+  pthread_rwlock_t latch;
+  pthread_mutex_t root_lock; // guards root while latch is shared
+  pthread_rwlock_t page_latches[PAGE_LATCHES];
 };
 
+// range scan over [start, end]; a live cursor holds no latch or pin between
+// two calls, so every call searches the tree again for from, and writers,
+// checkpoints and resizes go on while the cursor is open
+struct bt_cursor {
+  b_tree_buf *b;
+  bt_snapshot *snap; // NULL when the cursor runs over the live tree
+  page *copy;        // private copy of the leaf a snapshot cursor is on
+  page *leaf;        // only set inside a call for a live cursor
+  bool done;         // the scan went past end
+  u64 from; // the next key returned is the first one not below from
+  u64 end;
+  u32 ahead_from; // leaf rrns already handed to the kernel for readahead
+  u32 ahead_to;
+};
+
+// the tree as it was when the snapshot was opened; a writer about to change
+// a page in place, or to free it, first copies it to a fresh rrn for every
+// snapshot that has no copy of it yet, and the snapshot reads that copy
+struct bt_snapshot {
+  b_tree_buf *b;
+  u32 root;    // NULL_RRN when the tree was empty
+  u32 *rrns;   // open addressing over live rrns, NULL_RRN marks an empty slot
+  u32 *copies; // rrn of each page's copy, NULL_RRN for pages allocated later
+  u32 slots;
+  u32 used;
+  bt_snapshot *next;
+};
+
+// free rrns live in a bitmap below the high-water mark next, every rrn from
+// next on is unused; the file is only rewritten at checkpoints
 struct free_rrn_list {
   io_buf *io;
-  u16 *free_rrn;
-  u16 n;
+  u64 *bits;
+  u32 words;
+  u32 n;    // set bits
+  u32 next; // high-water mark
+  u32 low;  // no rrn below this one is free
+  bool dirty;
+  pthread_mutex_t lock; // taken by get_free_rrn and insert_list
+};
+
+// an index being migrated; its pages are read from the root down and the
+// keys of its leaves gathered in order
+struct old_index {
+  FILE *fp;
+  old_layout layout;
+  u32 page_size;
+  u16 header_size;
+  u16 order;
+  key *keys;
+  u32 n;
+  u32 cap;
 };
 
 struct app {
@@ -1,73 +1,86 @@
 #include "free-rrn-list.h"
 #include "io-buf.h"
 
-void sort_list(u16 A[], int n) {
-  if (n < 1)
-    return;
-  int h = 1;
-  while (h < n / 3) {
-    h = 3 * h + 1;
-  }
+#include <unistd.h>
 
-  while (h >= 1) {
-    for (int i = h; i < n; i++) {
-      int aux = A[i];
-      int j = i;
-      while (j >= h && A[j - h] > aux) {
-        A[j] = A[j - h];
-        j -= h;
-      }
-      A[j] = aux;
-    }
-    h = h / 3;
+static bool grow_bits(free_rrn_list *i, u32 rrn) {
+  u32 words = rrn / 64 + 1;
+  if (words <= i->words)
+    return true;
+
+  // doubling keeps the cost of a growing file amortized
+  u32 cap = i->words ? i->words : 16;
+  while (cap < words)
+    cap *= 2;
+
+  u64 *bits = realloc(i->bits, sizeof(u64) * cap);
+  if (!bits) {
+    puts("!!Error: Failed to allocate RRN bitmap");
+    return false;
   }
+  memset(bits + i->words, 0, sizeof(u64) * (cap - i->words));
+  i->bits = bits;
+  i->words = cap;
+  return true;
 }
 
-bool rrn_exists(u16 A[], int n, int rrn) {
-  if (!A || n <= 0)
-    return false;
+static bool is_free(free_rrn_list *i, u32 rrn) {
+  return rrn / 64 < i->words && (i->bits[rrn / 64] >> (rrn % 64)) & 1;
+}
 
-  int left = 0;
-  int right = n - 1;
-
-  while (left <= right) {
-    int mid = (left + right) / 2;
-    if (A[mid] == rrn)
-      return true;
-    if (A[mid] < rrn)
-      left = mid + 1;
-    else
-      right = mid - 1;
-  }
-  return false;
+static void mark_free(free_rrn_list *i, u32 rrn) {
+  if (is_free(i, rrn) || !grow_bits(i, rrn))
+    return;
+  i->bits[rrn / 64] |= (u64)1 << (rrn % 64);
+  i->n++;
+  if (rrn < i->low)
+    i->low = rrn;
 }
 
+static void forget_rrns(free_rrn_list *i) {
+  if (i->bits)
+    memset(i->bits, 0, sizeof(u64) * i->words);
+  i->n = 0;
+  i->next = 0;
+  i->low = 0;
+}
+
+// the file holds the free rrns in ascending order followed by the high-water
+// mark, so it is rewritten whole at each checkpoint
 void write_rrn_list_to_file(free_rrn_list *i) {
   if (!i || !i->io->fp)
     return;
 
-  fseek(i->io->fp, 0, SEEK_SET);
-  if (i->n > 0) {
-    if (fwrite(&i->n, sizeof(u16), 1, i->io->fp) != 1) {
-      puts("!!Error: Failed to write RRN count");
-      return;
-    }
+  u32 *list = load_rrns(i);
+  if (!list)
+    return;
 
-    size_t written = fwrite(i->free_rrn, sizeof(u16), i->n, i->io->fp);
-    if (written != i->n) {
-      printf("!!Error: Expected to write %d elements, but wrote %zu\n", i->n,
-             written);
-      return;
-    }
+  u32 head[2] = {LIST_MAGIC, i->n + 1};
+  fseek(i->io->fp, 0, SEEK_SET);
+  if (fwrite(head, sizeof(head), 1, i->io->fp) != 1) {
+    puts("!!Error: Failed to write RRN list header");
+    free(list);
     return;
   }
 
-  i->n = 0;
-  if (fwrite(&i->n, sizeof(u16), 1, i->io->fp) != 1) {
-    puts("!!Error: Failed to write empty RRN count");
+  size_t written = fwrite(list, sizeof(u32), i->n + 1, i->io->fp);
+  free(list);
+  if (written != i->n + 1) {
+    printf("!!Error: Expected to write %u elements, but wrote %zu\n",
+           i->n + 1, written);
+    return;
   }
 
   fflush(i->io->fp);
+  if (ftruncate(fileno(i->io->fp), LIST_FIXED_HEADER +
+                                       sizeof(u32) * (i->n + 1)) != 0)
+    puts("!!Error: Failed to truncate RRN list");
+  i->dirty = false;
+}
+
+void flush_list(free_rrn_list *i) {
+  if (i && i->dirty)
+    write_rrn_list_to_file(i);
 }
 
 free_rrn_list *alloc_ilist(void) {
@@ -75,8 +88,11 @@ free_rrn_list *alloc_ilist(void) {
   if (!i)
     exit(-1);
   i->io = alloc_io_buf();
-  i->n = 0;
-  i->free_rrn = NULL;
+  i->bits = NULL;
+  i->words = 0;
+  i->dirty = false;
+  pthread_mutex_init(&i->lock, NULL);
+  forget_rrns(i);
   return i;
 }
 
@@ -84,14 +100,16 @@ void clear_ilist(free_rrn_list *i) {
   if (!i)
     return;
 
+  flush_list(i);
   if (i->io && i->io->fp) {
     fclose(i->io->fp);
     i->io->fp = NULL;
   }
 
-  free(i->free_rrn);
-  i->free_rrn = NULL;
+  free(i->bits);
+  i->bits = NULL;
 
+  pthread_mutex_destroy(&i->lock);
   clear_io_buf(i->io);
   free(i);
 }
@@ -102,10 +120,8 @@ void load_list(free_rrn_list *i, char *s) {
     return;
   }
 
-  if (i->free_rrn) {
-    free(i->free_rrn);
-    i->free_rrn = NULL;
-  }
+  forget_rrns(i);
+  i->dirty = false;
 
   if (!i->io) {
     i->io = alloc_io_buf();
@@ -121,185 +137,188 @@ void load_list(free_rrn_list *i, char *s) {
   i->io->fp = fopen(i->io->address, "r+b");
   if (!i->io->fp) {
     printf("Creating new RRN list file: %s\n", s);
-    i->io->fp = fopen(i->io->address, "wb");
+    i->io->fp = fopen(i->io->address, "w+b");
     if (!i->io->fp) {
       printf("!!Error: Cannot create file %s\n", s);
       return;
     }
-    i->n = 1;
-    i->free_rrn = malloc(sizeof(u16));
-    if (!i->free_rrn) {
-      puts("!!Error: Failed to allocate RRN list");
-      fclose(i->io->fp);
-      return;
-    }
-    i->free_rrn[0] = 0;
-    fwrite(&i->n, sizeof(u16), 1, i->io->fp);
-    fwrite(i->free_rrn, sizeof(u16), i->n, i->io->fp);
-    fclose(i->io->fp);
-    i->io->fp = fopen(i->io->address, "r+b");
+    write_rrn_list_to_file(i);
   }
 
+  u32 magic = 0, n = 0;
   fseek(i->io->fp, 0, SEEK_SET);
-  size_t read = fread(&i->n, sizeof(u16), 1, i->io->fp);
-  if (read != 1) {
-    i->n = 1;
-    i->free_rrn = malloc(sizeof(u16));
-    if (!i->free_rrn) {
-      puts("!!Error: Failed to allocate RRN list");
-      return;
-    }
-    i->free_rrn[0] = 0;
-    fseek(i->io->fp, 0, SEEK_SET);
-    fwrite(&i->n, sizeof(u16), 1, i->io->fp);
-    fwrite(i->free_rrn, sizeof(u16), i->n, i->io->fp);
-  } else if (i->n > 0) {
-    i->free_rrn = load_rrn_list(i);
-    if (!i->free_rrn) {
-      i->n = 1;
-      i->free_rrn = malloc(sizeof(u16));
-      if (!i->free_rrn) {
-        puts("!!Error: Failed to allocate RRN list");
-        return;
-      }
-      i->free_rrn[0] = 0;
-      fseek(i->io->fp, 0, SEEK_SET);
-      fwrite(&i->n, sizeof(u16), 1, i->io->fp);
-      fwrite(i->free_rrn, sizeof(u16), i->n, i->io->fp);
-    }
+  size_t read = fread(&magic, sizeof(u32), 1, i->io->fp);
+  if (read == 1 && magic != LIST_MAGIC) {
+    printf("!!Error: %s holds 16-bit rrns, run B-PLUS-TREE_migrate on it\n",
+           s);
+    fclose(i->io->fp);
+    i->io->fp = NULL;
+    return;
   }
+  if (read == 1)
+    read = fread(&n, sizeof(u32), 1, i->io->fp);
+
+  u32 *list = read == 1 && n > 0 ? load_rrn_list(i, n) : NULL;
+  if (!list) {
+    write_rrn_list_to_file(i);
+    return;
+  }
+
+  // everything but the last entry is a hole below the high-water mark
+  for (u32 j = 0; j + 1 < n; j++)
+    mark_free(i, list[j]);
+  i->next = list[n - 1];
+  free(list);
 
-  fflush(i->io->fp);
   if (DEBUG)
-    printf("@Loaded RRN list with %d entries\n", i->n);
+    printf("@Loaded RRN list with %u entries\n", n);
 }
 
-u16 *load_rrn_list(free_rrn_list *i) {
-  if (!i->io->fp || i->n == 0)
+u32 *load_rrn_list(free_rrn_list *i, u32 n) {
+  if (!i->io->fp || n == 0)
     return NULL;
 
-  u16 *list = malloc(sizeof(u16) * i->n);
+  u32 *list = malloc(sizeof(u32) * n);
   if (!list) {
     puts("!!Error: memory allocation failed");
     return NULL;
   }
 
-  fseek(i->io->fp, sizeof(u16), SEEK_SET);
-  size_t read = fread(list, sizeof(u16), i->n, i->io->fp);
+  fseek(i->io->fp, LIST_FIXED_HEADER, SEEK_SET);
+  size_t read = fread(list, sizeof(u32), n, i->io->fp);
 
-  if (read != i->n) {
+  if (read != n) {
     free(list);
-    printf("!!Error: Expected to read %d elements, but read %zu\n", i->n, read);
+    printf("!!Error: Expected to read %u elements, but read %zu\n", n, read);
     return NULL;
   }
 
   if (DEBUG) {
-    for (int j = 0; j < i->n; j++)
-      printf("i->list[%d]: %hu\t", j, list[j]);
+    for (u32 j = 0; j < n; j++)
+      printf("i->list[%u]: %u\t", j, list[j]);
     puts("");
   }
   return list;
 }
 
-u16 get_free_rrn(free_rrn_list *i) {
+static u32 take_rrn(free_rrn_list *i) {
+  i->dirty = true;
+  if (i->n == 0)
+    return i->next++;
+
+  // nothing below low is free, so the scan starts at its word
+  for (u32 w = i->low / 64; w < i->words; w++) {
+    if (!i->bits[w])
+      continue;
+    u32 rrn = w * 64 + __builtin_ctzll(i->bits[w]);
+    i->bits[w] &= i->bits[w] - 1;
+    i->n--;
+    i->low = rrn + 1;
+    return rrn;
+  }
+
+  puts("!!Error: RRN bitmap lost its free entries");
+  i->n = 0;
+  return i->next++;
+}
+
+u32 get_free_rrn(free_rrn_list *i) {
   if (!i || !i->io->fp) {
     puts("!!Error: Invalid list or file pointer");
     exit(1);
   }
 
-  free(i->free_rrn);
-  i->free_rrn = load_rrn_list(i);
+  pthread_mutex_lock(&i->lock);
+  u32 rrn = take_rrn(i);
+  pthread_mutex_unlock(&i->lock);
+  return rrn;
+}
 
-  if (!i->free_rrn || i->n == 0) {
-    puts("!!Error: No free RRNs available; initializing with default");
-    i->n = 1;
-    i->free_rrn = malloc(sizeof(u16));
-    if (!i->free_rrn) {
-      puts("!!Error: Failed to allocate RRN list");
-      exit(1);
-    }
-    i->free_rrn[0] = 0;
-    write_rrn_list_to_file(i);
-    return 0;
+u32 get_last_free_rrn(free_rrn_list *i) {
+  if (!i || !i->io->fp) {
+    puts("!!Error: invalid list or file pointer");
+    return NULL_RRN;
   }
+  return i->next;
+}
 
-  int rrn = i->free_rrn[0];
-  i->n--;
-
-  if (i->n > 0)
-    memmove(i->free_rrn, i->free_rrn + 1, sizeof(u16) * i->n);
-
-  if (i->n < 1) {
-    u16 new_rrn = rrn + 1;
-    while (rrn_exists(i->free_rrn, i->n, new_rrn))
-      new_rrn++;
-
-    u16 *new_list = realloc(i->free_rrn, (i->n + 1) * sizeof(u16));
-    if (!new_list) {
-      puts("!!Error: Failed to reallocate RRN list");
-    }
-    i->free_rrn = new_list;
-    i->free_rrn[i->n] = new_rrn;
-    i->n++;
+u32 *load_rrns(free_rrn_list *i) {
+  u32 *list = malloc(sizeof(u32) * (i->n + 1));
+  if (!list) {
+    puts("!!Error: memory allocation failed");
+    return NULL;
   }
 
-  sort_list(i->free_rrn, i->n);
-  write_rrn_list_to_file(i);
-  return rrn;
+  u32 k = 0;
+  for (u32 w = i->low / 64; w < i->words && k < i->n; w++) {
+    for (u64 bits = i->bits[w]; bits; bits &= bits - 1)
+      list[k++] = w * 64 + __builtin_ctzll(bits);
+  }
+  list[k] = i->next;
+  return list;
 }
 
-u16 get_last_free_rrn(free_rrn_list *i) {
-  if (!i || !i->io->fp) {
-    puts("!!Error: invalid list or file pointer");
-    return (u16)-1;
+static void add_rrn(free_rrn_list *i, u32 rrn) {
+  if (rrn == i->next || is_free(i, rrn)) {
+    if (DEBUG)
+      printf("@RRN %u already exists in the list\n", rrn);
+    return;
   }
 
-  if (!i->free_rrn)
-    i->free_rrn = load_rrn_list(i);
-
-  if (!i->free_rrn || i->n == 0) {
-    puts("!!Error: no free RRNs available");
-    return (u16)-1;
+  // an rrn past the high-water mark becomes the new mark and the old one a
+  // hole, as the sorted list used to order them
+  if (rrn > i->next) {
+    mark_free(i, i->next);
+    i->next = rrn;
+  } else {
+    mark_free(i, rrn);
   }
-  return i->free_rrn[i->n - 1];
+  i->dirty = true;
+
+  if (DEBUG)
+    printf("@RRN %u added, %u free below %u\n", rrn, i->n, i->next);
 }
 
-void insert_list(free_rrn_list *i, int rrn) {
+void insert_list(free_rrn_list *i, u32 rrn) {
   if (!i || !i->io->fp) {
     puts("!!Error: NULL rrn list or file pointer");
     return;
   }
 
-  if (DEBUG)
-    printf("Current count before insertion: %d\n", i->n);
-  if (rrn_exists(i->free_rrn, i->n, rrn)) {
-    if (DEBUG)
-      printf("@RRN %d already exists in the list\n", rrn);
+  pthread_mutex_lock(&i->lock);
+  add_rrn(i, rrn);
+  pthread_mutex_unlock(&i->lock);
+}
+
+// takes rrn out of the free rrns, for pages the log wrote after the list was
+// last checkpointed
+void claim_rrn(free_rrn_list *i, u32 rrn) {
+  if (!i || rrn == NULL_RRN)
     return;
+
+  pthread_mutex_lock(&i->lock);
+  if (rrn >= i->next) {
+    for (u32 r = i->next; r < rrn; r++)
+      mark_free(i, r);
+    i->next = rrn + 1;
+  } else if (is_free(i, rrn)) {
+    i->bits[rrn / 64] &= ~((u64)1 << (rrn % 64));
+    i->n--;
   }
+  i->dirty = true;
+  pthread_mutex_unlock(&i->lock);
+}
 
-  u16 *new_list = realloc(i->free_rrn, (i->n + 1) * sizeof(u16));
-  if (!new_list) {
-    puts("!!Error: Memory allocation failed");
+void reset_list(free_rrn_list *i, u32 rrn) {
+  if (!i || !i->io->fp) {
+    puts("!!Error: NULL rrn list or file pointer");
     return;
   }
 
-  i->free_rrn = new_list;
-  i->free_rrn[i->n++] = rrn;
-  if (DEBUG)
-    printf("New count after insertion: %d\n", i->n);
-
-  sort_list(i->free_rrn, i->n);
-  write_rrn_list_to_file(i);
+  forget_rrns(i);
+  i->next = rrn;
+  i->dirty = true;
 
-  if (DEBUG) {
-    printf("List after insertion:\n");
-    for (int j = 0; j < i->n; j++)
-      printf("%hu ", i->free_rrn[j]);
-    puts("");
-    printf("@RRN %d added and list sorted. New list:\n", rrn);
-    for (int j = 0; j < i->n; j++)
-      printf("%d ", i->free_rrn[j]);
-    puts("");
-  }
+  if (DEBUG)
+    printf("@RRN list reset, next free RRN: %u\n", rrn);
 }
@@ -8,14 +8,22 @@ void clear_ilist(free_rrn_list *i);
 
 void load_list(free_rrn_list *i, char* s);
 
-u16 *load_rrn_list(free_rrn_list *i);
+u32 *load_rrn_list(free_rrn_list *i, u32 n);
 
-u16 get_free_rrn(free_rrn_list *i);
+u32 get_free_rrn(free_rrn_list *i);
 
-u16 get_last_free_rrn(free_rrn_list *i);
+u32 get_last_free_rrn(free_rrn_list *i);
 
-u16 *load_rrns(free_rrn_list *i);
+u32 *load_rrns(free_rrn_list *i);
 
-void insert_list(free_rrn_list *i, int rrn); 
+void insert_list(free_rrn_list *i, u32 rrn);
+
+void claim_rrn(free_rrn_list *i, u32 rrn);
+
+void reset_list(free_rrn_list *i, u32 rrn);
+
+void write_rrn_list_to_file(free_rrn_list *i);
+
+void flush_list(free_rrn_list *i);
 
 #endif
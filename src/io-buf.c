@@ -1,6 +1,12 @@
 #include "io-buf.h"
 #include "b-tree-buf.h"
 #include "free-rrn-list.h"
+#include "record-cache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 io_buf *alloc_io_buf(void) {
   io_buf *io = malloc(sizeof(io_buf));
@@ -8,6 +14,14 @@ io_buf *alloc_io_buf(void) {
     puts("!!Could not allocate IO_BUFFER");
     return NULL;
   }
+  io->fp = NULL;
+  io->address[0] = '\0';
+  io->map = NULL;
+  io->map_size = 0;
+  io->use_mmap = false;
+  io->sync = DATA_SYNC;
+  io->cache = NULL;
+  pthread_mutex_init(&io->map_lock, NULL);
 
   io->hr = malloc(sizeof(data_header_record));
   io->br = malloc(sizeof(index_header_record));
@@ -17,6 +31,13 @@ io_buf *alloc_io_buf(void) {
     return NULL;
   }
 
+  io->hr->header_size = 0;
+  io->hr->record_size = 0;
+  io->br->root_rrn = 0;
+  io->br->header_size = 0;
+  io->br->order = DEFAULT_ORDER;
+  io->br->page_size = order_page_size(DEFAULT_ORDER);
+
   io->hr->free_rrn_address = malloc(sizeof(char) * MAX_ADDRESS);
   io->br->free_rrn_address = malloc(sizeof(char) * MAX_ADDRESS);
   if (!io->hr->free_rrn_address || !io->br->free_rrn_address) {
@@ -26,6 +47,7 @@ io_buf *alloc_io_buf(void) {
     free(io);
     return NULL;
   }
+  io->br->free_rrn_address[0] = '\0';
 
   if (DEBUG) {
     puts("@Allocated IO_BUFFER");
@@ -33,11 +55,11 @@ io_buf *alloc_io_buf(void) {
   return io;
 }
 
-void d_insert(io_buf *io, data_record *d, free_rrn_list *ld, u16 rrn) {
+void d_insert(io_buf *io, data_record *d, free_rrn_list *ld, u32 rrn) {
   if (!io || !d || !ld) {
     puts("!!Error: NULL parameters on d_insert");
   }
-  if (rrn == (u16)-1)
+  if (rrn == NULL_RRN)
     rrn = get_free_rrn(ld);
 
   write_data_record(io, d, rrn);
@@ -102,7 +124,7 @@ void load_data_header(io_buf *io) {
   }
 }
 
-void print_data_record(data_record *hr) {
+void print_data_record(const data_record *hr) {
   puts("\n--------DATA RECORD--------");
   printf("Placa: %s\n", hr->placa);
   printf("Modelo: %s\n", hr->modelo);
@@ -114,39 +136,186 @@ void print_data_record(data_record *hr) {
   puts("---------------------------\n");
 }
 
-data_record *load_data_record(io_buf *io, u16 rrn) {
-  if (!io || !io->fp) {
-    puts("!!Invalid IO buffer or file pointer");
+u64 data_offset(io_buf *io, u32 rrn) {
+  return (u64)io->hr->header_size + (u64)io->hr->record_size * rrn;
+}
+
+// the header is padded so records start aligned in a mapping
+static u16 data_header_size(const char *list_name) {
+  size_t size = sizeof(u16) * 2 + strlen(list_name) + 1;
+  size_t align = _Alignof(data_record);
+  return (size + align - 1) / align * align;
+}
+
+// the record at rrn inside the mapping, which is first caught up with
+// records written past it; NULL when rrn is past the end of the file
+static u8 *mapped_record(io_buf *io, u32 rrn) {
+  u64 end = data_offset(io, rrn) + io->hr->record_size;
+  if (end > mapped_size(io)) {
+    pthread_mutex_lock(&io->map_lock);
+    int status = end > mapped_size(io) ? remap_file(io, 0) : IO_SUCCESS;
+    pthread_mutex_unlock(&io->map_lock);
+    if (status != IO_SUCCESS)
+      return NULL;
+  }
+  if (end > mapped_size(io))
+    return NULL;
+  return io->map + end - io->hr->record_size;
+}
+
+// the record at rrn without a copy, valid until io is unmapped and changed
+// by later writes to rrn; NULL when the data file is not mapped, rrn is past
+// its end or an old header leaves the records misaligned
+const data_record *map_data_record(io_buf *io, u32 rrn) {
+  if (!io || !io->map || !io->hr ||
+      io->hr->header_size % _Alignof(data_record) != 0)
     return NULL;
+  return (const data_record *)mapped_record(io, rrn);
+}
+
+// makes every record written so far durable, whatever the policy
+int sync_data(io_buf *io) {
+  if (!io || !io->fp)
+    return IO_ERROR;
+  if (io->map && msync(io->map, mapped_size(io), MS_SYNC) != 0) {
+    puts("!!Error: could not sync mapped data file");
+    return IO_ERROR;
   }
+  if (fdatasync(fileno(io->fp)) != 0) {
+    puts("!!Error: could not sync data file");
+    return IO_ERROR;
+  }
+  return IO_SUCCESS;
+}
 
+data_record *load_data_record(io_buf *io, u32 rrn) {
   data_record *hr = malloc(sizeof(data_record));
-
   if (!hr) {
     puts("!!Memory allocation failed for data record");
     return NULL;
   }
 
-  int byte_offset = io->hr->header_size + (io->hr->record_size * rrn);
-  if (DEBUG)
-    printf("Header size: %d, Record size: %d, RRN: %d, byte_offset: %d\n",
-           io->hr->header_size, io->hr->record_size, rrn, byte_offset);
-
-  if (fseek(io->fp, byte_offset, SEEK_SET) != 0) {
-    puts("!!Error seeking to byte offset");
+  if (load_data_record_into(io, rrn, hr) != IO_SUCCESS) {
     free(hr);
     return NULL;
   }
+  return hr;
+}
+
+int load_data_record_into(io_buf *io, u32 rrn, data_record *dst) {
+  if (!io || !io->fp || !dst) {
+    puts("!!Invalid IO buffer or file pointer");
+    return IO_ERROR;
+  }
+  // a mapped file is its own cache
+  const u8 *at = io->map ? mapped_record(io, rrn) : NULL;
+  if (at) {
+    memcpy(dst, at, sizeof(data_record));
+    return IO_SUCCESS;
+  }
+  u64 writes = 0;
+  if (cache_lookup(io->cache, rrn, dst, &writes))
+    return IO_SUCCESS;
 
-  size_t t = fread(hr, sizeof(data_record), 1, io->fp);
-  if (t != 1) {
+  u64 byte_offset = data_offset(io, rrn);
+  if (DEBUG)
+    printf("Header size: %d, Record size: %d, RRN: %u, byte_offset: %lu\n",
+           io->hr->header_size, io->hr->record_size, rrn,
+           (unsigned long)byte_offset);
+
+  // pread keeps the shared descriptor free of a file position, so readers on
+  // other threads never move each other
+  if (pread(fileno(io->fp), dst, sizeof(data_record), byte_offset) !=
+      (ssize_t)sizeof(data_record)) {
     puts("!!Error while reading data record");
-    free(hr);
-    return NULL;
+    return IO_ERROR;
   }
-  return hr;
+  cache_store(io->cache, rrn, dst, writes);
+  return IO_SUCCESS;
 }
 
+static int compare_slots(const void *a, const void *b) {
+  u64 ra = *(const u64 *)a, rb = *(const u64 *)b;
+  return (ra > rb) - (ra < rb);
+}
+
+// reads the records at rrns into dst in the same order; mapped and cached
+// ones are copied, the rest are read in rrn order with a single pread per run of
+// adjacent records and left out of the cache, so a scan does not evict the
+// records read one at a time
+int load_data_records(io_buf *io, const u32 *rrns, int n, data_record *dst) {
+  if (!io || !io->fp || n < 0 || (n > 0 && (!rrns || !dst)))
+    return IO_ERROR;
+
+  // rrn in the high half, destination slot in the low half
+  u64 *slots = malloc(sizeof(u64) * (n ? n : 1));
+  data_record *run_buf = malloc(sizeof(data_record) * (n ? n : 1));
+  if (!slots || !run_buf) {
+    puts("!!Memory allocation failed for data records");
+    free(slots);
+    free(run_buf);
+    return IO_ERROR;
+  }
+
+  int misses = 0;
+  for (int i = 0; i < n; i++) {
+    const u8 *at = io->map ? mapped_record(io, rrns[i]) : NULL;
+    if (at)
+      memcpy(&dst[i], at, sizeof(data_record));
+    else if (!cache_lookup(io->cache, rrns[i], &dst[i], NULL))
+      slots[misses++] = (u64)rrns[i] << 32 | (u32)i;
+  }
+  n = misses;
+  qsort(slots, n, sizeof(u64), compare_slots);
+
+  int status = IO_SUCCESS;
+  for (int i = 0; i < n;) {
+    u32 first = slots[i] >> 32;
+    int run = 1;
+    while (i + run < n && (u32)(slots[i + run] >> 32) == first + (u32)run)
+      run++;
+
+    ssize_t bytes = pread(fileno(io->fp), run_buf, sizeof(data_record) * run,
+                          data_offset(io, first));
+    size_t got = bytes > 0 ? (size_t)bytes / sizeof(data_record) : 0;
+    if (got != (size_t)run)
+      status = IO_ERROR;
+
+    for (int k = 0; k < run; k++) {
+      data_record *to = &dst[(u32)slots[i + k]];
+      if ((size_t)k < got)
+        *to = run_buf[k];
+      else
+        memset(to, 0, sizeof(data_record));
+    }
+    i += run;
+  }
+
+  free(slots);
+  free(run_buf);
+  return status;
+}
+
+// makes a rename in the directory of path durable
+static void sync_parent(const char *path) {
+  char dir[MAX_ADDRESS];
+  strcpy(dir, path);
+  char *slash = strrchr(dir, '/');
+  if (slash)
+    *slash = '\0';
+  else
+    strcpy(dir, ".");
+
+  int fd = open(slash == dir ? "/" : dir, O_RDONLY);
+  if (fd == -1 || fsync(fd) != 0)
+    puts("!!Error: could not sync data file directory");
+  if (fd != -1)
+    close(fd);
+}
+
+// writes the header and then the old contents to a temporary file, a chunk
+// at a time, and renames it over the data file once it is synced; a crash
+// leaves either the old file or the new one, never a truncated mix
 void prepend_data_header(io_buf *io) {
   if (!io || !io->fp || !io->hr || !io->hr->free_rrn_address) {
     puts("!!Invalid input in prepend_data_header");
@@ -154,7 +323,7 @@ void prepend_data_header(io_buf *io) {
   }
 
   size_t free_rrn_len = strlen(io->hr->free_rrn_address) + 1,
-         header_size = sizeof(u16) * 2 + free_rrn_len;
+         header_size = data_header_size(io->hr->free_rrn_address);
 
   if (io->hr->header_size != header_size) {
     io->hr->header_size = header_size;
@@ -168,68 +337,93 @@ void prepend_data_header(io_buf *io) {
     original_file_size = 0;
   }
 
-  char *buffer = NULL;
-  if (original_file_size > 0) {
-    buffer = malloc(original_file_size);
-    if (buffer == NULL) {
-      puts("!!Memory allocation failed for file content");
-      return;
-    }
+  char tmp_name[MAX_ADDRESS + 4];
+  snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", io->address);
+  FILE *tmp = fopen(tmp_name, "wb");
+  char *buffer = malloc(PREPEND_CHUNK);
+  if (!tmp || !buffer) {
+    puts("!!Error creating temporary data file");
+    if (tmp)
+      fclose(tmp);
+    free(buffer);
+    remove(tmp_name);
+    return;
+  }
+
+  printf("free rrn address: %s\n", io->hr->free_rrn_address);
+  char pad[sizeof(data_record)] = {0};
+  size_t pad_len = header_size - sizeof(u16) * 2 - free_rrn_len;
+  bool ok =
+      fwrite(&io->hr->header_size, sizeof(u16), 1, tmp) == 1 &&
+      fwrite(&io->hr->record_size, sizeof(u16), 1, tmp) == 1 &&
+      fwrite(io->hr->free_rrn_address, free_rrn_len, 1, tmp) == 1 &&
+      (pad_len == 0 || fwrite(pad, pad_len, 1, tmp) == 1);
+  if (!ok)
+    puts("!!Error writing header to file");
 
-    fseek(io->fp, 0, SEEK_SET);
-    if (fread(buffer, 1, original_file_size, io->fp) != original_file_size) {
+  fseek(io->fp, 0, SEEK_SET);
+  for (long left = original_file_size; ok && left > 0;) {
+    size_t chunk = (size_t)left < PREPEND_CHUNK ? (size_t)left : PREPEND_CHUNK;
+    if (fread(buffer, 1, chunk, io->fp) != chunk) {
       puts("!!Error reading original file content");
-      free(buffer);
-      return;
+      ok = false;
+    } else if (fwrite(buffer, 1, chunk, tmp) != chunk) {
+      puts("!!Error writing original content after header");
+      ok = false;
     }
+    left -= chunk;
   }
+  free(buffer);
 
-  fclose(io->fp);
-  io->fp = fopen(io->address, "wb");
-  if (io->fp == NULL) {
-    puts("!!Error reopening file in write mode");
-    if (buffer)
-      free(buffer);
+  // the new file must be on the disk before it replaces the old one
+  ok = ok && fflush(tmp) == 0 && fsync(fileno(tmp)) == 0;
+  if (fclose(tmp) != 0)
+    ok = false;
+  if (!ok || rename(tmp_name, io->address) != 0) {
+    puts("!!Error replacing data file, it was left as it was");
+    remove(tmp_name);
     return;
   }
+  sync_parent(io->address);
 
-  printf("free rrn address: %s\n", io->hr->free_rrn_address);
-  fseek(io->fp, 0, SEEK_SET);
-  if (fwrite(&io->hr->header_size, sizeof(u16), 1, io->fp) != 1 ||
-      fwrite(&io->hr->record_size, sizeof(u16), 1, io->fp) != 1 ||
-      fwrite(io->hr->free_rrn_address, free_rrn_len, 1, io->fp) != 1) {
-    puts("!!Error writing header to file");
-    if (buffer)
-      free(buffer);
+  fclose(io->fp);
+  io->fp = fopen(io->address, "r+b");
+  if (io->fp == NULL) {
+    puts("!!Error reopening file in write mode");
     return;
   }
 
-  if (buffer && original_file_size > 0) {
-    if (fwrite(buffer, 1, original_file_size, io->fp) != original_file_size) {
-      puts("!!Error writing original content after header");
-    }
-    free(buffer);
-  }
-
   if (DEBUG)
     printf("@Successfully written header: %hu %hu %s\n", io->hr->record_size,
            io->hr->header_size, io->hr->free_rrn_address);
-
-  fflush(io->fp);
 }
 
-void write_data_record(io_buf *io, data_record *d, u16 rrn) {
+void write_data_record(io_buf *io, data_record *d, u32 rrn) {
   if (!io || !io->fp || !d) {
     puts("!!Invalid input in write_data_record");
     return;
   }
 
-  int byte_offset = io->hr->header_size + (io->hr->record_size * rrn);
-  fseek(io->fp, byte_offset, SEEK_SET);
-  size_t t = fwrite(d, sizeof(data_record), 1, io->fp);
-  if (t != 1) {
+  // records inside the mapping are written through it, so pointers handed
+  // out by map_data_record see them; appended ones are mapped on next read
+  u8 *at = io->map ? mapped_record(io, rrn) : NULL;
+  if (at) {
+    memcpy(at, d, sizeof(data_record));
+    if (io->sync != DATA_SYNC_NONE) {
+      u64 skew = (u64)(at - io->map) % sysconf(_SC_PAGESIZE);
+      if (msync(at - skew, sizeof(data_record) + skew,
+                io->sync == DATA_SYNC_RECORD ? MS_SYNC : MS_ASYNC) != 0)
+        puts("!!Error: could not sync data record");
+    }
+  } else if (pwrite(fileno(io->fp), d, sizeof(data_record),
+                    data_offset(io, rrn)) != (ssize_t)sizeof(data_record)) {
     puts("!!Error while writing data record");
+    return;
+  } else if (io->sync == DATA_SYNC_RECORD && io->map &&
+             fdatasync(fileno(io->fp)) != 0) {
+    puts("!!Error: could not sync data record");
   }
+  cache_refresh(io->cache, rrn, d);
 }
 
 void populate_header(data_header_record *hp, const char *file_name) {
@@ -241,15 +435,16 @@ void populate_header(data_header_record *hp, const char *file_name) {
   hp->record_size = sizeof(data_record);
   strcpy(hp->free_rrn_address, file_name);
   hp->free_rrn_address[strlen(file_name) + 1] = '\0';
-  hp->header_size = strlen(file_name) + 1 + sizeof(u16) * 2;
+  hp->header_size = data_header_size(file_name);
 }
 
-void load_file(io_buf *io, char *file_name, const char *type) {
+void load_file(io_buf *io, const char *file_name, const char *type) {
   if (!file_name) {
     puts("!!ERROR: no file");
     return;
   }
 
+  unmap_file(io);
   if (io->fp != NULL) {
     if (DEBUG)
       puts("--> buffer already filled\n--> closing logical link\n");
@@ -261,7 +456,7 @@ void load_file(io_buf *io, char *file_name, const char *type) {
   }
 
   memcpy(io->address, file_name, strlen(file_name));
-  io->address[strlen(file_name) + 1] = '\0';
+  io->address[strlen(file_name)] = '\0';
 
   printf("@Loading file: %s\n", file_name);
 
@@ -282,6 +477,10 @@ void load_file(io_buf *io, char *file_name, const char *type) {
     load_index_header(io);
     if (!io->br || !io->hr)
       exit(-1);
+    if (io->use_mmap && map_file(io) != IO_SUCCESS) {
+      puts("!!Error: could not map index file, using stdio");
+      io->use_mmap = false;
+    }
   }
 
   if (strcmp(type, "data") == 0) {
@@ -294,6 +493,21 @@ void load_file(io_buf *io, char *file_name, const char *type) {
       }
     }
     load_data_header(io);
+    if (io->use_mmap && io->hr->record_size != 0 && map_file(io) != IO_SUCCESS) {
+      puts("!!Error: could not map data file, using stdio");
+      io->use_mmap = false;
+    }
+
+    // records cached from another file are no good for this one, and a
+    // mapped file needs no cache
+    if (io->map) {
+      clear_record_cache(io->cache);
+      io->cache = NULL;
+    } else if (io->cache) {
+      empty_record_cache(io->cache);
+    } else {
+      io->cache = alloc_record_cache(RECORD_CACHE_BYTES);
+    }
   }
   if (strcmp(type, "data") == 0 &&
       (io->hr->record_size == 0 || io->hr->header_size == 0)) {
@@ -306,6 +520,7 @@ void load_file(io_buf *io, char *file_name, const char *type) {
       (io->br->page_size == 0 || io->br->header_size == 0)) {
     puts("!!Error: one or more inputs in index_header_record are 0");
     fclose(io->fp);
+    io->fp = NULL;
     return;
   }
 
@@ -385,10 +600,14 @@ void clear_io_buf(io_buf *io) {
   if (!io)
     return;
 
+  unmap_file(io);
   if (io->fp) {
     fclose(io->fp);
     io->fp = NULL;
   }
+  clear_record_cache(io->cache);
+  io->cache = NULL;
+  pthread_mutex_destroy(&io->map_lock);
 
   if (io->hr) {
     free(io->hr->free_rrn_address);
@@ -407,3 +626,92 @@ void clear_io_buf(io_buf *io) {
     puts("@IO_BUFFER cleared");
   }
 }
+
+int map_file(io_buf *io) {
+  if (!io || !io->fp)
+    return IO_ERROR;
+  if (io->map)
+    return IO_SUCCESS;
+
+  // the whole range is reserved up front so growing the mapping never moves
+  // it and page pointers handed out earlier stay valid
+  void *base = mmap(NULL, MAP_RESERVE, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    puts("!!Error: could not reserve address space for mapping");
+    return IO_ERROR;
+  }
+
+  io->map = base;
+  io->map_size = 0;
+  if (remap_file(io, 0) != IO_SUCCESS) {
+    unmap_file(io);
+    return IO_ERROR;
+  }
+
+  if (DEBUG)
+    printf("@Mapped %s (%zu bytes)\n", io->address, io->map_size);
+  return IO_SUCCESS;
+}
+
+int remap_file(io_buf *io, size_t min_size) {
+  if (!io || !io->fp || !io->map)
+    return IO_ERROR;
+
+  fflush(io->fp);
+  int fd = fileno(io->fp);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    puts("!!Error: could not stat mapped file");
+    return IO_ERROR;
+  }
+
+  size_t size = st.st_size;
+  if (size < min_size) {
+    size = ((min_size + MAP_EXTENT - 1) / MAP_EXTENT) * MAP_EXTENT;
+    if (ftruncate(fd, size) != 0) {
+      puts("!!Error: could not extend mapped file");
+      return IO_ERROR;
+    }
+  }
+
+  if (size > MAP_RESERVE) {
+    puts("!!Error: file is larger than the mapping reserve");
+    return IO_ERROR;
+  }
+
+  if (size <= mapped_size(io))
+    return IO_SUCCESS;
+
+  if (mmap(io->map, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+           0) == MAP_FAILED) {
+    puts("!!Error: could not map file");
+    return IO_ERROR;
+  }
+
+  // published once the extent is mapped, so a reader seeing the new size
+  // also sees the pages behind it
+  __atomic_store_n(&io->map_size, size, __ATOMIC_RELEASE);
+  return IO_SUCCESS;
+}
+
+void unmap_file(io_buf *io) {
+  if (!io || !io->map)
+    return;
+
+  msync(io->map, io->map_size, MS_ASYNC);
+  munmap(io->map, MAP_RESERVE);
+  io->map = NULL;
+  io->map_size = 0;
+}
+
+bool in_map(io_buf *io, const void *p) {
+  return io && io->map && (const u8 *)p >= io->map &&
+         (const u8 *)p < io->map + mapped_size(io);
+}
+
+// remap_file grows the mapping while other threads read through it, and
+// callers serialized by the lock they hold around remap_file read it here
+size_t mapped_size(io_buf *io) {
+  return __atomic_load_n(&io->map_size, __ATOMIC_ACQUIRE);
+}
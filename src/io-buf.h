@@ -5,15 +5,25 @@
 
 io_buf *alloc_io_buf(void);
 
-void print_data_record(data_record *hr);
+void print_data_record(const data_record *hr);
 
-void load_file(io_buf *io, char *file_name, const char *type);
+void load_file(io_buf *io, const char *file_name, const char *type);
 
 void create_data_file(io_buf *io, char *file_name);
 
 void load_data_header(io_buf *io);
 
-data_record *load_data_record(io_buf *io, u16 rrn);
+u64 data_offset(io_buf *io, u32 rrn);
+
+data_record *load_data_record(io_buf *io, u32 rrn);
+
+int load_data_record_into(io_buf *io, u32 rrn, data_record *dst);
+
+int load_data_records(io_buf *io, const u32 *rrns, int n, data_record *dst);
+
+const data_record *map_data_record(io_buf *io, u32 rrn);
+
+int sync_data(io_buf *io);
 
 void populate_header(data_header_record *hp, const char *file_name);
 
@@ -21,10 +31,20 @@ void prepend_data_header(io_buf *io);
 
 void write_data_header(io_buf *io);
 
-void write_data_record(io_buf *io, data_record *d, u16 rrn);
+void write_data_record(io_buf *io, data_record *d, u32 rrn);
 
 void clear_io_buf(io_buf *io_buf);
 
-void d_insert(io_buf *io, data_record *d, free_rrn_list *ld, u16 rrn);
+void d_insert(io_buf *io, data_record *d, free_rrn_list *ld, u32 rrn);
+
+int map_file(io_buf *io);
+
+int remap_file(io_buf *io, size_t min_size);
+
+void unmap_file(io_buf *io);
+
+bool in_map(io_buf *io, const void *p);
+
+size_t mapped_size(io_buf *io);
 
 #endif
@@ -0,0 +1,412 @@
+#include "migrate.h"
+#include "b-tree-buf.h"
+#include "free-rrn-list.h"
+
+static u16 get16(const u8 *p) {
+  u16 v;
+  memcpy(&v, p, sizeof(u16));
+  return v;
+}
+
+static u32 get32(const u8 *p) {
+  u32 v;
+  memcpy(&v, p, sizeof(u32));
+  return v;
+}
+
+// 16-bit files used (u16)-1 as the null rrn
+static u32 widen_rrn(u16 rrn) { return rrn == (u16)-1 ? NULL_RRN : rrn; }
+
+static void widen_key(key *k, const u8 *old) {
+  k->data_register_rrn = widen_rrn(get16(old));
+  memcpy(k->id, old + sizeof(u16), TAMANHO_PLACA);
+}
+
+static bool zero_page(const u8 *old, u32 size) {
+  for (u32 i = 0; i < size; i++) {
+    if (old[i])
+      return false;
+  }
+  return true;
+}
+
+// packed pages keep the shared id bytes once and a data rrn in every slot,
+// but slim internal pages have none; false when the page overflows its size
+static bool read_packed_page(old_index *o, const u8 *old, key *keys,
+                             u32 *children, u16 keys_num, u16 child_num,
+                             bool leaf) {
+  u8 prefix = old[14], width = old[15];
+  bool rrns = leaf || o->layout == LAYOUT_PACKED;
+  u32 slot = width + (rrns ? sizeof(u32) : 0);
+  const u8 *shared = old + PLAIN_PAGE_HEADER + sizeof(u32) * child_num;
+  if (prefix + width > TAMANHO_PLACA ||
+      PLAIN_PAGE_HEADER + sizeof(u32) * child_num + prefix + keys_num * slot >
+          o->page_size)
+    return false;
+
+  for (int i = 0; i < keys_num; i++) {
+    const u8 *s = shared + prefix + i * slot;
+    memset(&keys[i], 0, sizeof(key));
+    memcpy(keys[i].id, shared, prefix);
+    memcpy(keys[i].id + prefix, s, width);
+    keys[i].data_register_rrn = rrns ? get32(s + width) : NULL_RRN;
+  }
+  for (int i = 0; i < child_num; i++)
+    children[i] = get32(old + PLAIN_PAGE_HEADER + i * sizeof(u32));
+  return true;
+}
+
+// keys and children of a page in one of the old layouts; false when its
+// counters do not fit the order
+static bool read_old_page(old_index *o, const u8 *old, key *keys,
+                          u32 *children, u16 *keys_num, u16 *child_num,
+                          u8 *leaf) {
+  int order = o->order;
+  if (o->layout == LAYOUT_PACKED || o->layout == LAYOUT_SLIM) {
+    *child_num = get16(old + 8);
+    *keys_num = get16(old + 10);
+    *leaf = old[12];
+    if (!*leaf && *child_num != *keys_num + 1)
+      return false;
+    return read_packed_page(o, old, keys, children, *keys_num, *child_num,
+                            *leaf);
+  }
+
+  bool narrow = o->layout == LAYOUT_NARROW || o->layout == LAYOUT_ORDERED;
+  const u8 *slots;
+
+  if (o->layout == LAYOUT_ORDERED) {
+    *child_num = get16(old + 4);
+    *keys_num = get16(old + 6);
+    *leaf = old[8];
+    slots = old + 10;
+  } else if (o->layout == LAYOUT_NARROW) {
+    const u8 *tail = old + (order - 1) * 10 + 2 + order * 2;
+    *child_num = tail[2];
+    *keys_num = tail[3];
+    *leaf = tail[4];
+    slots = old;
+  } else {
+    // 32-bit pages differ only in the header before the key slots
+    *child_num = get16(old + 8);
+    *keys_num = get16(old + 10);
+    *leaf = old[12];
+    slots = old + (o->layout == LAYOUT_PLAIN ? PLAIN_PAGE_HEADER : 16);
+  }
+
+  if (*keys_num > order - 1 || *child_num > order ||
+      (!*leaf && *child_num != *keys_num + 1))
+    return false;
+
+  u32 slot = narrow ? 10 : sizeof(key);
+  // the original layout keeps the page rrn between keys and children
+  const u8 *rrns =
+      slots + (order - 1) * slot + (o->layout == LAYOUT_NARROW ? 2 : 0);
+  for (int i = 0; i < *keys_num; i++) {
+    if (narrow)
+      widen_key(&keys[i], slots + i * slot);
+    else
+      memcpy(&keys[i], slots + i * slot, sizeof(key));
+  }
+  for (int i = 0; !*leaf && i < *child_num; i++)
+    children[i] = narrow ? widen_rrn(get16(rrns + i * 2)) : get32(rrns + i * 4);
+  return true;
+}
+
+static bool read_page_at(old_index *o, u32 rrn, u8 *old) {
+  return fseeko(o->fp, o->header_size + (off_t)o->page_size * rrn,
+                SEEK_SET) == 0 &&
+         fread(old, o->page_size, 1, o->fp) == 1;
+}
+
+static bool gather_key(old_index *o, const key *k) {
+  if (o->n > 0 && compare_key(&o->keys[o->n - 1], k) >= 0) {
+    printf("!!Error: key %.*s is out of order\n", TAMANHO_PLACA, k->id);
+    return false;
+  }
+  if (o->n == o->cap) {
+    u32 cap = o->cap ? o->cap * 2 : 1024;
+    key *keys = realloc(o->keys, sizeof(key) * cap);
+    if (!keys) {
+      puts("!!Error: could not grow the migrated keys");
+      return false;
+    }
+    o->keys = keys;
+    o->cap = cap;
+  }
+  o->keys[o->n++] = *k;
+  return true;
+}
+
+// appends the keys of the leaves below rrn to o->keys, in order; pages are
+// reached from the root so stale pages on the free list are never read
+static int gather_keys(old_index *o, u32 rrn, int depth) {
+  if (depth == MAX_HEIGHT) {
+    puts("!!Error: index is deeper than MAX_HEIGHT");
+    return IO_ERROR;
+  }
+
+  // a packed page holds at least a byte per key, with a data rrn or a child
+  bool packed = o->layout == LAYOUT_PACKED || o->layout == LAYOUT_SLIM;
+  u32 most = packed ? o->page_size / 5 + 1 : o->order;
+  u8 *old = malloc(o->page_size);
+  key *keys = malloc(sizeof(key) * most);
+  u32 *children = malloc(sizeof(u32) * (most + 1));
+  u16 keys_num, child_num;
+  u8 leaf;
+  int status = old && keys && children && read_page_at(o, rrn, old) &&
+                       read_old_page(o, old, keys, children, &keys_num,
+                                     &child_num, &leaf)
+                   ? IO_SUCCESS
+                   : IO_ERROR;
+  if (status != IO_SUCCESS)
+    printf("!!Error: page %u could not be read\n", rrn);
+
+  for (int i = 0; status == IO_SUCCESS && leaf && i < keys_num; i++)
+    status = gather_key(o, &keys[i]) ? IO_SUCCESS : IO_ERROR;
+  for (int i = 0; status == IO_SUCCESS && !leaf && i < child_num; i++)
+    status = gather_keys(o, children[i], depth + 1);
+
+  free(old);
+  free(keys);
+  free(children);
+  return status;
+}
+
+// the keys of the old tree are bulk loaded into a new one, written next to
+// it along with a fresh free list, so pages come out packed whatever the
+// layout they were in
+int migrate_index(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    printf("!!Error: could not open %s\n", path);
+    return IO_ERROR;
+  }
+
+  u8 head[INDEX_FIXED_HEADER];
+  size_t got = fread(head, 1, sizeof(head), fp);
+  u32 magic = got >= sizeof(u32) ? get32(head) : 0;
+  bool wide = magic == OLD_INDEX_MAGIC || magic == PLAIN_INDEX_MAGIC ||
+              magic == PACKED_INDEX_MAGIC || magic == SLIM_INDEX_MAGIC;
+  if (got < sizeof(u16) * 4 || (wide && got < sizeof(head))) {
+    printf("!!Error: %s is too short to be an index\n", path);
+    fclose(fp);
+    return IO_ERROR;
+  }
+  if (magic == INDEX_MAGIC) {
+    printf("%s already uses the current page layout\n", path);
+    fclose(fp);
+    return IO_SUCCESS;
+  }
+
+  old_layout layout;
+  u32 root, page_size;
+  u16 header_size, order, name_offset;
+  if (wide) {
+    layout = magic == SLIM_INDEX_MAGIC     ? LAYOUT_SLIM
+             : magic == PACKED_INDEX_MAGIC ? LAYOUT_PACKED
+             : magic == PLAIN_INDEX_MAGIC  ? LAYOUT_PLAIN
+                                           : LAYOUT_UNLINKED;
+    root = get32(head + 4);
+    page_size = get32(head + 8);
+    header_size = get16(head + 12);
+    order = get16(head + 14);
+    name_offset = INDEX_FIXED_HEADER;
+  } else {
+    root = widen_rrn(get16(head));
+    page_size = get16(head + 2);
+    header_size = get16(head + 4);
+    order = get16(head + 6);
+    bool ordered = valid_order(order) && page_size == 12 * order;
+    layout = ordered ? LAYOUT_ORDERED : LAYOUT_NARROW;
+    name_offset = ordered ? sizeof(u16) * 4 : sizeof(u16) * 3;
+    if (!ordered)
+      order = (page_size + 3) / 12;
+  }
+
+  // 32-bit pages take their size from the order, less the high key on
+  // unlinked ones
+  u32 unlinked = layout == LAYOUT_UNLINKED ? sizeof(key) : 0;
+  bool valid = layout == LAYOUT_ORDERED ||
+               (layout == LAYOUT_NARROW && (page_size + 3) % 12 == 0) ||
+               (wide && page_size == order_page_size(order) - sizeof(page) +
+                                          PLAIN_PAGE_HEADER - unlinked);
+  if (!valid || !valid_order(order) || header_size <= name_offset ||
+      header_size > MAX_ADDRESS) {
+    printf("!!Error: %s is not an index in a known layout\n", path);
+    fclose(fp);
+    return IO_ERROR;
+  }
+
+  char list_name[MAX_ADDRESS] = {0};
+  fseeko(fp, name_offset, SEEK_SET);
+  if (fread(list_name, header_size - name_offset, 1, fp) != 1) {
+    printf("!!Error: could not read the header of %s\n", path);
+    fclose(fp);
+    return IO_ERROR;
+  }
+
+  // pages never written (holes and unused mapping extents) stay zero, and an
+  // empty index has no root page at all
+  old_index o = {fp, layout, page_size, header_size, order, NULL, 0, 0};
+  u8 *old = malloc(page_size);
+  int status = old ? IO_SUCCESS : IO_ERROR;
+  if (old && read_page_at(&o, root, old) && !zero_page(old, page_size))
+    status = gather_keys(&o, root, 0);
+  free(old);
+  fclose(fp);
+
+  char tmp[MAX_ADDRESS], tmp_list[MAX_ADDRESS];
+  if (snprintf(tmp, MAX_ADDRESS, "%s-migrate", path) >= MAX_ADDRESS ||
+      snprintf(tmp_list, MAX_ADDRESS, "%s-migrate", list_name) >=
+          MAX_ADDRESS) {
+    printf("!!Error: the name of %s is too long to migrate\n", path);
+    free(o.keys);
+    return IO_ERROR;
+  }
+  remove(tmp);
+  remove(tmp_list);
+
+  b_tree_buf *b = status == IO_SUCCESS ? alloc_tree_buf() : NULL;
+  if (!b) {
+    free(o.keys);
+    return IO_ERROR;
+  }
+  b->io->br->order = order;
+  create_index_file(b->io, tmp);
+  if (!b->io->fp) {
+    clear_tree_buf(b);
+    free(o.keys);
+    return IO_ERROR;
+  }
+  strcpy(b->io->br->free_rrn_address, list_name);
+  status = write_index_header(b->io) == BTREE_SUCCESS ? IO_SUCCESS : IO_ERROR;
+  load_list(b->i, tmp_list);
+
+  if (status == IO_SUCCESS &&
+      b_bulk_build(b, o.keys, o.n, BULK_FILL_PERCENT) != BTREE_SUCCESS)
+    status = IO_ERROR;
+  if (status == IO_SUCCESS && b_flush(b) != BTREE_SUCCESS)
+    status = IO_ERROR;
+  clear_tree_buf(b);
+  free(o.keys);
+
+  if (status == IO_SUCCESS &&
+      (rename(tmp, path) != 0 || rename(tmp_list, list_name) != 0)) {
+    printf("!!Error: could not replace %s\n", path);
+    status = IO_ERROR;
+  }
+  if (status != IO_SUCCESS) {
+    remove(tmp);
+    remove(tmp_list);
+    return status;
+  }
+
+  printf("@Migrated %s (order %hu, %u keys)\n", path, order, o.n);
+  return IO_SUCCESS;
+}
+
+int migrate_list(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    printf("!!Error: could not open %s\n", path);
+    return IO_ERROR;
+  }
+
+  fseeko(fp, 0, SEEK_END);
+  off_t size = ftello(fp);
+  fseeko(fp, 0, SEEK_SET);
+
+  u32 head[2] = {0, 0};
+  if (size >= (off_t)LIST_FIXED_HEADER &&
+      fread(head, sizeof(head), 1, fp) == 1 && head[0] == LIST_MAGIC &&
+      size == (off_t)(LIST_FIXED_HEADER + sizeof(u32) * head[1])) {
+    fclose(fp);
+    return IO_SUCCESS;
+  }
+
+  // an empty list file is rebuilt by load_list, so it needs no conversion
+  u16 n = 0;
+  fseeko(fp, 0, SEEK_SET);
+  if (fread(&n, sizeof(u16), 1, fp) != 1 && size > 0) {
+    printf("!!Error: could not read %s\n", path);
+    fclose(fp);
+    return IO_ERROR;
+  }
+
+  u16 *old = malloc(sizeof(u16) * (n ? n : 1));
+  u32 *list = malloc(sizeof(u32) * (n ? n : 1));
+  if (!old || !list || fread(old, sizeof(u16), n, fp) != n) {
+    printf("!!Error: %s is not a 16-bit rrn list\n", path);
+    free(old);
+    free(list);
+    fclose(fp);
+    return IO_ERROR;
+  }
+  fclose(fp);
+
+  for (u16 i = 0; i < n; i++)
+    list[i] = old[i];
+  free(old);
+
+  char tmp[MAX_ADDRESS];
+  snprintf(tmp, MAX_ADDRESS, "%s-migrate", path);
+  FILE *out = fopen(tmp, "wb");
+  u32 wide[2] = {LIST_MAGIC, n};
+  int status = out && fwrite(wide, sizeof(wide), 1, out) == 1 &&
+                       fwrite(list, sizeof(u32), n, out) == n
+                   ? IO_SUCCESS
+                   : IO_ERROR;
+  free(list);
+  if (out && fclose(out) != 0)
+    status = IO_ERROR;
+  if (status == IO_SUCCESS && rename(tmp, path) != 0)
+    status = IO_ERROR;
+
+  if (status != IO_SUCCESS) {
+    printf("!!Error: could not rewrite %s\n", path);
+    remove(tmp);
+    return status;
+  }
+
+  if (DEBUG)
+    printf("@Migrated %s (%hu entries)\n", path, n);
+  return IO_SUCCESS;
+}
+
+// data records hold no rrns, only the free list of the data file changes
+int migrate_data(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    printf("!!Error: could not open %s\n", path);
+    return IO_ERROR;
+  }
+
+  u16 header_size = 0, record_size = 0;
+  char list_name[MAX_ADDRESS] = {0};
+  bool ok = fread(&header_size, sizeof(u16), 1, fp) == 1 &&
+            fread(&record_size, sizeof(u16), 1, fp) == 1 &&
+            record_size == sizeof(data_record) &&
+            header_size > sizeof(u16) * 2 && header_size <= MAX_ADDRESS &&
+            fread(list_name, header_size - sizeof(u16) * 2, 1, fp) == 1;
+  fclose(fp);
+
+  if (!ok) {
+    printf("!!Error: %s has no valid data header\n", path);
+    return IO_ERROR;
+  }
+  return migrate_list(list_name);
+}
+
+int migrate_file(const char *path) {
+  const char *dot = strrchr(path, '.');
+  if (dot && strcmp(dot, ".idx") == 0)
+    return migrate_index(path);
+  if (dot && strcmp(dot, ".dat") == 0)
+    return migrate_data(path);
+  if (dot && strcmp(dot, ".hlp") == 0)
+    return migrate_list(path);
+
+  printf("!!Error: %s is not an .idx, .dat or .hlp file\n", path);
+  return IO_ERROR;
+}
@@ -0,0 +1,14 @@
+#ifndef _MIGRATE_H
+#define _MIGRATE_H
+
+#include "defines.h"
+
+int migrate_index(const char *path);
+
+int migrate_list(const char *path);
+
+int migrate_data(const char *path);
+
+int migrate_file(const char *path);
+
+#endif
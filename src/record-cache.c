@@ -0,0 +1,194 @@
+#include "record-cache.h"
+
+static u32 cache_bucket(record_cache *rc, u32 rrn) {
+  return (rrn * 2654435761u) & (rc->buckets - 1);
+}
+
+// the budget pays for whole entries, so it is a bound on the bytes held
+record_cache *alloc_record_cache(size_t bytes) {
+  size_t capacity = bytes / sizeof(cached_record);
+  if (capacity < MIN_CACHE_RECORDS) {
+    printf("!!Error: record cache needs at least %zu bytes\n",
+           MIN_CACHE_RECORDS * sizeof(cached_record));
+    return NULL;
+  }
+  if (capacity > INT32_MAX)
+    capacity = INT32_MAX;
+
+  record_cache *rc = malloc(sizeof(record_cache));
+  if (!rc) {
+    puts("!!Error: Memory allocation failed");
+    return NULL;
+  }
+
+  rc->buckets = 1;
+  while (rc->buckets < capacity)
+    rc->buckets <<= 1;
+
+  rc->capacity = capacity;
+  rc->entries = malloc(sizeof(cached_record) * capacity);
+  rc->table = malloc(sizeof(i32) * rc->buckets);
+  if (!rc->entries || !rc->table) {
+    puts("!!Error: Memory allocation failed");
+    free(rc->entries);
+    free(rc->table);
+    free(rc);
+    return NULL;
+  }
+
+  pthread_mutex_init(&rc->lock, NULL);
+  empty_record_cache(rc);
+
+  if (DEBUG)
+    printf("@Allocated record cache with %u entries\n", rc->capacity);
+  return rc;
+}
+
+void clear_record_cache(record_cache *rc) {
+  if (!rc)
+    return;
+
+  pthread_mutex_destroy(&rc->lock);
+  free(rc->entries);
+  free(rc->table);
+  free(rc);
+}
+
+// forgets every record, for when the file behind the cache changes
+void empty_record_cache(record_cache *rc) {
+  if (!rc)
+    return;
+
+  pthread_mutex_lock(&rc->lock);
+  memset(rc->table, 0xFF, sizeof(i32) * rc->buckets);
+  for (u32 e = 0; e < rc->capacity; e++) {
+    rc->entries[e].used = false;
+    rc->entries[e].next = -1;
+  }
+  rc->used = 0;
+  rc->hand = 0;
+  rc->hits = rc->misses = 0;
+  rc->writes = 0;
+  pthread_mutex_unlock(&rc->lock);
+}
+
+// replaces the cache of a data file by an empty one of the given size; 0
+// turns caching off. nothing else may use io meanwhile
+int set_cache_budget(io_buf *io, size_t bytes) {
+  if (!io)
+    return IO_ERROR;
+
+  record_cache *rc = NULL;
+  if (bytes > 0 && !(rc = alloc_record_cache(bytes)))
+    return IO_ERROR;
+
+  clear_record_cache(io->cache);
+  io->cache = rc;
+  return IO_SUCCESS;
+}
+
+static i32 find_entry(record_cache *rc, u32 rrn) {
+  for (i32 e = rc->table[cache_bucket(rc, rrn)]; e != -1;
+       e = rc->entries[e].next) {
+    if (rc->entries[e].rrn == rrn)
+      return e;
+  }
+  return -1;
+}
+
+static void unlink_entry(record_cache *rc, i32 e) {
+  i32 *link = &rc->table[cache_bucket(rc, rc->entries[e].rrn)];
+  while (*link != -1) {
+    if (*link == e) {
+      *link = rc->entries[e].next;
+      break;
+    }
+    link = &rc->entries[*link].next;
+  }
+  rc->entries[e].next = -1;
+  rc->entries[e].used = false;
+  rc->used--;
+}
+
+// CLOCK over the entries; one referenced since the hand last passed gets
+// another turn, so vehicles read over and over stay
+static i32 pick_victim(record_cache *rc) {
+  while (true) {
+    u32 e = rc->hand;
+    rc->hand = (rc->hand + 1) % rc->capacity;
+
+    if (!rc->entries[e].used)
+      return e;
+    if (rc->entries[e].ref) {
+      rc->entries[e].ref = false;
+      continue;
+    }
+    unlink_entry(rc, e);
+    return e;
+  }
+}
+
+// on a miss, writes (when given) gets the count of records written so far,
+// to be handed back to cache_store along with the record read from disk
+bool cache_lookup(record_cache *rc, u32 rrn, data_record *dst, u64 *writes) {
+  if (!rc)
+    return false;
+
+  pthread_mutex_lock(&rc->lock);
+  if (writes)
+    *writes = rc->writes;
+  i32 e = find_entry(rc, rrn);
+  if (e != -1) {
+    *dst = rc->entries[e].d;
+    rc->entries[e].ref = true;
+    rc->hits++;
+  } else {
+    rc->misses++;
+  }
+  pthread_mutex_unlock(&rc->lock);
+  return e != -1;
+}
+
+// keeps d as the record at rrn; a new entry starts unreferenced, so records
+// read only once replace each other rather than the ones read again. d is
+// dropped when a record was written since the lookup that missed it, as it
+// may have been read before the write and the write found nothing to refresh
+void cache_store(record_cache *rc, u32 rrn, const data_record *d, u64 writes) {
+  if (!rc)
+    return;
+
+  pthread_mutex_lock(&rc->lock);
+  if (rc->writes != writes) {
+    pthread_mutex_unlock(&rc->lock);
+    return;
+  }
+  i32 e = find_entry(rc, rrn);
+  if (e == -1) {
+    e = pick_victim(rc);
+    u32 bucket = cache_bucket(rc, rrn);
+    rc->entries[e].rrn = rrn;
+    rc->entries[e].used = true;
+    rc->entries[e].ref = false;
+    rc->entries[e].next = rc->table[bucket];
+    rc->table[bucket] = e;
+    rc->used++;
+  } else {
+    rc->entries[e].ref = true;
+  }
+  rc->entries[e].d = *d;
+  pthread_mutex_unlock(&rc->lock);
+}
+
+// a write only updates a cached copy, so loading the data file does not push
+// the hot records out; it is counted so a read it overtook is not stored
+void cache_refresh(record_cache *rc, u32 rrn, const data_record *d) {
+  if (!rc)
+    return;
+
+  pthread_mutex_lock(&rc->lock);
+  rc->writes++;
+  i32 e = find_entry(rc, rrn);
+  if (e != -1)
+    rc->entries[e].d = *d;
+  pthread_mutex_unlock(&rc->lock);
+}
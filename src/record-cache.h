@@ -0,0 +1,20 @@
+#ifndef _RECORD_CACHE
+#define _RECORD_CACHE
+
+#include "defines.h"
+
+record_cache *alloc_record_cache(size_t bytes);
+
+void clear_record_cache(record_cache *rc);
+
+void empty_record_cache(record_cache *rc);
+
+int set_cache_budget(io_buf *io, size_t bytes);
+
+bool cache_lookup(record_cache *rc, u32 rrn, data_record *dst, u64 *writes);
+
+void cache_store(record_cache *rc, u32 rrn, const data_record *d, u64 writes);
+
+void cache_refresh(record_cache *rc, u32 rrn, const data_record *d);
+
+#endif
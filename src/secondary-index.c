@@ -0,0 +1,312 @@
+#include "secondary-index.h"
+#include "b-tree-buf.h"
+#include "buffer-pool.h"
+#include "free-rrn-list.h"
+#include "io-buf.h"
+#include "wal.h"
+
+#include <endian.h>
+
+static const char *const field_names[SECONDARY_FIELDS] = {"marca", "categoria",
+                                                          "status", "ano"};
+
+const char *secondary_name(secondary_field f) {
+  return f < SECONDARY_FIELDS ? field_names[f] : NULL;
+}
+
+// the text of f in d and its size, NULL for the year
+static const char *field_text(const data_record *d, secondary_field f,
+                              size_t *len) {
+  switch (f) {
+  case BY_MARCA:
+    *len = TAMANHO_MARCA;
+    return d->marca;
+  case BY_CATEGORIA:
+    *len = TAMANHO_CATEGORIA;
+    return d->categoria;
+  case BY_STATUS:
+    *len = TAMANHO_STATUS;
+    return d->status;
+  default:
+    *len = 0;
+    return NULL;
+  }
+}
+
+// the first bytes of a text as a big-endian number, which sorts like it
+static u32 text_value(const char *s, size_t len) {
+  size_t n = strnlen(s, len);
+  u32 v = 0;
+  for (size_t i = 0; i < SECONDARY_VALUE; i++)
+    v = v << 8 | (i < n ? (u8)s[i] : 0);
+  return v;
+}
+
+// years are offset so the ones below zero sort first
+static u32 year_value(int ano) { return (u32)ano ^ 0x80000000u; }
+
+static u32 record_value(const data_record *d, secondary_field f) {
+  size_t len;
+  const char *s = field_text(d, f, &len);
+  return s ? text_value(s, len) : year_value(d->ano);
+}
+
+static u32 query_value(secondary_field f, const char *q) {
+  return f == BY_ANO ? year_value(atoi(q)) : text_value(q, strlen(q));
+}
+
+// how the whole field of d sorts against q, which the key only tells for its
+// first bytes
+static int compare_field(const data_record *d, secondary_field f,
+                         const char *q) {
+  size_t len;
+  const char *s = field_text(d, f, &len);
+  if (!s) {
+    int ano = atoi(q);
+    return (d->ano > ano) - (d->ano < ano);
+  }
+  return strncmp(s, q, len);
+}
+
+static key entry_key(u32 value, u32 rrn) {
+  key k;
+  u64 be = htobe64((u64)value << 32 | rrn);
+  memcpy(k.id, &be, sizeof(u64));
+  k.data_register_rrn = rrn;
+  return k;
+}
+
+static int compare_entries(const void *a, const void *b) {
+  return compare_key(a, b);
+}
+
+// the index of f sits next to b's: btree.idx has btree.marca.idx, with its
+// own .hlp list and log
+static bool secondary_path(b_tree_buf *b, secondary_field f, char *path) {
+  char base[MAX_ADDRESS];
+  strcpy(base, b->io->address);
+  char *dot = strrchr(base, '.');
+  if (dot)
+    *dot = '\0';
+  return snprintf(path, MAX_ADDRESS, "%s.%s.idx", base, field_names[f]) <
+         MAX_ADDRESS;
+}
+
+// opens the index file at path, with a log when b has one
+static b_tree_buf *attach_secondary(b_tree_buf *b, const char *path,
+                                    btree_status *status) {
+  b_tree_buf *s = alloc_tree_buf();
+  if (!s) {
+    *status = BTREE_ERROR_MEMORY;
+    return NULL;
+  }
+
+  // a new index takes the page size of the plates one
+  s->io->br->order = b->io->br->order;
+  s->io->use_mmap = b->io->use_mmap;
+  create_index_file(s->io, path);
+  load_file(s->io, path, "index");
+  if (!s->io->fp) {
+    clear_tree_buf(s);
+    *status = BTREE_ERROR_IO;
+    return NULL;
+  }
+  load_list(s->i, s->io->br->free_rrn_address);
+
+  *status = b->wal ? open_wal(s) : BTREE_SUCCESS;
+  if (*status < 0) {
+    clear_tree_buf(s);
+    return NULL;
+  }
+  page *root = load_page(s, s->io->br->root_rrn);
+  set_root(s, root);
+  unpin_page(s, root);
+  return s;
+}
+
+// removes the index file at path along with its list and log
+static void remove_secondary(const char *path) {
+  char other[MAX_ADDRESS];
+  remove(path);
+  strcpy(other, path);
+  char *dot = strrchr(other, '.');
+  strcpy(dot, ".hlp");
+  remove(other);
+  strcpy(dot, ".wal");
+  remove(other);
+}
+
+// opens the index of f and loads it from b when it is new; once open, it
+// follows every insert, remove and update on b, so it must be opened each
+// time b is, before other threads use b. Each index commits apart from b,
+// and a crash between the two leaves one of their logs with work to redo,
+// so an index opened after that is rebuilt from b
+btree_status open_secondary(b_tree_buf *b, io_buf *data, secondary_field f) {
+  if (!b || !b->io || !b->io->fp || !data || f >= SECONDARY_FIELDS)
+    return BTREE_ERROR_INVALID_PAGE;
+  if (b->secondary[f])
+    return BTREE_SUCCESS;
+
+  char path[MAX_ADDRESS];
+  if (!secondary_path(b, f, path)) {
+    printf("!!Error: no room for the path of the %s index\n", field_names[f]);
+    return BTREE_ERROR_IO;
+  }
+
+  btree_status status;
+  b_tree_buf *s = attach_secondary(b, path, &status);
+  if (s && s->root && b->wal &&
+      (b->wal->replayed > 0 || s->wal->replayed > 0)) {
+    printf("Rebuilding the %s index after a crash\n", field_names[f]);
+    clear_tree_buf(s);
+    remove_secondary(path);
+    s = attach_secondary(b, path, &status);
+  }
+  if (!s)
+    return status;
+
+  b->secondary[f] = s;
+  if (!s->root)
+    status = build_secondary(b, data, f);
+  if (status < 0) {
+    b->secondary[f] = NULL;
+    clear_tree_buf(s);
+  }
+  return status;
+}
+
+// loads the empty index of f with a key per record b leads to
+btree_status build_secondary(b_tree_buf *b, io_buf *data, secondary_field f) {
+  b_tree_buf *s = b && f < SECONDARY_FIELDS ? b->secondary[f] : NULL;
+  if (!s || !data)
+    return BTREE_ERROR_INVALID_PAGE;
+
+  size_t n = 0, cap = RANGE_BATCH;
+  key *entries = malloc(sizeof(key) * cap);
+  bt_cursor *c = entries ? bt_cursor_open(b, NULL, NULL) : NULL;
+  if (!c) {
+    free(entries);
+    return BTREE_ERROR_MEMORY;
+  }
+
+  btree_status status = BTREE_SUCCESS;
+  key keys[RANGE_BATCH];
+  data_record records[RANGE_BATCH];
+  int got;
+  while (status == BTREE_SUCCESS &&
+         (got = bt_cursor_next_batch(c, data, keys, records, RANGE_BATCH)) >
+             0) {
+    if (n + got > cap) {
+      key *grown = realloc(entries, sizeof(key) * cap * 2);
+      if (!grown) {
+        status = BTREE_ERROR_MEMORY;
+        break;
+      }
+      entries = grown;
+      cap *= 2;
+    }
+    for (int i = 0; i < got; i++)
+      entries[n++] = entry_key(record_value(&records[i], f),
+                               keys[i].data_register_rrn);
+  }
+  bt_cursor_close(c);
+
+  if (status == BTREE_SUCCESS) {
+    qsort(entries, n, sizeof(key), compare_entries);
+    status = b_bulk_build(s, entries, (int)n, BULK_FILL_PERCENT);
+  }
+  free(entries);
+
+  if (DEBUG)
+    printf("@Built %s index with %zu keys\n", field_names[f], n);
+  return status;
+}
+
+btree_status secondary_insert(b_tree_buf *b, const data_record *d, u32 rrn) {
+  if (!b || !d)
+    return BTREE_ERROR_INVALID_PAGE;
+
+  btree_status status = BTREE_SUCCESS;
+  for (int f = 0; f < SECONDARY_FIELDS && status == BTREE_SUCCESS; f++) {
+    if (b->secondary[f])
+      status = b_insert_key(b->secondary[f],
+                            entry_key(record_value(d, f), rrn));
+  }
+  return status;
+}
+
+// an index missing the key already is where the removal would leave it
+static btree_status remove_entry(b_tree_buf *s, key k) {
+  btree_status status = b_remove_key(s, NULL, NULL, k);
+  return status == BTREE_NOT_FOUND_KEY ? BTREE_SUCCESS : status;
+}
+
+btree_status secondary_remove(b_tree_buf *b, const data_record *d, u32 rrn) {
+  if (!b || !d)
+    return BTREE_ERROR_INVALID_PAGE;
+
+  btree_status status = BTREE_SUCCESS;
+  for (int f = 0; f < SECONDARY_FIELDS && status == BTREE_SUCCESS; f++) {
+    if (b->secondary[f])
+      status = remove_entry(b->secondary[f],
+                            entry_key(record_value(d, f), rrn));
+  }
+  return status;
+}
+
+// moves the keys of the record at rrn whose leading bytes changed
+btree_status secondary_update(b_tree_buf *b, const data_record *old,
+                              const data_record *d, u32 rrn) {
+  if (!b || !old || !d)
+    return BTREE_ERROR_INVALID_PAGE;
+
+  btree_status status = BTREE_SUCCESS;
+  for (int f = 0; f < SECONDARY_FIELDS && status == BTREE_SUCCESS; f++) {
+    u32 was = record_value(old, f), is = record_value(d, f);
+    if (!b->secondary[f] || was == is)
+      continue;
+    status = remove_entry(b->secondary[f], entry_key(was, rrn));
+    if (status == BTREE_SUCCESS)
+      status = b_insert_key(b->secondary[f], entry_key(is, rrn));
+  }
+  return status;
+}
+
+// counts the records whose f lies in [lo, hi] and leaves the data rrns of
+// the first max in out_rrns; lo == hi looks up one value. Years are given
+// in decimal. Keys only hold the leading bytes of a value, so every record
+// they lead to is read to check the whole field
+size_t secondary_search(b_tree_buf *b, io_buf *data, secondary_field f,
+                        const char *lo, const char *hi, u32 *out_rrns,
+                        size_t max) {
+  b_tree_buf *s = b && f < SECONDARY_FIELDS ? b->secondary[f] : NULL;
+  if (!s || !data || !lo || !hi || (max > 0 && !out_rrns))
+    return 0;
+
+  u64 from = (u64)query_value(f, lo) << 32;
+  u64 end = (u64)query_value(f, hi) << 32 | UINT32_MAX;
+  if (from > end)
+    return 0;
+
+  bt_cursor *c = bt_cursor_open_bits(s, from, end);
+  if (!c)
+    return 0;
+
+  size_t found = 0;
+  key keys[RANGE_BATCH];
+  data_record records[RANGE_BATCH];
+  int got;
+  while ((got = bt_cursor_next_batch(c, data, keys, records, RANGE_BATCH)) >
+         0) {
+    for (int i = 0; i < got; i++) {
+      if (compare_field(&records[i], f, lo) < 0 ||
+          compare_field(&records[i], f, hi) > 0)
+        continue;
+      if (found < max)
+        out_rrns[found] = keys[i].data_register_rrn;
+      found++;
+    }
+  }
+  bt_cursor_close(c);
+  return found;
+}
@@ -0,0 +1,23 @@
+#ifndef _SECONDARY_INDEX_H
+#define _SECONDARY_INDEX_H
+
+#include "defines.h"
+
+btree_status open_secondary(b_tree_buf *b, io_buf *data, secondary_field f);
+
+btree_status build_secondary(b_tree_buf *b, io_buf *data, secondary_field f);
+
+btree_status secondary_insert(b_tree_buf *b, const data_record *d, u32 rrn);
+
+btree_status secondary_remove(b_tree_buf *b, const data_record *d, u32 rrn);
+
+btree_status secondary_update(b_tree_buf *b, const data_record *old,
+                              const data_record *d, u32 rrn);
+
+size_t secondary_search(b_tree_buf *b, io_buf *data, secondary_field f,
+                        const char *lo, const char *hi, u32 *out_rrns,
+                        size_t max);
+
+const char *secondary_name(secondary_field f);
+
+#endif
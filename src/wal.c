@@ -0,0 +1,318 @@
+#include "wal.h"
+#include "b-tree-buf.h"
+#include "free-rrn-list.h"
+#include "io-buf.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+wal *alloc_wal(void) {
+  wal *w = malloc(sizeof(wal));
+  if (!w) {
+    puts("!!Error: could not allocate log");
+    return NULL;
+  }
+
+  memset(w, 0, sizeof(wal));
+  w->fd = -1;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->synced, NULL);
+  return w;
+}
+
+void clear_wal(wal *w) {
+  if (!w)
+    return;
+
+  if (w->fd != -1)
+    close(w->fd);
+  free(w->buf);
+  free(w->spare);
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->synced);
+  free(w);
+}
+
+// FNV-1a, enough to tell a torn or stale record from a whole one
+static u32 checksum(u32 sum, const u8 *bytes, size_t n) {
+  for (size_t k = 0; k < n; k++)
+    sum = (sum ^ bytes[k]) * 16777619u;
+  return sum;
+}
+
+static u32 record_sum(const wal_record *r, const void *image) {
+  wal_record h = *r;
+  h.sum = 0;
+  u32 sum = checksum(2166136261u, (const u8 *)&h, sizeof(wal_record));
+  return checksum(sum, image, r->len);
+}
+
+static bool reserve(wal *w, size_t n) {
+  if (w->len + n <= w->cap)
+    return true;
+
+  size_t cap = w->cap ? w->cap : 4096;
+  while (cap < w->len + n)
+    cap *= 2;
+
+  u8 *buf = realloc(w->buf, cap);
+  if (!buf) {
+    puts("!!Error: could not grow log buffer");
+    return false;
+  }
+  w->buf = buf;
+  w->cap = cap;
+  return true;
+}
+
+// hands buf to the file without a sync; the caller holds the lock while no
+// commit is syncing, so the log keeps its order
+static bool write_buffered(wal *w) {
+  if (pwrite(w->fd, w->buf, w->len, w->size) != (ssize_t)w->len)
+    return false;
+  w->size += w->len;
+  w->len = 0;
+  return true;
+}
+
+btree_status wal_append(wal *w, wal_type type, u32 rrn, const void *image,
+                        u32 len) {
+  if (!w)
+    return BTREE_SUCCESS;
+
+  wal_record r = {type, rrn, len, 0};
+  r.sum = record_sum(&r, image);
+
+  pthread_mutex_lock(&w->lock);
+  // a lost record leaves the log unable to redo anything after it
+  if (!w->failed && !reserve(w, sizeof(wal_record) + len))
+    w->failed = true;
+  if (!w->failed) {
+    memcpy(w->buf + w->len, &r, sizeof(wal_record));
+    if (len > 0)
+      memcpy(w->buf + w->len + sizeof(wal_record), image, len);
+    w->len += sizeof(wal_record) + len;
+    w->appended += sizeof(wal_record) + len;
+
+    // long operations spill to the file before they commit
+    if (w->len >= WAL_BUFFER && !w->syncing && !write_buffered(w)) {
+      puts("!!Error: could not write the log");
+      w->failed = true;
+    }
+  }
+
+  btree_status status = w->failed ? BTREE_ERROR_IO : BTREE_SUCCESS;
+  pthread_mutex_unlock(&w->lock);
+  return status;
+}
+
+u64 wal_tail(wal *w) {
+  if (!w)
+    return 0;
+
+  pthread_mutex_lock(&w->lock);
+  u64 tail = w->appended;
+  pthread_mutex_unlock(&w->lock);
+  return tail;
+}
+
+// makes the log durable up to lsn; a thread finding a sync under way waits
+// for it and, if that was not enough, syncs for everything queued meanwhile
+btree_status wal_sync(wal *w, u64 lsn) {
+  if (!w)
+    return BTREE_SUCCESS;
+
+  pthread_mutex_lock(&w->lock);
+  u64 target = lsn < w->appended ? lsn : w->appended;
+  while (w->durable < target && !w->failed) {
+    if (w->syncing) {
+      pthread_cond_wait(&w->synced, &w->lock);
+      continue;
+    }
+
+    // this thread syncs for itself and for every commit queued behind it,
+    // while new records go to the other buffer
+    u8 *out = w->buf;
+    size_t out_cap = w->cap, len = w->len;
+    u64 offset = w->size, end = w->appended;
+    w->buf = w->spare;
+    w->cap = w->spare_cap;
+    w->spare = out;
+    w->spare_cap = out_cap;
+    w->len = 0;
+    w->size += len;
+    w->syncing = true;
+    pthread_mutex_unlock(&w->lock);
+
+    bool ok = pwrite(w->fd, out, len, offset) == (ssize_t)len &&
+              fdatasync(w->fd) == 0;
+
+    pthread_mutex_lock(&w->lock);
+    w->syncing = false;
+    if (ok) {
+      w->durable = end;
+      w->syncs++;
+    } else {
+      puts("!!Error: could not sync the log");
+      w->failed = true;
+    }
+    pthread_cond_broadcast(&w->synced);
+  }
+
+  btree_status status = w->failed ? BTREE_ERROR_IO : BTREE_SUCCESS;
+  pthread_mutex_unlock(&w->lock);
+  return status;
+}
+
+btree_status wal_commit(wal *w) { return wal_sync(w, (u64)-1); }
+
+// empties the log once the index holds everything in it; nothing may be
+// appended meanwhile
+btree_status wal_truncate(wal *w, u32 page_size) {
+  btree_status status = wal_commit(w);
+  if (!w || status != BTREE_SUCCESS)
+    return status;
+
+  u32 head[2] = {WAL_MAGIC, page_size};
+  pthread_mutex_lock(&w->lock);
+  if (ftruncate(w->fd, 0) != 0 ||
+      pwrite(w->fd, head, sizeof(head), 0) != (ssize_t)sizeof(head) ||
+      fdatasync(w->fd) != 0) {
+    puts("!!Error: could not truncate the log");
+    w->failed = true;
+    status = BTREE_ERROR_IO;
+  } else {
+    w->size = WAL_FIXED_HEADER;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return status;
+}
+
+bool wal_full(wal *w) {
+  if (!w)
+    return false;
+
+  pthread_mutex_lock(&w->lock);
+  bool full = w->size + w->len >= WAL_CHECKPOINT;
+  pthread_mutex_unlock(&w->lock);
+  return full;
+}
+
+// applies the records a crash left in the log: page images are written back
+// and the root and free list catch up with them
+static btree_status replay(b_tree_buf *b, wal *w, const char *path) {
+  off_t size = lseek(w->fd, 0, SEEK_END);
+  if (size <= (off_t)WAL_FIXED_HEADER)
+    return BTREE_SUCCESS;
+
+  u8 *log = malloc(size);
+  if (!log)
+    return BTREE_ERROR_MEMORY;
+  if (pread(w->fd, log, size, 0) != size) {
+    printf("!!Error: could not read log %s\n", path);
+    free(log);
+    return BTREE_ERROR_IO;
+  }
+
+  u32 head[2];
+  memcpy(head, log, sizeof(head));
+  if (head[0] != WAL_MAGIC || head[1] != b->io->br->page_size) {
+    printf("!!Error: %s is not a log of this index\n", path);
+    free(log);
+    return BTREE_ERROR_INVALID_PAGE;
+  }
+
+  // the log ends at the first torn record, and a group cut short by the
+  // crash is dropped whole
+  size_t end = WAL_FIXED_HEADER;
+  bool grouped = false;
+  size_t bytes = size;
+  for (size_t at = WAL_FIXED_HEADER; at + sizeof(wal_record) <= bytes;) {
+    wal_record r;
+    memcpy(&r, log + at, sizeof(wal_record));
+    if (r.len > bytes - at - sizeof(wal_record) ||
+        r.sum != record_sum(&r, log + at + sizeof(wal_record)))
+      break;
+    at += sizeof(wal_record) + r.len;
+    if (r.type == WAL_BEGIN)
+      grouped = true;
+    else if (r.type == WAL_END)
+      grouped = false;
+    if (!grouped)
+      end = at;
+  }
+
+  u32 records = 0;
+  btree_status status = BTREE_SUCCESS;
+  for (size_t at = WAL_FIXED_HEADER; at < end && status >= 0; records++) {
+    wal_record r;
+    memcpy(&r, log + at, sizeof(wal_record));
+    page *image = (page *)(log + at + sizeof(wal_record));
+    at += sizeof(wal_record) + r.len;
+
+    if (r.type == WAL_PAGE && r.len == b->io->br->page_size &&
+        image->rrn == r.rrn) {
+      status = write_page(b, image);
+      claim_rrn(b->i, r.rrn);
+    } else if (r.type == WAL_ROOT) {
+      b->io->br->root_rrn = r.rrn;
+    } else if (r.type == WAL_FREE || r.type == WAL_SHADOW) {
+      insert_list(b->i, r.rrn);
+    }
+  }
+  free(log);
+
+  w->replayed = records;
+  if (records > 0)
+    printf("Recovered %u records from log %s\n", records, path);
+  return status;
+}
+
+// opens the log next to the index, named like its .hlp list, and redoes what
+// a crash left in it; call it before the root is loaded
+btree_status open_wal(b_tree_buf *b) {
+  if (!b || !b->io || !b->io->fp || !b->io->br || b->wal)
+    return BTREE_ERROR_INVALID_PAGE;
+
+  // mapped pages are edited in place and the kernel may write them back
+  // before their records are durable, so a logged index goes through the
+  // pool; no page may be handed out of the mapping yet
+  if (b->io->map) {
+    if (b->root) {
+      puts("!!Error: open the log before the root of a mapped index");
+      return BTREE_ERROR_INVALID_PAGE;
+    }
+    unmap_file(b->io);
+    b->io->use_mmap = false;
+    printf("Index %s is not mapped while its log is open\n", b->io->address);
+  }
+
+  char path[MAX_ADDRESS];
+  strcpy(path, b->io->address);
+  char *dot = strrchr(path, '.');
+  if (dot)
+    strcpy(dot, ".wal");
+  else
+    strcat(path, ".wal");
+
+  wal *w = alloc_wal();
+  if (!w)
+    return BTREE_ERROR_MEMORY;
+
+  w->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (w->fd == -1) {
+    printf("!!Error: cannot open log %s\n", path);
+    clear_wal(w);
+    return BTREE_ERROR_IO;
+  }
+
+  btree_status status = replay(b, w, path);
+  if (status < 0) {
+    clear_wal(w);
+    return status;
+  }
+
+  // the replayed pages are synced with the index and the log starts over
+  b->wal = w;
+  return b_flush(b);
+}
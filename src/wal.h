@@ -0,0 +1,25 @@
+#ifndef _WAL_H
+#define _WAL_H
+
+#include "defines.h"
+
+wal *alloc_wal(void);
+
+void clear_wal(wal *w);
+
+btree_status open_wal(b_tree_buf *b);
+
+btree_status wal_append(wal *w, wal_type type, u32 rrn, const void *image,
+                        u32 len);
+
+u64 wal_tail(wal *w);
+
+btree_status wal_sync(wal *w, u64 lsn);
+
+btree_status wal_commit(wal *w);
+
+btree_status wal_truncate(wal *w, u32 page_size);
+
+bool wal_full(wal *w);
+
+#endif
@@ -0,0 +1,53 @@
+#include "test.h"
+
+#include <stdlib.h>
+
+typedef int (*test_fn)(const char *dir);
+
+static int run_test(const char *name, test_fn fn) {
+  char dir[] = "/tmp/bplus-test-XXXXXX";
+  if (!mkdtemp(dir)) {
+    printf("!!Could not create directory for %s\n", name);
+    return 1;
+  }
+
+  int errors = fn(dir);
+  remove_test_dir(dir);
+  printf("%s: %s (%d errors)\n", name, errors ? "FAILED" : "OK", errors);
+  return errors;
+}
+
+int main(void) {
+  int failed = 0;
+
+  failed += run_test("bulk_load", test_bulk_load) != 0;
+  failed += run_test("buffer_pool", test_buffer_pool) != 0;
+  failed += run_test("dirty_pages", test_dirty_pages) != 0;
+  failed += run_test("mmap_index", test_mmap_index) != 0;
+  failed += run_test("key_order", test_key_order) != 0;
+  failed += run_test("runtime_order", test_runtime_order) != 0;
+  failed += run_test("migrate", test_migrate) != 0;
+  failed += run_test("remove", test_remove) != 0;
+  failed += run_test("free_list", test_free_list) != 0;
+  failed += run_test("batch_insert", test_batch_insert) != 0;
+  failed += run_test("cursor", test_cursor) != 0;
+  failed += run_test("readahead", test_readahead) != 0;
+  failed += run_test("search_many", test_search_many) != 0;
+  failed += run_test("concurrent_reads", test_concurrent_reads) != 0;
+  failed += run_test("concurrent_writes", test_concurrent_writes) != 0;
+  failed += run_test("wal", test_wal) != 0;
+  failed += run_test("mapped_log", test_mapped_log) != 0;
+  failed += run_test("snapshot", test_snapshot) != 0;
+  failed += run_test("record_cache", test_record_cache) != 0;
+  failed += run_test("mapped_data", test_mapped_data) != 0;
+  failed += run_test("prepend_header", test_prepend_header) != 0;
+  failed += run_test("prefix_pages", test_prefix_pages) != 0;
+  failed += run_test("separators", test_separators) != 0;
+  failed += run_test("plate_codes", test_plate_codes) != 0;
+  failed += run_test("scratch", test_scratch) != 0;
+  failed += run_test("secondary", test_secondary) != 0;
+  failed += run_test("secondary_crash", test_secondary_crash) != 0;
+
+  printf("ASSERTS FAILED: %d\n", failed);
+  return failed != 0;
+}
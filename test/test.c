@@ -1,38 +1,19 @@
 #include "test.h"
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include "../src/b-tree-buf.h"
+#include "../src/buffer-pool.h"
 #include "../src/free-rrn-list.h"
 #include "../src/io-buf.h"
-#include "../src/queue.h"
-
-void test_queue_search(void) {
-  b_tree_buf *b = alloc_tree_buf();
-  if (!b) {
-    puts("!!Error: Could not allocate b_tree_buf");
-    return;
-  }
-
-  for (u16 i = 0; i < 5; i++) {
-    page *p = alloc_page();
-    if (!p) {
-      puts("!!Error: Could not allocate page");
-      continue;
-    }
-    p->rrn = i;
-    push_page(b, p);
-  }
-
-  for (u16 i = 0; i < 5; i++) {
-    page *p = queue_search(b->q, i);
-    if (p) {
-      printf("Page with RRN %hu found in queue\n", i);
-    } else {
-      printf("Page with RRN %hu not found in queue\n", i);
-    }
-  }
-
-  clear_tree_buf(b);
-}
+#include "../src/migrate.h"
+#include "../src/record-cache.h"
+#include "../src/secondary-index.h"
+#include "../src/wal.h"
 
 void test_tree(b_tree_buf *b, io_buf *data, int n) {
   if (!b || !data) {
@@ -63,7 +44,8 @@ void test_tree(b_tree_buf *b, io_buf *data, int n) {
       errors++;
       printf("!!Error: Page not found for key %s\n", d->placa);
     } else {
-      print_page(p);
+      print_page(b, p);
+      unpin_page(b, p);
     }
   }
   
@@ -84,17 +66,2967 @@ void test_range_search(b_tree_buf *b, io_buf *data) {
 
 void test_leaf_links(b_tree_buf *b) {
   puts("Testing leaf node links...");
+  page *curr = leftmost_leaf(b);
+  while (curr) {
+    print_page(b, curr);
+    page *next = NULL;
+    if (curr->next_leaf != NULL_RRN)
+      next = load_page(b, curr->next_leaf);
+    unpin_page(b, curr);
+    curr = next;
+  }
+}
+
+void make_test_plate(int i, char *placa) {
+  unsigned u = (unsigned)i;
+  snprintf(placa, TAMANHO_PLACA, "%c%c%c%04u", 'A' + (u / 10000 / 676) % 26,
+           'A' + (u / 10000 / 26) % 26, 'A' + (u / 10000) % 26, u % 10000);
+}
+
+io_buf *make_test_data(const char *dir, int n) {
+  char path[MAX_ADDRESS];
+  snprintf(path, MAX_ADDRESS, "%s/veiculos.dat", dir);
+
+  io_buf *data = alloc_io_buf();
+  if (!data)
+    return NULL;
+  create_data_file(data, path);
+  load_file(data, path, "data");
+  if (!data->fp) {
+    clear_io_buf(data);
+    return NULL;
+  }
+
+  // plates are written out of order so the index never sees sorted input
+  for (int i = 0; i < n; i++) {
+    data_record d;
+    memset(&d, 0, sizeof(data_record));
+    make_test_plate((int)(((long)i * 7919 + 13) % n), d.placa);
+    strcpy(d.modelo, "Onix");
+    strcpy(d.marca, "Chevrolet");
+    d.ano = 2000 + i % 25;
+    strcpy(d.categoria, i % 3 ? "Hatch" : "SUV");
+    d.quilometragem = i * 100;
+    strcpy(d.status, i % 2 ? "Alugado" : "Disponivel");
+    write_data_record(data, &d, i);
+  }
+  fflush(data->fp);
+  return data;
+}
+
+b_tree_buf *open_test_tree(const char *dir) {
+  return attach_test_tree(alloc_tree_buf(), dir);
+}
+
+static b_tree_buf *attach_tree(b_tree_buf *b, const char *dir, bool logged) {
+  char path[MAX_ADDRESS];
+  snprintf(path, MAX_ADDRESS, "%s/btree.idx", dir);
+
+  if (!b)
+    return NULL;
+  create_index_file(b->io, path);
+  load_file(b->io, path, "index");
+  load_list(b->i, b->io->br->free_rrn_address);
+  if (logged)
+    open_wal(b);
+  b->root = load_page(b, b->io->br->root_rrn);
+  return b;
+}
+
+b_tree_buf *attach_test_tree(b_tree_buf *b, const char *dir) {
+  return attach_tree(b, dir, true);
+}
+
+// a mapped index is only edited in place without a log
+b_tree_buf *attach_unlogged_tree(b_tree_buf *b, const char *dir) {
+  return attach_tree(b, dir, false);
+}
+
+void remove_test_dir(const char *dir) {
+  DIR *d = opendir(dir);
+  if (!d)
+    return;
+
+  char path[MAX_ADDRESS];
+  struct dirent *e;
+  while ((e = readdir(d))) {
+    if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+      continue;
+    snprintf(path, MAX_ADDRESS, "%s/%s", dir, e->d_name);
+    remove(path);
+  }
+  closedir(d);
+  rmdir(dir);
+}
+
+page *leftmost_leaf(b_tree_buf *b) {
   page *curr = b->root;
-  while (!curr->leaf) {
-    curr = load_page(b, curr->children[0]);
+  pin_page(b, curr);
+  while (curr && !curr->leaf) {
+    page *next = load_page(b, page_children(b, curr)[0]);
+    unpin_page(b, curr);
+    curr = next;
   }
-  
+  return curr;
+}
+
+// walks the leaf chain checking order and occupancy, returns the key count
+int check_leaf_chain(b_tree_buf *b, int *errors) {
+  int count = 0;
+  char last[TAMANHO_PLACA] = "";
+  page *curr = leftmost_leaf(b);
+
   while (curr) {
-    print_page(curr);
-    if (curr->next_leaf != (u16)-1) {
-      curr = load_page(b, curr->next_leaf);
-    } else {
+    if (curr != b->root && curr->keys_num < (b->io->br->order - 1) / 2) {
+      printf("!!Leaf %u is under filled: %d keys\n", curr->rrn,
+             curr->keys_num);
+      (*errors)++;
+    }
+    for (int i = 0; i < curr->keys_num; i++) {
+      key k = page_key(curr, i);
+      if (strcmp(last, k.id) >= 0) {
+        printf("!!Leaf %u out of order at %s\n", curr->rrn, k.id);
+        (*errors)++;
+      }
+      strcpy(last, k.id);
+      count++;
+    }
+    page *next = NULL;
+    if (curr->next_leaf != NULL_RRN)
+      next = load_page(b, curr->next_leaf);
+    unpin_page(b, curr);
+    curr = next;
+  }
+  return count;
+}
+
+int check_all_keys(b_tree_buf *b, io_buf *data, int n) {
+  int errors = 0;
+  u16 pos;
+
+  for (int i = 0; i < n; i++) {
+    data_record *d = load_data_record(data, i);
+    if (!d) {
+      errors++;
+      continue;
+    }
+
+    page *p = b_search(b, d->placa, &pos);
+    key k = p && pos < p->keys_num ? page_key(p, pos) : (key){0};
+    if (!p || pos >= p->keys_num || strcmp(k.id, d->placa) != 0 ||
+        k.data_register_rrn != (u32)i) {
+      printf("!!Key %s (rrn %d) not found\n", d->placa, i);
+      errors++;
+    }
+    unpin_page(b, p);
+    free(d);
+  }
+  return errors;
+}
+
+int test_bulk_load(const char *dir) {
+  int errors = 0;
+  int n = 500;
+
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = open_test_tree(dir);
+  if (!data || !b || b->root) {
+    puts("!!Could not set up bulk load test");
+    return 1;
+  }
+
+  build_tree(b, data, n);
+  if (!b->root) {
+    puts("!!Bulk load produced no root");
+    return 1;
+  }
+
+  if (b->io->br->root_rrn != b->root->rrn) {
+    puts("!!Root RRN was not persisted");
+    errors++;
+  }
+
+  int count = check_leaf_chain(b, &errors);
+  if (count != n) {
+    printf("!!Leaf chain holds %d keys, expected %d\n", count, n);
+    errors++;
+  }
+  errors += check_all_keys(b, data, n);
+
+  // the tree keeps taking regular inserts after a bulk load
+  data_record d;
+  memset(&d, 0, sizeof(data_record));
+  make_test_plate(n + 1, d.placa);
+  write_data_record(data, &d, n);
+  if (b_insert(b, data, &d, n) < 0) {
+    puts("!!Insert after bulk load failed");
+    errors++;
+  }
+  errors += check_all_keys(b, data, n + 1);
+  check_subtree(b, b->root->rrn, NULL, NULL, &errors);
+
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+int pinned_frames(b_tree_buf *b) {
+  int pinned = 0;
+  for (u32 f = 0; f < b->pool->capacity; f++)
+    pinned += b->pool->frames[f].pins > 0;
+  return pinned;
+}
+
+int test_buffer_pool(const char *dir) {
+  int errors = 0;
+  page *pages[MIN_POOL_FRAMES];
+
+  b_tree_buf *b = alloc_tree_buf();
+  if (!b || set_pool_capacity(b, MIN_POOL_FRAMES) != BTREE_SUCCESS) {
+    puts("!!Could not set up buffer pool test");
+    return 1;
+  }
+
+  for (u32 i = 0; i < MIN_POOL_FRAMES; i++) {
+    pages[i] = new_page(b, i);
+    if (!pages[i]) {
+      printf("!!Could not claim frame for page %u\n", i);
+      return errors + 1;
+    }
+  }
+
+  if (new_page(b, MIN_POOL_FRAMES)) {
+    puts("!!Claimed a frame while every frame was pinned");
+    errors++;
+  }
+
+  for (u32 i = 0; i < MIN_POOL_FRAMES; i++)
+    unpin_page(b, pages[i]);
+
+  page *hit = pool_search(b->pool, 3);
+  if (hit != pages[3]) {
+    puts("!!Cached page 3 was not found");
+    errors++;
+  }
+
+  // a pinned page survives any amount of traffic through the other frames
+  for (u32 i = 100; i < 100 + 4 * MIN_POOL_FRAMES; i++) {
+    page *p = new_page(b, i);
+    if (!p) {
+      printf("!!Could not claim frame for page %u\n", i);
+      errors++;
+      continue;
+    }
+    unpin_page(b, p);
+  }
+
+  if (pool_search(b->pool, 3) != hit) {
+    puts("!!Pinned page 3 was evicted");
+    errors++;
+  }
+  unpin_page(b, hit);
+  if (pool_search(b->pool, 0)) {
+    puts("!!Unpinned page 0 was never evicted");
+    errors++;
+  }
+
+  drop_page(b, hit);
+  unpin_page(b, hit);
+  if (pool_search(b->pool, 3)) {
+    puts("!!Dropped page 3 is still cached");
+    errors++;
+  }
+  clear_tree_buf(b);
+
+  // a tree many times larger than the pool is still fully searchable
+  int n = 2000;
+  io_buf *data = make_test_data(dir, n);
+  b = open_test_tree(dir);
+  if (!data || !b || set_pool_capacity(b, MIN_POOL_FRAMES) != BTREE_SUCCESS) {
+    puts("!!Could not set up buffer pool tree test");
+    return errors + 1;
+  }
+
+  build_tree(b, data, n);
+  errors += check_all_keys(b, data, n);
+  int count = check_leaf_chain(b, &errors);
+  if (count != n) {
+    printf("!!Leaf chain holds %d keys, expected %d\n", count, n);
+    errors++;
+  }
+
+  for (int i = n; i < n + 200; i++) {
+    data_record d;
+    memset(&d, 0, sizeof(data_record));
+    make_test_plate(i, d.placa);
+    write_data_record(data, &d, i);
+    if (b_insert(b, data, &d, i) < 0) {
+      printf("!!Insert of %s failed\n", d.placa);
+      errors++;
+    }
+  }
+  errors += check_all_keys(b, data, n + 200);
+
+  if (pinned_frames(b) != 1) {
+    printf("!!%d frames left pinned, only the root should be\n",
+           pinned_frames(b));
+    errors++;
+  }
+
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+// reads the on-disk copy of a page, bypassing the buffer pool
+bool read_disk_page(b_tree_buf *b, u32 rrn, page *out) {
+  FILE *fp = fopen(b->io->address, "rb");
+  if (!fp)
+    return false;
+
+  bool ok = fseeko(fp, page_offset(b, rrn), SEEK_SET) == 0 &&
+            fread(out, b->io->br->page_size, 1, fp) == 1;
+  fclose(fp);
+  return ok;
+}
+
+int test_dirty_pages(const char *dir) {
+  int errors = 0;
+  int n = 300;
+
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = open_test_tree(dir);
+  if (!data || !b) {
+    puts("!!Could not set up dirty page test");
+    return 1;
+  }
+  build_tree(b, data, n);
+
+  data_record d;
+  memset(&d, 0, sizeof(data_record));
+  make_test_plate(n, d.placa);
+  write_data_record(data, &d, n);
+  if (b_insert(b, data, &d, n) < 0) {
+    puts("!!Insert failed");
+    errors++;
+  }
+
+  u16 pos;
+  page *disk = alloc_page(b);
+  page *leaf = b_search(b, d.placa, &pos);
+  if (!leaf || !disk) {
+    puts("!!Could not find inserted key");
+    return errors + 1;
+  }
+
+  // a page created by a split may not even exist on disk yet
+  u32 size = b->io->br->page_size;
+  if (read_disk_page(b, leaf->rrn, disk) && memcmp(disk, leaf, size) == 0) {
+    puts("!!Modified page was written before b_flush");
+    errors++;
+  }
+
+  if (b_flush(b) != BTREE_SUCCESS || !read_disk_page(b, leaf->rrn, disk) ||
+      memcmp(disk, leaf, size) != 0) {
+    puts("!!b_flush did not write the modified page");
+    errors++;
+  }
+  unpin_page(b, leaf);
+  clear_page(disk);
+
+  // dirty pages written back on eviction and at shutdown survive a reopen
+  set_pool_capacity(b, MIN_POOL_FRAMES);
+  for (int i = n + 1; i < 2 * n; i++) {
+    make_test_plate(i, d.placa);
+    write_data_record(data, &d, i);
+    if (b_insert(b, data, &d, i) < 0)
+      errors++;
+  }
+  fflush(data->fp);
+  clear_tree_buf(b);
+
+  b = open_test_tree(dir);
+  if (!b || !b->root) {
+    puts("!!Could not reopen tree");
+    return errors + 1;
+  }
+  errors += check_all_keys(b, data, 2 * n);
+  int count = check_leaf_chain(b, &errors);
+  if (count != 2 * n) {
+    printf("!!Leaf chain holds %d keys after reopen, expected %d\n", count,
+           2 * n);
+    errors++;
+  }
+
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+int test_mmap_index(const char *dir) {
+  int errors = 0;
+  int n = 1000;
+
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = alloc_tree_buf();
+  if (b)
+    b->io->use_mmap = true;
+  b = attach_unlogged_tree(b, dir);
+  if (!data || !b || !b->io->map) {
+    puts("!!Could not set up mapped index test");
+    return 1;
+  }
+
+  build_tree(b, data, n);
+  if (!in_map(b->io, b->root)) {
+    puts("!!Root page is not served from the mapping");
+    errors++;
+  }
+  errors += check_all_keys(b, data, n);
+
+  // enough inserts to grow the file by at least one extent
+  size_t built_size = b->io->map_size;
+  int total = n + (int)(MAP_EXTENT / b->io->br->page_size);
+  data_record d;
+  memset(&d, 0, sizeof(data_record));
+  for (int i = n; i < total; i++) {
+    make_test_plate(i, d.placa);
+    write_data_record(data, &d, i);
+    if (b_insert(b, data, &d, i) < 0)
+      errors++;
+  }
+  fflush(data->fp);
+
+  if (b->io->map_size <= built_size || b->io->map_size % MAP_EXTENT != 0) {
+    puts("!!Mapping did not grow");
+    errors++;
+  }
+  errors += check_all_keys(b, data, total);
+  if (pinned_frames(b) != 0) {
+    puts("!!Mapped mode left pages in the pool");
+    errors++;
+  }
+  clear_tree_buf(b);
+
+  // pages written through the mapping read back through stdio
+  b = open_test_tree(dir);
+  if (!b || !b->root || b->io->map) {
+    puts("!!Could not reopen tree without mapping");
+    return errors + 1;
+  }
+  errors += check_all_keys(b, data, total);
+  int count = check_leaf_chain(b, &errors);
+  if (count != total) {
+    printf("!!Leaf chain holds %d keys, expected %d\n", count, total);
+    errors++;
+  }
+
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+int sign(int x) { return (x > 0) - (x < 0); }
+
+int test_key_order(const char *dir) {
+  (void)dir;
+  int errors = 0;
+  key a, b;
+  b_tree_buf *t = alloc_tree_buf();
+  data_record d;
+  memset(&d, 0, sizeof(data_record));
+
+  const char *plates[] = {"AAA0000", "AAA0001", "AAB0000", "ZZZ9999",
+                          "ABC1D23", "ABC1234", "A",       "AB"};
+  int count = sizeof(plates) / sizeof(plates[0]);
+  for (int i = 0; i < count; i++) {
+    for (int j = 0; j < count; j++) {
+      strcpy(d.placa, plates[i]);
+      populate_key(&a, &d, 0);
+      strcpy(d.placa, plates[j]);
+      populate_key(&b, &d, 0);
+      if (compare_key(&a, &b) != sign(strcmp(plates[i], plates[j]))) {
+        printf("!!compare_key(%s, %s) disagrees with strcmp\n", plates[i],
+               plates[j]);
+        errors++;
+      }
+    }
+  }
+
+  // every slot and every gap of a page resolves to the right position
+  page *p = alloc_page(t);
+  key keys[MAX_ORDER];
+  for (int n = 0; n < t->io->br->order; n++) {
+    for (int i = 0; i < n; i++) {
+      make_test_plate(2 * i + 1, d.placa);
+      populate_key(&keys[i], &d, i);
+    }
+    pack_page(t, p, keys, n, NULL, 0);
+    for (int i = 0; i <= 2 * n; i++) {
+      int pos;
+      make_test_plate(i, d.placa);
+      populate_key(&a, &d, 0);
+      int status = search_in_page(p, a, &pos);
+      int expected = i % 2 ? BTREE_FOUND_KEY : BTREE_NOT_FOUND_KEY;
+      if (status != expected || pos != i / 2) {
+        printf("!!search_in_page(%s) in %d keys gave %d at %d\n", d.placa, n,
+               status, pos);
+        errors++;
+      }
+    }
+  }
+  clear_page(p);
+  clear_tree_buf(t);
+
+  // query strings normalize to the same value as stored keys
+  if (key_norm(plates[count - 1]) != key_bits(&b)) {
+    puts("!!key_norm disagrees with a stored key");
+    errors++;
+  }
+
+  return errors;
+}
+
+int test_runtime_order(const char *dir) {
+  int errors = 0;
+  int n = 3000;
+  u32 order = page_order(4096);
+
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = alloc_tree_buf();
+  if (b)
+    b->io->br->order = order;
+  b = attach_test_tree(b, dir);
+  if (!data || !b || b->root) {
+    puts("!!Could not set up runtime order test");
+    return 1;
+  }
+
+  if (b->io->br->order != order || b->io->br->page_size > 4096 ||
+      b->io->br->page_size != order_page_size(order)) {
+    printf("!!Index created with order %hu and %u byte pages\n",
+           b->io->br->order, b->io->br->page_size);
+    errors++;
+  }
+
+  build_tree(b, data, n);
+  errors += check_all_keys(b, data, n);
+
+  // wide pages keep splitting correctly on regular inserts
+  data_record d;
+  memset(&d, 0, sizeof(data_record));
+  for (int i = n; i < 2 * n; i++) {
+    make_test_plate(i, d.placa);
+    write_data_record(data, &d, i);
+    if (b_insert(b, data, &d, i) < 0)
+      errors++;
+  }
+  fflush(data->fp);
+  clear_tree_buf(b);
+
+  // the stored order wins over the one asked for when reopening
+  b = alloc_tree_buf();
+  if (b)
+    b->io->br->order = DEFAULT_ORDER;
+  b = attach_test_tree(b, dir);
+  if (!b || !b->root || b->io->br->order != order) {
+    puts("!!Reopened index did not keep its order");
+    return errors + 1;
+  }
+  if (b->root->leaf || b->root->child_num < 2) {
+    puts("!!Wide tree has an unexpected root");
+    errors++;
+  }
+  errors += check_all_keys(b, data, 2 * n);
+  int count = check_leaf_chain(b, &errors);
+  if (count != 2 * n) {
+    printf("!!Leaf chain holds %d keys, expected %d\n", count, 2 * n);
+    errors++;
+  }
+  clear_tree_buf(b);
+
+  // an index header without a valid order is refused, not overwritten
+  char path[MAX_ADDRESS];
+  snprintf(path, MAX_ADDRESS, "%s/btree.idx", dir);
+  FILE *fp = fopen(path, "r+b");
+  u16 bad_order = MAX_ORDER + 1;
+  if (!fp || fseek(fp, INDEX_FIXED_HEADER - sizeof(u16), SEEK_SET) != 0 ||
+      fwrite(&bad_order, sizeof(u16), 1, fp) != 1) {
+    puts("!!Could not corrupt index header");
+    errors++;
+  }
+  if (fp)
+    fclose(fp);
+
+  b = alloc_tree_buf();
+  create_index_file(b->io, path);
+  if (b->io->fp) {
+    puts("!!Index with an unknown layout was opened");
+    errors++;
+  }
+  clear_tree_buf(b);
+
+  clear_io_buf(data);
+  return errors;
+}
+
+// writes a 16-bit rrn list, as found before rrns were widened
+bool write_legacy_list(const char *path, const u32 *list, u16 n) {
+  FILE *fp = fopen(path, "wb");
+  if (!fp)
+    return false;
+
+  bool ok = fwrite(&n, sizeof(u16), 1, fp) == 1;
+  for (u16 i = 0; ok && i < n; i++) {
+    u16 rrn = list[i];
+    ok = fwrite(&rrn, sizeof(u16), 1, fp) == 1;
+  }
+  return fclose(fp) == 0 && ok;
+}
+
+static void put16(FILE *fp, u32 v) {
+  u16 narrow = v == NULL_RRN ? (u16)-1 : (u16)v;
+  fwrite(&narrow, sizeof(u16), 1, fp);
+}
+
+// old pages held at most order - 1 keys, so legacy files get an order that
+// takes the keys of the fullest page; a page's capacity would grow the order
+// with every migration
+static u32 legacy_order(b_tree_buf *b) {
+  u32 order = b->io->br->order;
+  u32 pages = get_last_free_rrn(b->i);
+  for (u32 rrn = 0; rrn < pages; rrn++) {
+    page *p = load_page(b, rrn);
+    if (p && p->keys_num + 1u > order)
+      order = p->keys_num + 1;
+    unpin_page(b, p);
+  }
+  return order;
+}
+
+// pages before plate codes had a 28-byte header and room for order - 1 full
+// keys and order children
+static u32 plain_page_size(u32 order) {
+  return PLAIN_PAGE_HEADER + sizeof(key) * (order - 1) + sizeof(u32) * order;
+}
+
+// keys and children of p in the fixed slots of a legacy order
+static void legacy_slots(b_tree_buf *b, page *p, u32 order, key *keys,
+                         u32 *children) {
+  memset(keys, 0, sizeof(key) * (order - 1));
+  memset(children, 0, sizeof(u32) * order);
+  unpack_keys(p, keys);
+  memcpy(children, page_children(b, p), sizeof(u32) * p->child_num);
+}
+
+// rewrites the tree in one of the two 16-bit layouts: the original one
+// (keys first, u8 counters) or the one with the order in the header
+bool write_legacy_index(b_tree_buf *b, const char *path, bool ordered) {
+  FILE *fp = fopen(path, "wb");
+  if (!fp)
+    return false;
+
+  u32 order = legacy_order(b);
+  const char *name = b->io->br->free_rrn_address;
+  u16 page_size = ordered ? 12 * order : 12 * order - 3;
+  u16 header_size = sizeof(u16) * (ordered ? 4 : 3) + strlen(name) + 1;
+
+  put16(fp, b->io->br->root_rrn);
+  put16(fp, page_size);
+  put16(fp, header_size);
+  if (ordered)
+    put16(fp, order);
+  fwrite(name, strlen(name) + 1, 1, fp);
+
+  u8 zero[1] = {0};
+  key keys[MAX_ORDER];
+  u32 children[MAX_ORDER];
+  u32 pages = get_last_free_rrn(b->i);
+  for (u32 rrn = 0; rrn < pages; rrn++) {
+    page *p = load_page(b, rrn);
+    if (!p) {
+      fclose(fp);
+      return false;
+    }
+    legacy_slots(b, p, order, keys, children);
+    if (ordered) {
+      put16(fp, p->rrn);
+      put16(fp, p->next_leaf);
+      put16(fp, p->child_num);
+      put16(fp, p->keys_num);
+      fwrite(&p->leaf, 1, 1, fp);
+      fwrite(zero, 1, 1, fp);
+    }
+    for (u32 i = 0; i < order - 1; i++) {
+      put16(fp, keys[i].data_register_rrn);
+      fwrite(keys[i].id, TAMANHO_PLACA, 1, fp);
+    }
+    if (!ordered)
+      put16(fp, p->rrn);
+    for (u32 i = 0; i < order; i++)
+      put16(fp, children[i]);
+    if (!ordered) {
+      u8 tail[3] = {p->child_num, p->keys_num, p->leaf};
+      put16(fp, p->next_leaf);
+      fwrite(tail, sizeof(tail), 1, fp);
+    }
+    unpin_page(b, p);
+  }
+
+  u32 *list = load_rrns(b->i);
+  bool ok = fclose(fp) == 0 && list &&
+            write_legacy_list(name, list, b->i->n + 1);
+  free(list);
+  return ok;
+}
+
+// rewrites the tree with 32-bit rrns and full keys in fixed slots; unlinked
+// pages, as written before pages were linked on every level, also lack the
+// level and high key
+static bool write_wide_index(b_tree_buf *b, const char *path, bool linked) {
+  FILE *fp = fopen(path, "wb");
+  if (!fp)
+    return false;
+
+  u32 order = legacy_order(b);
+  u32 page_size = plain_page_size(order) - (linked ? 0 : sizeof(key));
+  u32 head[3] = {linked ? PLAIN_INDEX_MAGIC : OLD_INDEX_MAGIC,
+                 b->io->br->root_rrn, page_size};
+  u16 sizes[2] = {b->io->br->header_size, order};
+  char name[MAX_ADDRESS] = {0};
+  strcpy(name, b->io->br->free_rrn_address);
+  bool ok = fwrite(head, sizeof(head), 1, fp) == 1 &&
+            fwrite(sizes, sizeof(sizes), 1, fp) == 1 &&
+            fwrite(name, b->io->br->header_size - INDEX_FIXED_HEADER, 1, fp) == 1;
+
+  u8 zero[3] = {0};
+  key keys[MAX_ORDER];
+  u32 children[MAX_ORDER];
+  u32 pages = get_last_free_rrn(b->i);
+  for (u32 rrn = 0; ok && rrn < pages; rrn++) {
+    page *p = load_page(b, rrn);
+    if (!p)
+      break;
+    legacy_slots(b, p, order, keys, children);
+    ok = fwrite(p, sizeof(u32) * 3, 1, fp) == 1 &&
+         fwrite(&p->leaf, 1, 1, fp) == 1;
+    if (linked)
+      ok = ok && fwrite(&p->level, 1, 1, fp) == 1 &&
+           fwrite(zero, 2, 1, fp) == 1 &&
+           fwrite(&p->high, sizeof(key), 1, fp) == 1;
+    else
+      ok = ok && fwrite(zero, 3, 1, fp) == 1;
+    ok = ok && fwrite(keys, sizeof(key), order - 1, fp) == order - 1 &&
+         fwrite(children, sizeof(u32), order, fp) == order;
+    unpin_page(b, p);
+  }
+  return fclose(fp) == 0 && ok;
+}
+
+bool write_unlinked_index(b_tree_buf *b, const char *path) {
+  return write_wide_index(b, path, false);
+}
+
+// pages of the layout before prefix compression: linked, with full keys
+bool write_plain_index(b_tree_buf *b, const char *path) {
+  return write_wide_index(b, path, true);
+}
+
+// rewrites the tree as packed pages of raw ids with a data rrn in every slot,
+// internal pages included, as written before separators were cut short; slim
+// pages, written before plate codes, keep data rrns on leaves only
+static bool write_raw_index(b_tree_buf *b, const char *path, bool slim) {
+  FILE *fp = fopen(path, "wb");
+  if (!fp)
+    return false;
+
+  u32 order = legacy_order(b);
+  u32 page_size = plain_page_size(order);
+  u32 head[3] = {slim ? SLIM_INDEX_MAGIC : PACKED_INDEX_MAGIC,
+                 b->io->br->root_rrn, page_size};
+  u16 sizes[2] = {b->io->br->header_size, order};
+  char name[MAX_ADDRESS] = {0};
+  strcpy(name, b->io->br->free_rrn_address);
+  bool ok = fwrite(head, sizeof(head), 1, fp) == 1 &&
+            fwrite(sizes, sizeof(sizes), 1, fp) == 1 &&
+            fwrite(name, b->io->br->header_size - INDEX_FIXED_HEADER, 1, fp) == 1;
+
+  u8 *out = malloc(page_size);
+  key keys[MAX_ORDER];
+  u32 pages = get_last_free_rrn(b->i);
+  for (u32 rrn = 0; ok && out && rrn < pages; rrn++) {
+    page *p = load_page(b, rrn);
+    if (!p)
       break;
+    unpack_keys(p, keys);
+    // the page may hold codes, so prefix and width come from the ids
+    u8 prefix = p->keys_num > 0 ? strnlen(keys[0].id, TAMANHO_PLACA) : 0;
+    u8 width = 0;
+    for (int i = 1; i < p->keys_num; i++)
+      while (prefix > 0 && memcmp(keys[i].id, keys[0].id, prefix) != 0)
+        prefix--;
+    for (int i = 0; i < p->keys_num; i++) {
+      u8 len = strnlen(keys[i].id, TAMANHO_PLACA);
+      width = len > prefix + width ? len - prefix : width;
+    }
+    bool rrns = p->leaf || !slim;
+
+    memset(out, 0, page_size);
+    memcpy(out, p, 14);
+    out[14] = prefix;
+    out[15] = width;
+    memcpy(out + 16, &p->high, sizeof(key));
+    memcpy(out + PLAIN_PAGE_HEADER, page_children(b, p),
+           sizeof(u32) * p->child_num);
+
+    u8 *s = out + PLAIN_PAGE_HEADER + sizeof(u32) * p->child_num;
+    if (p->keys_num > 0)
+      memcpy(s, keys[0].id, prefix);
+    s += prefix;
+    for (int i = 0; i < p->keys_num; i++) {
+      memcpy(s, keys[i].id + prefix, width);
+      s += width;
+      if (rrns) {
+        memcpy(s, &keys[i].data_register_rrn, sizeof(u32));
+        s += sizeof(u32);
+      }
     }
+    ok = fwrite(out, page_size, 1, fp) == 1;
+    unpin_page(b, p);
   }
+  free(out);
+  return fclose(fp) == 0 && ok;
+}
+
+bool write_packed_index(b_tree_buf *b, const char *path) {
+  return write_raw_index(b, path, false);
+}
+
+bool write_slim_index(b_tree_buf *b, const char *path) {
+  return write_raw_index(b, path, true);
+}
+
+int test_migrate(const char *dir) {
+  int errors = 0;
+  int n = 600;
+
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = open_test_tree(dir);
+  if (!data || !b) {
+    puts("!!Could not set up migration test");
+    return 1;
+  }
+  build_tree(b, data, n);
+  b_flush(b);
+
+  char path[MAX_ADDRESS], legacy[MAX_ADDRESS];
+  snprintf(path, MAX_ADDRESS, "%s/btree.idx", dir);
+  snprintf(legacy, MAX_ADDRESS, "%s/legacy.idx", dir);
+
+  // both 16-bit layouts, 32-bit pages without high keys, pages with full
+  // keys, packed pages with data rrns on internal pages, then packed pages
+  // of raw ids
+  for (int layout = 0; layout < 6; layout++) {
+    bool written = layout < 2    ? write_legacy_index(b, legacy, layout)
+                   : layout == 2 ? write_unlinked_index(b, legacy)
+                   : layout == 3 ? write_plain_index(b, legacy)
+                   : layout == 4 ? write_packed_index(b, legacy)
+                                 : write_slim_index(b, legacy);
+    if (!written) {
+      puts("!!Could not write legacy index");
+      return errors + 1;
+    }
+    clear_tree_buf(b);
+
+    if (migrate_file(legacy) != IO_SUCCESS || rename(legacy, path) != 0) {
+      printf("!!Could not migrate layout %d\n", layout);
+      return errors + 1;
+    }
+
+    b = open_test_tree(dir);
+    if (!b || !b->root) {
+      printf("!!Migrated layout %d did not open\n", layout);
+      return errors + 1;
+    }
+    errors += check_all_keys(b, data, n);
+    check_subtree(b, b->root->rrn, NULL, NULL, &errors);
+    int count = check_leaf_chain(b, &errors);
+    if (count != n + layout) {
+      printf("!!Leaf chain holds %d keys after migration, expected %d\n",
+             count, n + layout);
+      errors++;
+    }
+
+    // the migrated tree keeps growing past what 16-bit rrns could address
+    data_record d;
+    memset(&d, 0, sizeof(data_record));
+    make_test_plate(n + layout, d.placa);
+    write_data_record(data, &d, 70000 + layout);
+    if (b_insert(b, data, &d, 70000 + layout) < 0) {
+      puts("!!Insert with a wide data rrn failed");
+      errors++;
+    }
+    u16 pos;
+    page *p = b_search(b, d.placa, &pos);
+    if (!p || page_key(p, pos).data_register_rrn != (u32)(70000 + layout)) {
+      puts("!!Wide data rrn was not stored");
+      errors++;
+    }
+    unpin_page(b, p);
+  }
+
+  if (migrate_file(path) != IO_SUCCESS) {
+    puts("!!Migrating a wide index again failed");
+    errors++;
+  }
+  clear_tree_buf(b);
+
+  // the data file keeps its records, only its free list is widened
+  u32 entries[] = {3, 5, 9, 601};
+  free_rrn_list *l = alloc_ilist();
+  if (!write_legacy_list(data->hr->free_rrn_address, entries, 4) ||
+      migrate_file(data->address) != IO_SUCCESS) {
+    puts("!!Could not migrate data free list");
+    errors++;
+  }
+  load_list(l, data->hr->free_rrn_address);
+  u32 *list = load_rrns(l);
+  if (l->n + 1 != 4 || !list || memcmp(list, entries, sizeof(entries)) != 0) {
+    puts("!!Migrated data free list lost entries");
+    errors++;
+  }
+  free(list);
+  clear_ilist(l);
+
+  clear_io_buf(data);
+  return errors;
+}
+
+// checks bounds, high keys, levels, occupancy, fan-out and the links between
+// siblings below rrn, returns the leaf depth
+int check_subtree(b_tree_buf *b, u32 rrn, const key *lo, const key *hi,
+                  int *errors) {
+  page *p = load_page(b, rrn);
+  if (!p) {
+    printf("!!Page %u could not be loaded\n", rrn);
+    (*errors)++;
+    return -1;
+  }
+
+  key max;
+  set_max_key(&max);
+  if (compare_key(&p->high, hi ? hi : &max) != 0) {
+    printf("!!Page %u has a high key off its parent's bound\n", p->rrn);
+    (*errors)++;
+  }
+
+  if (p != b->root && p->keys_num < (b->io->br->order - 1) / 2) {
+    printf("!!Page %u is under filled: %d keys\n", p->rrn, p->keys_num);
+    (*errors)++;
+  }
+  key *keys = malloc(sizeof(key) * (p->keys_num + 1));
+  unpack_keys(p, keys);
+  for (int i = 0; i < p->keys_num; i++) {
+    if ((lo && compare_key(&keys[i], lo) < 0) ||
+        (hi && compare_key(&keys[i], hi) >= 0) ||
+        (i > 0 && compare_key(&keys[i - 1], &keys[i]) >= 0)) {
+      printf("!!Key %.*s of page %u is out of place\n", TAMANHO_PLACA,
+             keys[i].id, p->rrn);
+      (*errors)++;
+    }
+  }
+
+  int depth = 0;
+  if (!p->leaf) {
+    if (p->child_num != p->keys_num + 1) {
+      printf("!!Page %u has %d keys and %d children\n", p->rrn, p->keys_num,
+             p->child_num);
+      (*errors)++;
+    }
+    u32 *children = page_children(b, p);
+    for (int i = 0; i < p->child_num; i++) {
+      int d = check_subtree(b, children[i], i > 0 ? &keys[i - 1] : lo,
+                            i < p->keys_num ? &keys[i] : hi, errors);
+      if (i == 0) {
+        depth = d;
+      } else if (d != depth) {
+        printf("!!Children of page %u end at different depths\n", p->rrn);
+        (*errors)++;
+      }
+
+      page *child = i + 1 < p->child_num ? load_page(b, children[i]) : NULL;
+      if (child && child->next_leaf != children[i + 1]) {
+        printf("!!Page %u does not link to its right sibling\n", child->rrn);
+        (*errors)++;
+      }
+      unpin_page(b, child);
+    }
+    depth++;
+  }
+  if (p->level != depth) {
+    printf("!!Page %u is at level %d, %d above the leaves\n", p->rrn,
+           p->level, depth);
+    (*errors)++;
+  }
+  free(keys);
+  unpin_page(b, p);
+  return depth;
+}
+
+bool has_key(b_tree_buf *b, const char *placa) {
+  u16 pos;
+  page *p = b_search(b, placa, &pos);
+  bool found =
+      p && pos < p->keys_num && strcmp(page_key(p, pos).id, placa) == 0;
+  unpin_page(b, p);
+  return found;
+}
+
+int remove_with_order(const char *dir, u16 order) {
+  int errors = 0;
+  int n = 1500;
+
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = alloc_tree_buf();
+  if (b)
+    b->io->br->order = order;
+  b = attach_test_tree(b, dir);
+  char list_path[MAX_ADDRESS];
+  snprintf(list_path, MAX_ADDRESS, "%s/veiculos.hlp", dir);
+  free_rrn_list *ld = alloc_ilist();
+  load_list(ld, list_path);
+  if (!data || !b || b->root || !ld->io->fp) {
+    puts("!!Could not set up remove test");
+    return 1;
+  }
+
+  // regular inserts leave pages at every fill level, unlike the bulk loader
+  char(*plates)[TAMANHO_PLACA] = malloc(sizeof(*plates) * n);
+  for (int i = 0; i < n; i++) {
+    data_record *d = load_data_record(data, i);
+    strcpy(plates[i], d->placa);
+    if (b_insert(b, data, d, i) < 0)
+      errors++;
+    free(d);
+  }
+
+  u32 free_pages = b->i->n;
+  int removed = 0;
+  for (int i = 0; i < n; i++) {
+    if (i % 3 == 0)
+      continue;
+    if (b_remove(b, data, ld, plates[i]) != BTREE_SUCCESS) {
+      printf("!!Could not remove %s\n", plates[i]);
+      errors++;
+    }
+    removed++;
+  }
+  if (b_remove(b, data, ld, plates[1]) != BTREE_NOT_FOUND_KEY) {
+    puts("!!Removed key was found again");
+    errors++;
+  }
+
+  // data rrns go to the data list, merged pages to the index list
+  if (ld->n != (u32)removed || b->i->n <= free_pages) {
+    printf("!!Free lists hold %u data and %u index rrns\n", ld->n, b->i->n);
+    errors++;
+  }
+  if (pinned_frames(b) != 1) {
+    printf("!!%d frames still pinned after removals\n", pinned_frames(b));
+    errors++;
+  }
+  clear_tree_buf(b);
+
+  // every parent update has to survive a reopen
+  b = open_test_tree(dir);
+  if (!b || !b->root) {
+    puts("!!Index lost its root after removals");
+    return errors + 1;
+  }
+  check_subtree(b, b->root->rrn, NULL, NULL, &errors);
+  int count = check_leaf_chain(b, &errors);
+  if (count != n - removed) {
+    printf("!!Leaf chain holds %d keys, expected %d\n", count, n - removed);
+    errors++;
+  }
+  for (int i = 0; i < n; i++) {
+    if (has_key(b, plates[i]) != (i % 3 == 0)) {
+      printf("!!Key %s is %s\n", plates[i], i % 3 ? "still there" : "missing");
+      errors++;
+    }
+  }
+
+  // emptying the tree collapses the root level by level
+  for (int i = 0; i < n; i += 3) {
+    if (b_remove(b, data, ld, plates[i]) != BTREE_SUCCESS)
+      errors++;
+  }
+  if (b->root) {
+    puts("!!Empty tree kept a root");
+    errors++;
+  }
+
+  // the last leaf is freed and the header forgets it across a reopen
+  clear_tree_buf(b);
+  b = open_test_tree(dir);
+  if (!b || b->root || b->io->br->root_rrn != NULL_RRN) {
+    puts("!!Emptied index still has a root after reopening");
+    return errors + 1;
+  }
+  free_pages = b->i->n;
+
+  data_record d;
+  memset(&d, 0, sizeof(data_record));
+  for (int i = 0; i < 50; i++) {
+    strcpy(d.placa, plates[i]);
+    write_data_record(data, &d, i);
+    if (b_insert(b, data, &d, i) < 0)
+      errors++;
+  }
+  fflush(data->fp);
+  errors += check_all_keys(b, data, 50);
+  if (b->i->n >= free_pages) {
+    puts("!!Freed pages were not reused");
+    errors++;
+  }
+
+  free(plates);
+  clear_ilist(ld);
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+// runs fn on a fresh subdirectory of dir for a few orders, odd and even
+int for_each_order(const char *dir, int (*fn)(const char *dir, u16 order)) {
+  int errors = 0;
+  u16 orders[] = {MIN_ORDER, 4, DEFAULT_ORDER};
+
+  for (size_t i = 0; i < sizeof(orders) / sizeof(orders[0]); i++) {
+    char sub[MAX_ADDRESS];
+    snprintf(sub, MAX_ADDRESS, "%s/order-%hu", dir, orders[i]);
+    if (mkdir(sub, 0700) != 0) {
+      printf("!!Could not create %s\n", sub);
+      errors++;
+      continue;
+    }
+    int e = fn(sub, orders[i]);
+    if (e)
+      printf("!!Order %hu: %d errors\n", orders[i], e);
+    errors += e;
+    remove_test_dir(sub);
+  }
+  return errors;
+}
+
+int test_remove(const char *dir) {
+  return for_each_order(dir, remove_with_order);
+}
+
+long file_size(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+int test_free_list(const char *dir) {
+  int errors = 0;
+  char path[MAX_ADDRESS];
+  snprintf(path, MAX_ADDRESS, "%s/pages.hlp", dir);
+
+  free_rrn_list *l = alloc_ilist();
+  load_list(l, path);
+  if (!l->io->fp || get_last_free_rrn(l) != 0) {
+    puts("!!Could not set up free list test");
+    return 1;
+  }
+
+  // a fresh list hands out rrns from the high-water mark
+  for (u32 r = 0; r < 1000; r++) {
+    if (get_free_rrn(l) != r) {
+      printf("!!Allocation %u returned another rrn\n", r);
+      errors++;
+      break;
+    }
+  }
+  for (u32 r = 900; r > 0; r -= 9)
+    insert_list(l, r);
+  insert_list(l, 450);
+  insert_list(l, 1000);
+  if (l->n != 100) {
+    printf("!!List holds %u free rrns, expected 100\n", l->n);
+    errors++;
+  }
+
+  // nothing reaches the file before a checkpoint
+  if (file_size(path) != LIST_FIXED_HEADER + sizeof(u32)) {
+    puts("!!Free list was written before a checkpoint");
+    errors++;
+  }
+  flush_list(l);
+  if (file_size(path) != (long)(LIST_FIXED_HEADER + sizeof(u32) * 101)) {
+    printf("!!Checkpoint wrote %ld bytes\n", file_size(path));
+    errors++;
+  }
+  clear_ilist(l);
+
+  l = alloc_ilist();
+  load_list(l, path);
+  for (u32 r = 9; r <= 900; r += 9) {
+    if (get_free_rrn(l) != r) {
+      printf("!!Reloaded list did not return %u\n", r);
+      errors++;
+      break;
+    }
+  }
+
+  // an rrn past the mark becomes the new mark, the old one a hole
+  insert_list(l, 1005);
+  if (get_free_rrn(l) != 1000 || get_free_rrn(l) != 1005 ||
+      get_free_rrn(l) != 1006) {
+    puts("!!Rrns past the high-water mark were handed out out of order");
+    errors++;
+  }
+
+  reset_list(l, 7);
+  clear_ilist(l);
+  l = alloc_ilist();
+  load_list(l, path);
+  if (l->n != 0 || get_last_free_rrn(l) != 7 ||
+      file_size(path) != LIST_FIXED_HEADER + sizeof(u32)) {
+    puts("!!Reset list was not persisted on close");
+    errors++;
+  }
+  clear_ilist(l);
+  return errors;
+}
+
+int batch_with_order(const char *dir, u16 order) {
+  int errors = 0;
+  int n = 3000;
+
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = alloc_tree_buf();
+  if (b)
+    b->io->br->order = order;
+  b = attach_test_tree(b, dir);
+  data_record *d = malloc(sizeof(data_record) * n);
+  u32 *rrns = malloc(sizeof(u32) * n);
+  if (!data || !b || b->root || !d || !rrns) {
+    puts("!!Could not set up batch insert test");
+    return 1;
+  }
+
+  // the first batch builds the tree, the second one lands between its keys
+  // and repeats some of them
+  int m = 0;
+  for (int i = 0; i < n; i += 2) {
+    data_record *r = load_data_record(data, i);
+    d[m] = *r;
+    rrns[m++] = i;
+    free(r);
+  }
+  if (b_insert_batch(b, data, d, rrns, m) != BTREE_SUCCESS) {
+    puts("!!First batch failed");
+    errors++;
+  }
+
+  m = 0;
+  for (int i = 1; i < n; i += 2) {
+    data_record *r = load_data_record(data, i);
+    d[m] = *r;
+    rrns[m++] = i;
+    free(r);
+  }
+  for (int i = 0; i < n; i += 100) {
+    data_record *r = load_data_record(data, i);
+    d[m] = *r;
+    rrns[m++] = n + i;
+    free(r);
+  }
+  if (b_insert_batch(b, data, d, rrns, m) != BTREE_SUCCESS) {
+    puts("!!Second batch failed");
+    errors++;
+  }
+  if (pinned_frames(b) != 1) {
+    printf("!!%d frames still pinned after batches\n", pinned_frames(b));
+    errors++;
+  }
+  clear_tree_buf(b);
+
+  b = open_test_tree(dir);
+  if (!b || !b->root) {
+    puts("!!Index lost its root after batches");
+    return errors + 1;
+  }
+  check_subtree(b, b->root->rrn, NULL, NULL, &errors);
+  int count = check_leaf_chain(b, &errors);
+  if (count != n) {
+    printf("!!Leaf chain holds %d keys, expected %d\n", count, n);
+    errors++;
+  }
+  errors += check_all_keys(b, data, n);
+
+  // single inserts keep working on a tree grown by batches
+  data_record one;
+  memset(&one, 0, sizeof(data_record));
+  make_test_plate(n, one.placa);
+  write_data_record(data, &one, n);
+  fflush(data->fp);
+  if (b_insert(b, data, &one, n) != BTREE_SUCCESS)
+    errors++;
+  errors += check_all_keys(b, data, n + 1);
+
+  free(d);
+  free(rrns);
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+int test_batch_insert(const char *dir) {
+  return for_each_order(dir, batch_with_order);
+}
+
+int count_between(io_buf *data, int n, const char *start, const char *end) {
+  int count = 0;
+  for (int i = 0; i < n; i++) {
+    data_record d;
+    if (load_data_record_into(data, i, &d) == IO_SUCCESS &&
+        strcmp(d.placa, start) >= 0 && strcmp(d.placa, end) <= 0)
+      count++;
+  }
+  return count;
+}
+
+int test_cursor(const char *dir) {
+  int errors = 0;
+  int n = 2000;
+
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = open_test_tree(dir);
+  if (!data || !b || b->root) {
+    puts("!!Could not set up cursor test");
+    return 1;
+  }
+
+  // a cursor over an empty tree ends at once
+  bt_cursor *c = bt_cursor_open(b, NULL, NULL);
+  if (!c || bt_cursor_next(c, NULL)) {
+    puts("!!Cursor on an empty tree returned a key");
+    errors++;
+  }
+  bt_cursor_close(c);
+
+  build_tree(b, data, n);
+
+  // bounds are inclusive and need not exist in the tree
+  const char *ranges[][2] = {
+      {"AAA0100", "AAA0999"}, {"AAA0150", "AAA0150"}, {"AAA0999Z", "AAA1500"},
+      {"AAA1200", "AAA1100"}, {"", "AAA0005"},        {"AAA1990", "ZZZ9999"}};
+  for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+    c = bt_cursor_open(b, ranges[r][0], ranges[r][1]);
+    if (!c) {
+      errors++;
+      continue;
+    }
+
+    int count = 0;
+    key k, last;
+    data_record d;
+    while (bt_cursor_next(c, &k)) {
+      if (pinned_frames(b) != 1) {
+        printf("!!Open cursor holds %d frames\n", pinned_frames(b) - 1);
+        errors++;
+      }
+      if (strcmp(k.id, ranges[r][0]) < 0 || strcmp(k.id, ranges[r][1]) > 0 ||
+          (count > 0 && compare_key(&last, &k) >= 0) ||
+          load_data_record_into(data, k.data_register_rrn, &d) != IO_SUCCESS ||
+          strcmp(d.placa, k.id) != 0) {
+        printf("!!Cursor returned %s for [%s, %s]\n", k.id, ranges[r][0],
+               ranges[r][1]);
+        errors++;
+      }
+      last = k;
+      count++;
+    }
+    bt_cursor_close(c);
+
+    int expected = count_between(data, n, ranges[r][0], ranges[r][1]);
+    if (count != expected) {
+      printf("!!Range [%s, %s] gave %d keys, expected %d\n", ranges[r][0],
+             ranges[r][1], count, expected);
+      errors++;
+    }
+  }
+
+  // records come back in key order through the caller's buffer
+  int count = 0;
+  data_record d;
+  char last[TAMANHO_PLACA] = "";
+  c = bt_cursor_open(b, NULL, NULL);
+  while (bt_cursor_next_record(c, data, &d)) {
+    if (strcmp(last, d.placa) >= 0) {
+      printf("!!Record %s came after %s\n", d.placa, last);
+      errors++;
+    }
+    strcpy(last, d.placa);
+    count++;
+  }
+  bt_cursor_close(c);
+  if (count != n) {
+    printf("!!Full scan returned %d records, expected %d\n", count, n);
+    errors++;
+  }
+
+  // closing early drops the leaf pin
+  c = bt_cursor_open(b, "AAA0500", NULL);
+  bt_cursor_next(c, NULL);
+  bt_cursor_close(c);
+  if (pinned_frames(b) != 1) {
+    printf("!!%d frames pinned after closing cursors\n", pinned_frames(b));
+    errors++;
+  }
+
+  // the tree latch is only held inside a step, so rows can be removed from
+  // the same thread while the scan goes on
+  int seen = 0, removed = 0;
+  key k;
+  c = bt_cursor_open(b, NULL, NULL);
+  while (bt_cursor_next(c, &k)) {
+    seen++;
+    if (seen % 2 && b_remove(b, data, NULL, k.id) == BTREE_SUCCESS)
+      removed++;
+  }
+  bt_cursor_close(c);
+  if (seen != n || removed != (n + 1) / 2) {
+    printf("!!Removing while scanning saw %d keys and removed %d\n", seen,
+           removed);
+    errors++;
+  }
+
+  count = 0;
+  c = bt_cursor_open(b, NULL, NULL);
+  while (bt_cursor_next(c, NULL))
+    count++;
+  bt_cursor_close(c);
+  if (count != n - removed) {
+    printf("!!%d keys left after removing %d of %d\n", count, removed, n);
+    errors++;
+  }
+
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+int test_readahead(const char *dir) {
+  int errors = 0;
+  int n = 1500;
+
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = open_test_tree(dir);
+  if (!data || !b) {
+    puts("!!Could not set up readahead test");
+    return 1;
+  }
+  build_tree(b, data, n);
+
+  // sorted batch reads match record by record reads, in the caller's order,
+  // with runs, gaps, repeats and an rrn past the end of the file
+  u32 rrns[RANGE_BATCH];
+  data_record got[RANGE_BATCH], want;
+  for (int i = 0; i < RANGE_BATCH; i++)
+    rrns[i] = (u32)((i * 37 + 5) % 80) + (i % 7 == 0 ? 700 : 0);
+  rrns[10] = rrns[11];
+  rrns[RANGE_BATCH - 1] = n + 10;
+  if (load_data_records(data, rrns, RANGE_BATCH, got) != IO_ERROR) {
+    puts("!!Reading past the data file was not reported");
+    errors++;
+  }
+  for (int i = 0; i < RANGE_BATCH - 1; i++) {
+    if (load_data_record_into(data, rrns[i], &want) != IO_SUCCESS ||
+        memcmp(&want, &got[i], sizeof(data_record)) != 0) {
+      printf("!!Batch read of rrn %u differs\n", rrns[i]);
+      errors++;
+    }
+  }
+  if (got[RANGE_BATCH - 1].placa[0] != '\0') {
+    puts("!!Unreadable record was not zeroed");
+    errors++;
+  }
+
+  // batches walk the whole tree in key order with matching records
+  for (int mapped = 0; mapped < 2; mapped++) {
+    if (mapped) {
+      clear_tree_buf(b);
+      b = alloc_tree_buf();
+      if (b)
+        b->io->use_mmap = true;
+      b = attach_unlogged_tree(b, dir);
+      if (!b || !b->io->map || !b->root) {
+        puts("!!Could not map index");
+        return errors + 1;
+      }
+    }
+
+    int count = 0, k;
+    key keys[RANGE_BATCH];
+    char last[TAMANHO_PLACA] = "";
+    bt_cursor *c = bt_cursor_open(b, NULL, NULL);
+    while ((k = bt_cursor_next_batch(c, data, keys, got, RANGE_BATCH)) > 0) {
+      for (int i = 0; i < k; i++) {
+        if (strcmp(last, keys[i].id) >= 0 ||
+            strcmp(keys[i].id, got[i].placa) != 0) {
+          printf("!!Batch slot %d holds %s for key %s\n", i, got[i].placa,
+                 keys[i].id);
+          errors++;
+        }
+        strcpy(last, keys[i].id);
+      }
+      count += k;
+    }
+    if (c->ahead_to <= c->ahead_from) {
+      puts("!!Scan never read ahead");
+      errors++;
+    }
+    bt_cursor_close(c);
+    if (count != n) {
+      printf("!!Batched scan returned %d keys, expected %d\n", count, n);
+      errors++;
+    }
+  }
+
+  // advice past the end of the index is harmless
+  prefetch_pages(b, 1u << 20, READAHEAD_LEAVES);
+
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+int test_search_many(const char *dir) {
+  int errors = 0;
+  int n = 2000;
+  size_t probes = 700;
+
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = open_test_tree(dir);
+  const char **plates = malloc(sizeof(char *) * probes);
+  char(*names)[TAMANHO_PLACA] = malloc(sizeof(*names) * probes);
+  u32 *rrns = malloc(sizeof(u32) * probes);
+  if (!data || !b || !plates || !names || !rrns) {
+    puts("!!Could not set up multi-key search test");
+    return 1;
+  }
+
+  if (b_search_many(b, plates, 0, rrns) != 0) {
+    puts("!!Empty probe list found keys");
+    errors++;
+  }
+  build_tree(b, data, n);
+
+  // present, missing and repeated plates in no particular order
+  for (size_t i = 0; i < probes; i++) {
+    make_test_plate((int)((i * 7 + 3) % (n + n / 4)), names[i]);
+    plates[i] = names[i];
+  }
+  strcpy(names[5], names[17]);
+  strcpy(names[6], "ZZZ");
+  plates[7] = NULL;
+
+  size_t found = b_search_many(b, plates, probes, rrns);
+  size_t expected = 0;
+  for (size_t i = 0; i < probes; i++) {
+    u16 pos;
+    u32 want = NULL_RRN;
+    page *p = plates[i] ? b_search(b, plates[i], &pos) : NULL;
+    if (p)
+      want = page_key(p, pos).data_register_rrn;
+    unpin_page(b, p);
+
+    expected += want != NULL_RRN;
+    if (rrns[i] != want) {
+      printf("!!Probe %zu (%s) gave rrn %u, expected %u\n", i,
+             plates[i] ? plates[i] : "NULL", rrns[i], want);
+      errors++;
+    }
+  }
+  if (found != expected || pinned_frames(b) != 1) {
+    printf("!!Found %zu of %zu probes with %d frames pinned\n", found,
+           expected, pinned_frames(b));
+    errors++;
+  }
+
+  free(plates);
+  free(names);
+  free(rrns);
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+// looks up every stride-th plate below n three ways and checks each hit
+// against the plate stored in its data record
+void *concurrent_reader(void *arg) {
+  thread_args *t = arg;
+  char plate[TAMANHO_PLACA];
+  const char *plates[1] = {plate};
+  for (int i = t->id; i < t->n; i += t->stride) {
+    make_test_plate(i, plate);
+
+    u32 rrn = NULL_RRN;
+    if (!t->writing) {
+      u16 pos;
+      page *p = b_search(t->b, plate, &pos);
+      rrn = p ? page_key(p, pos).data_register_rrn : NULL_RRN;
+      unpin_page(t->b, p);
+    } else {
+      b_search_many(t->b, plates, 1, &rrn);
+    }
+
+    data_record d;
+    if (rrn == NULL_RRN || load_data_record_into(t->data, rrn, &d) != IO_SUCCESS ||
+        strcmp(d.placa, plate) != 0) {
+      printf("!!Thread %d lost plate %s\n", t->id, plate);
+      t->errors++;
+    }
+  }
+
+  // a scan sees the keys in order, including whatever the writer has added
+  int count = 0;
+  key k;
+  char last[TAMANHO_PLACA] = "";
+  bt_cursor *c = bt_cursor_open(t->b, NULL, NULL);
+  while (bt_cursor_next(c, &k)) {
+    if (strcmp(last, k.id) >= 0)
+      t->errors++;
+    strcpy(last, k.id);
+    count++;
+  }
+  bt_cursor_close(c);
+  if (count < t->n) {
+    printf("!!Thread %d scanned %d of %d keys\n", t->id, count, t->n);
+    t->errors++;
+  }
+  return NULL;
+}
+
+void *concurrent_writer(void *arg) {
+  thread_args *t = arg;
+  for (int i = t->n; i < t->n + t->stride; i++) {
+    data_record d;
+    memset(&d, 0, sizeof(data_record));
+    make_test_plate(i, d.placa);
+    if (b_insert(t->b, t->data, &d, i) < 0)
+      t->errors++;
+  }
+  return NULL;
+}
+
+int run_threads(thread_args *args, int threads, bool writing) {
+  pthread_t ids[CONCURRENT_THREADS + 1];
+  int errors = 0;
+  for (int i = 0; i < threads; i++) {
+    args[i].id = i;
+    args[i].stride = threads;
+    args[i].writing = writing;
+    args[i].errors = 0;
+    pthread_create(&ids[i], NULL, concurrent_reader, &args[i]);
+  }
+  if (writing) {
+    args[threads] = args[0];
+    args[threads].stride = 500;
+    args[threads].errors = 0;
+    pthread_create(&ids[threads], NULL, concurrent_writer, &args[threads]);
+  }
+  for (int i = 0; i < threads + writing; i++) {
+    pthread_join(ids[i], NULL);
+    errors += args[i].errors;
+  }
+  return errors;
+}
+
+int test_concurrent_reads(const char *dir) {
+  int errors = 0;
+  int n = 3000;
+
+  // a pool far smaller than the tree keeps the readers evicting each other
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = open_test_tree(dir);
+  if (!data || !b || set_pool_capacity(b, 64) != BTREE_SUCCESS) {
+    puts("!!Could not set up concurrent read test");
+    return 1;
+  }
+  build_tree(b, data, n);
+
+  thread_args args[CONCURRENT_THREADS + 1];
+  for (int i = 0; i <= CONCURRENT_THREADS; i++) {
+    args[i].b = b;
+    args[i].data = data;
+    args[i].n = n;
+  }
+  errors += run_threads(args, CONCURRENT_THREADS, false);
+  errors += run_threads(args, CONCURRENT_THREADS / 2, true);
+
+  for (int i = n; i < n + 500; i++) {
+    char plate[TAMANHO_PLACA];
+    make_test_plate(i, plate);
+    if (!has_key(b, plate)) {
+      printf("!!Plate %s written alongside the readers is missing\n", plate);
+      errors++;
+      break;
+    }
+  }
+  if (pinned_frames(b) != 1) {
+    printf("!!%d frames left pinned\n", pinned_frames(b));
+    errors++;
+  }
+
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+// plates from first to n, interleaved with the other workers so they keep
+// splitting the same pages
+void *insert_worker(void *arg) {
+  thread_args *t = arg;
+  data_record d;
+  memset(&d, 0, sizeof(data_record));
+  for (int i = t->first + t->id; i < t->n; i += t->stride) {
+    make_test_plate(i, d.placa);
+    if (b_insert(t->b, t->data, &d, i) < 0) {
+      printf("!!Thread %d could not insert %s\n", t->id, d.placa);
+      t->errors++;
+    }
+  }
+  return NULL;
+}
+
+// every third plate below n
+void *remove_worker(void *arg) {
+  thread_args *t = arg;
+  char plate[TAMANHO_PLACA];
+  for (int i = 3 * t->id; i < t->n; i += 3 * t->stride) {
+    make_test_plate(i, plate);
+    if (b_remove(t->b, t->data, NULL, plate) != BTREE_SUCCESS) {
+      printf("!!Thread %d could not remove %s\n", t->id, plate);
+      t->errors++;
+    }
+  }
+  return NULL;
+}
+
+// the plates no remover touches must be found all along, and scans must
+// stay in order while pages split and shrink under them
+void *lookup_worker(void *arg) {
+  thread_args *t = arg;
+  char plate[TAMANHO_PLACA];
+  const char *plates[1] = {plate};
+  for (int i = t->id; i < t->n; i += t->stride) {
+    if (i % 3 == 0)
+      continue;
+    make_test_plate(i, plate);
+    u32 rrn = NULL_RRN;
+    if (b_search_many(t->b, plates, 1, &rrn) != 1 || rrn != (u32)i) {
+      printf("!!Thread %d lost plate %s\n", t->id, plate);
+      t->errors++;
+    }
+
+    if ((i / t->stride) % 64 == 0) {
+      key k;
+      char last[TAMANHO_PLACA] = "";
+      bt_cursor *c = bt_cursor_open(t->b, plate, NULL);
+      for (int s = 0; s < 64 && bt_cursor_next(c, &k); s++) {
+        if (strcmp(last, k.id) >= 0)
+          t->errors++;
+        strcpy(last, k.id);
+      }
+      bt_cursor_close(c);
+    }
+  }
+  return NULL;
+}
+
+int run_workers(thread_args *args, void *(**fns)(void *), int threads) {
+  pthread_t ids[CONCURRENT_THREADS];
+  int errors = 0;
+  for (int i = 0; i < threads; i++)
+    pthread_create(&ids[i], NULL, fns[i], &args[i]);
+  for (int i = 0; i < threads; i++) {
+    pthread_join(ids[i], NULL);
+    errors += args[i].errors;
+  }
+  return errors;
+}
+
+int test_concurrent_writes(const char *dir) {
+  int errors = 0;
+  int n = 3000, extra = 1000;
+
+  // order 5 pages and a small pool make splits, root growth and evictions
+  // frequent while the workers run
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = open_test_tree(dir);
+  if (!data || !b || set_pool_capacity(b, 64) != BTREE_SUCCESS) {
+    puts("!!Could not set up concurrent write test");
+    return 1;
+  }
+
+  thread_args args[CONCURRENT_THREADS];
+  void *(*fns[CONCURRENT_THREADS])(void *);
+  for (int i = 0; i < CONCURRENT_THREADS; i++) {
+    args[i] = (thread_args){b, data, i, CONCURRENT_THREADS, 0, n, 0, false};
+    fns[i] = insert_worker;
+  }
+  errors += run_workers(args, fns, CONCURRENT_THREADS);
+  check_subtree(b, b->root->rrn, NULL, NULL, &errors);
+
+  // removers, inserters past n and lookups all at once
+  int lookups = 0;
+  for (int i = 0; i < CONCURRENT_THREADS; i++) {
+    int role = i % 4;
+    args[i] = (thread_args){b, data, i / 4, CONCURRENT_THREADS / 4, 0, n, 0,
+                            false};
+    fns[i] = role == 0 ? remove_worker : role == 1 ? insert_worker
+                                                   : lookup_worker;
+    if (role == 1) {
+      args[i].first = n;
+      args[i].n = n + extra;
+    } else if (role > 1) {
+      args[i].id = lookups++;
+      args[i].stride = CONCURRENT_THREADS / 2;
+    }
+  }
+  errors += run_workers(args, fns, CONCURRENT_THREADS);
+
+  check_subtree(b, b->root->rrn, NULL, NULL, &errors);
+  int count = check_leaf_chain(b, &errors);
+  if (count != n - (n + 2) / 3 + extra) {
+    printf("!!Leaf chain holds %d keys, expected %d\n", count,
+           n - (n + 2) / 3 + extra);
+    errors++;
+  }
+  for (int i = 0; i < n + extra; i++) {
+    char plate[TAMANHO_PLACA];
+    make_test_plate(i, plate);
+    if (has_key(b, plate) != (i >= n || i % 3 != 0)) {
+      printf("!!Plate %s is %s\n", plate, i % 3 ? "missing" : "still there");
+      errors++;
+      break;
+    }
+  }
+  if (pinned_frames(b) != 1) {
+    printf("!!%d frames left pinned\n", pinned_frames(b));
+    errors++;
+  }
+  // evictions write pages back outside the pool lock, and all must be over
+  if (b->pool->evicting != 0) {
+    printf("!!%u frames still being written back\n", b->pool->evicting);
+    errors++;
+  }
+
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+// inserts and removes run in a child that dies without flushing anything,
+// like a crash, and reopening the index must redo them from the log
+int test_wal(const char *dir) {
+  int errors = 0;
+  int n = 2000, extra = 1000, more = 200;
+  char wal_path[MAX_ADDRESS];
+  snprintf(wal_path, MAX_ADDRESS, "%s/btree.wal", dir);
+
+  io_buf *data = make_test_data(dir, n + extra + more);
+  b_tree_buf *b = open_test_tree(dir);
+  if (!data || !b || file_size(wal_path) != (long)WAL_FIXED_HEADER) {
+    puts("!!Could not set up log test");
+    return 1;
+  }
+
+  data_record d;
+  memset(&d, 0, sizeof(data_record));
+  for (int i = 0; i < n; i++) {
+    make_test_plate(i, d.placa);
+    if (b_insert(b, data, &d, i) < 0)
+      errors++;
+  }
+  u32 page_size = b->io->br->page_size;
+  clear_tree_buf(b);
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    // a small pool evicts pages, which must wait for their log records
+    b = open_test_tree(dir);
+    if (!b || set_pool_capacity(b, MIN_POOL_FRAMES * 2) != BTREE_SUCCESS)
+      _exit(1);
+    u64 ops = 0;
+    for (int i = n; i < n + extra; i++, ops++) {
+      make_test_plate(i, d.placa);
+      if (b_insert(b, data, &d, i) < 0)
+        errors++;
+    }
+    for (int i = 0; i < n; i += 3, ops++) {
+      make_test_plate(i, d.placa);
+      if (b_remove(b, data, NULL, d.placa) < 0)
+        errors++;
+    }
+
+    // one sync per operation at most, however many pages each wrote
+    _exit(errors > 0 || b->wal->syncs == 0 || b->wal->syncs > ops);
+  }
+
+  int child = -1;
+  if (pid < 0 || waitpid(pid, &child, 0) != pid || !WIFEXITED(child) ||
+      WEXITSTATUS(child) != 0) {
+    puts("!!Log test child failed");
+    errors++;
+  }
+  if (file_size(wal_path) <= (long)WAL_FIXED_HEADER) {
+    puts("!!Nothing was logged");
+    errors++;
+  }
+
+  // a group the crash cut short is dropped, and so is a torn record
+  wal *w = alloc_wal();
+  u8 *image = calloc(1, page_size);
+  w->fd = open(wal_path, O_WRONLY);
+  w->size = file_size(wal_path);
+  wal_append(w, WAL_BEGIN, NULL_RRN, NULL, 0);
+  wal_append(w, WAL_PAGE, 0, image, page_size);
+  if (wal_commit(w) != BTREE_SUCCESS) {
+    puts("!!Could not append an unfinished group");
+    errors++;
+  }
+  memset(image, 0xAB, page_size);
+  if (pwrite(w->fd, image, sizeof(wal_record) + 5, w->size) < 0)
+    errors++;
+  clear_wal(w);
+  free(image);
+
+  b = open_test_tree(dir);
+  if (!b || !b->root) {
+    puts("!!Could not reopen the index after the crash");
+    return errors + 1;
+  }
+  if (file_size(wal_path) != (long)WAL_FIXED_HEADER) {
+    puts("!!Log was not truncated after recovery");
+    errors++;
+  }
+
+  check_subtree(b, b->root->rrn, NULL, NULL, &errors);
+  int count = check_leaf_chain(b, &errors);
+  if (count != n - (n + 2) / 3 + extra) {
+    printf("!!Recovered tree holds %d keys, expected %d\n", count,
+           n - (n + 2) / 3 + extra);
+    errors++;
+  }
+
+  // pages written after the last checkpoint must not be handed out again
+  for (int i = n + extra; i < n + extra + more; i++) {
+    make_test_plate(i, d.placa);
+    if (b_insert(b, data, &d, i) < 0)
+      errors++;
+  }
+  check_subtree(b, b->root->rrn, NULL, NULL, &errors);
+  for (int i = 0; i < n + extra + more; i++) {
+    char plate[TAMANHO_PLACA];
+    make_test_plate(i, plate);
+    if (has_key(b, plate) != (i >= n || i % 3 != 0)) {
+      printf("!!Plate %s is %s\n", plate, i % 3 ? "missing" : "still there");
+      errors++;
+      break;
+    }
+  }
+
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+static b_tree_buf *open_mapped_tree(const char *dir) {
+  b_tree_buf *b = alloc_tree_buf();
+  if (b)
+    b->io->use_mmap = true;
+  return attach_test_tree(b, dir);
+}
+
+// asking for a mapping does not let a logged index write pages in place, so
+// a crash leaves no page on disk ahead of its record and the log redoes it
+int test_mapped_log(const char *dir) {
+  int errors = 0;
+  int n = 1000, extra = 500;
+
+  io_buf *data = make_test_data(dir, n + extra);
+  b_tree_buf *b = open_mapped_tree(dir);
+  if (!data || !b || !b->wal) {
+    puts("!!Could not set up mapped log test");
+    return 1;
+  }
+  if (b->io->map || b->io->use_mmap) {
+    puts("!!Logged index is still mapped");
+    errors++;
+  }
+
+  data_record d;
+  memset(&d, 0, sizeof(data_record));
+  for (int i = 0; i < n; i++) {
+    make_test_plate(i, d.placa);
+    if (b_insert(b, data, &d, i) < 0)
+      errors++;
+  }
+  clear_tree_buf(b);
+
+  // the child splits and merges pages, then dies without a flush
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    b = open_mapped_tree(dir);
+    if (!b || !b->root || b->io->map)
+      _exit(1);
+    for (int i = n; i < n + extra; i++) {
+      make_test_plate(i, d.placa);
+      if (b_insert(b, data, &d, i) < 0)
+        errors++;
+    }
+    for (int i = 0; i < n; i += 2) {
+      make_test_plate(i, d.placa);
+      if (b_remove(b, data, NULL, d.placa) < 0)
+        errors++;
+    }
+    _exit(errors > 0);
+  }
+
+  int child = -1;
+  if (pid < 0 || waitpid(pid, &child, 0) != pid || !WIFEXITED(child) ||
+      WEXITSTATUS(child) != 0) {
+    puts("!!Mapped log test child failed");
+    errors++;
+  }
+
+  b = open_mapped_tree(dir);
+  if (!b || !b->root) {
+    puts("!!Could not reopen the mapped index after the crash");
+    return errors + 1;
+  }
+  check_subtree(b, b->root->rrn, NULL, NULL, &errors);
+  int count = check_leaf_chain(b, &errors);
+  if (count != n / 2 + extra) {
+    printf("!!Recovered tree holds %d keys, expected %d\n", count,
+           n / 2 + extra);
+    errors++;
+  }
+  for (int i = 0; i < n + extra; i++) {
+    char plate[TAMANHO_PLACA];
+    make_test_plate(i, plate);
+    if (has_key(b, plate) != (i >= n || i % 2 != 0)) {
+      printf("!!Plate %s is %s\n", plate, i % 2 ? "missing" : "still there");
+      errors++;
+      break;
+    }
+  }
+
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+// the snapshot must return plates 0 to n - 1, each once and in order
+int scan_snapshot(bt_snapshot *s, int n) {
+  int errors = 0, i = 0;
+  key k;
+  bt_cursor *c = bt_cursor_open_snapshot(s, NULL, NULL);
+  while (bt_cursor_next(c, &k)) {
+    char plate[TAMANHO_PLACA];
+    make_test_plate(i++, plate);
+    if (i > n || strcmp(plate, k.id) != 0) {
+      printf("!!Snapshot returned %s where %s was expected\n", k.id, plate);
+      errors++;
+      break;
+    }
+  }
+  bt_cursor_close(c);
+  if (i != n) {
+    printf("!!Snapshot returned %d plates, expected %d\n", i, n);
+    errors++;
+  }
+  return errors;
+}
+
+// a snapshot keeps returning the tree it was opened on while inserters and
+// removers change the live one, and gives its copies back when closed
+int test_snapshot(const char *dir) {
+  int errors = 0;
+  int n = 3000, extra = 1000;
+  char wal_path[MAX_ADDRESS];
+  snprintf(wal_path, MAX_ADDRESS, "%s/btree.wal", dir);
+
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = open_test_tree(dir);
+  if (!data || !b || set_pool_capacity(b, 64) != BTREE_SUCCESS) {
+    puts("!!Could not set up snapshot test");
+    return 1;
+  }
+  build_tree(b, data, n);
+
+  bt_snapshot *s = bt_snapshot_open(b);
+  if (!s) {
+    puts("!!Could not open a snapshot");
+    return errors + 1;
+  }
+
+  thread_args args[2] = {{b, data, 0, 1, 0, n, 0, false},
+                         {b, data, 0, 1, n, n + extra, 0, false}};
+  pthread_t ids[2];
+  pthread_create(&ids[0], NULL, remove_worker, &args[0]);
+  pthread_create(&ids[1], NULL, insert_worker, &args[1]);
+  errors += scan_snapshot(s, n);
+  for (int i = 0; i < 2; i++) {
+    pthread_join(ids[i], NULL);
+    errors += args[i].errors;
+  }
+  errors += scan_snapshot(s, n);
+
+  check_subtree(b, b->root->rrn, NULL, NULL, &errors);
+  int count = check_leaf_chain(b, &errors);
+  if (count != n - (n + 2) / 3 + extra) {
+    printf("!!Live tree holds %d keys, expected %d\n", count,
+           n - (n + 2) / 3 + extra);
+    errors++;
+  }
+
+  u32 copies = 0;
+  for (u32 h = 0; h < s->slots; h++)
+    copies += s->rrns[h] != NULL_RRN && s->copies[h] != NULL_RRN;
+  if (copies == 0) {
+    puts("!!Writers copied no page for the snapshot");
+    errors++;
+  }
+
+  // the checkpoint leaves the copies in the log, to be freed after a crash
+  b_flush(b);
+  if (file_size(wal_path) <= (long)WAL_FIXED_HEADER) {
+    puts("!!Snapshot copies were not logged at the checkpoint");
+    errors++;
+  }
+  errors += scan_snapshot(s, n);
+
+  u32 free_before = b->i->n;
+  bt_snapshot_close(s);
+  if (b->i->n != free_before + copies) {
+    printf("!!Closing the snapshot freed %u pages, expected %u\n",
+           b->i->n - free_before, copies);
+    errors++;
+  }
+  if (pinned_frames(b) != 1) {
+    printf("!!%d frames left pinned\n", pinned_frames(b));
+    errors++;
+  }
+
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+// records come from the cache once read, stay equal to the file across
+// writes, and the vehicles read over and over outlive a stream of cold reads
+int test_record_cache(const char *dir) {
+  int errors = 0;
+  int n = 500;
+  u32 hot = 1;
+
+  io_buf *data = make_test_data(dir, n);
+  if (!data || !data->cache ||
+      set_cache_budget(data, 32 * sizeof(cached_record)) != IO_SUCCESS ||
+      data->cache->capacity != 32) {
+    puts("!!Could not set up record cache test");
+    return 1;
+  }
+  if (set_cache_budget(data, sizeof(cached_record)) != IO_ERROR) {
+    puts("!!A budget below one record was accepted");
+    errors++;
+  }
+
+  data_record d, want;
+  for (int pass = 0; pass < 2; pass++) {
+    for (u32 i = 0; i < 10; i++) {
+      if (load_data_record_into(data, i, &d) != IO_SUCCESS ||
+          pread(fileno(data->fp), &want, sizeof(data_record),
+                data_offset(data, i)) != (ssize_t)sizeof(data_record) ||
+          memcmp(&d, &want, sizeof(data_record)) != 0) {
+        printf("!!Record %u differs from the file\n", i);
+        errors++;
+      }
+    }
+  }
+  if (data->cache->hits != 10 || data->cache->misses != 10) {
+    printf("!!Expected 10 hits and 10 misses, got %lu and %lu\n",
+           (unsigned long)data->cache->hits,
+           (unsigned long)data->cache->misses);
+    errors++;
+  }
+
+  // a write reaches the cached copy
+  d.ano = 1999;
+  write_data_record(data, &d, 9);
+  if (load_data_record_into(data, 9, &d) != IO_SUCCESS || d.ano != 1999) {
+    puts("!!Cached record missed a write");
+    errors++;
+  }
+
+  u64 misses = data->cache->misses;
+  int cold = 0;
+  for (int i = 100; i < n; i++, cold++) {
+    load_data_record_into(data, i, &d);
+    if (i % 4 == 0)
+      load_data_record_into(data, hot, &d);
+  }
+  if (data->cache->misses - misses != (u64)cold) {
+    printf("!!Hot record was evicted %lu times\n",
+           (unsigned long)(data->cache->misses - misses - cold));
+    errors++;
+  }
+  if (data->cache->used > data->cache->capacity) {
+    puts("!!Record cache went over its budget");
+    errors++;
+  }
+
+  // a batch takes what is cached and leaves the rest out of the cache
+  u32 rrns[RANGE_BATCH];
+  data_record got[RANGE_BATCH];
+  for (int i = 0; i < RANGE_BATCH; i++)
+    rrns[i] = i == 0 ? hot : (u32)(20 + i);
+  if (load_data_records(data, rrns, RANGE_BATCH, got) != IO_SUCCESS) {
+    puts("!!Batch read failed");
+    errors++;
+  }
+  for (int i = 0; i < RANGE_BATCH; i++) {
+    pread(fileno(data->fp), &want, sizeof(data_record),
+          data_offset(data, rrns[i]));
+    if (memcmp(&got[i], &want, sizeof(data_record)) != 0) {
+      printf("!!Batch read of rrn %u differs\n", rrns[i]);
+      errors++;
+    }
+  }
+  misses = data->cache->misses;
+  load_data_record_into(data, hot, &d);
+  load_data_record_into(data, n - 1, &d);
+  if (data->cache->misses != misses) {
+    puts("!!Batch read evicted cached records");
+    errors++;
+  }
+
+  // a read that missed, then lost the race to a write of its record, does
+  // not put the copy it read before the write into the cache
+  u64 writes;
+  data_record stale;
+  if (cache_lookup(data->cache, 7, &stale, &writes)) {
+    puts("!!Record 7 should not be cached yet");
+    errors++;
+  }
+  pread(fileno(data->fp), &stale, sizeof(data_record), data_offset(data, 7));
+  want = stale;
+  want.ano = 1998;
+  write_data_record(data, &want, 7);
+  cache_store(data->cache, 7, &stale, writes);
+  if (load_data_record_into(data, 7, &d) != IO_SUCCESS || d.ano != 1998) {
+    puts("!!Cache kept a record read before a write");
+    errors++;
+  }
+
+  // without a cache every load goes to the file
+  if (set_cache_budget(data, 0) != IO_SUCCESS || data->cache ||
+      load_data_record_into(data, 9, &d) != IO_SUCCESS || d.ano != 1999) {
+    puts("!!Loading without a cache failed");
+    errors++;
+  }
+
+  clear_io_buf(data);
+  return errors;
+}
+
+// records come straight out of a mapping of the data file, writes through
+// it reach the file, and records appended past it are mapped on next read
+int test_mapped_data(const char *dir) {
+  int errors = 0;
+  int n = 1000;
+  char path[MAX_ADDRESS];
+  snprintf(path, MAX_ADDRESS, "%s/veiculos.dat", dir);
+
+  io_buf *data = make_test_data(dir, n);
+  if (data) {
+    data->use_mmap = true;
+    load_file(data, path, "data");
+  }
+  b_tree_buf *b = open_test_tree(dir);
+  if (!data || !data->map || !b) {
+    puts("!!Could not set up mapped data test");
+    return 1;
+  }
+  if (data->cache || data->hr->header_size % _Alignof(data_record) != 0) {
+    puts("!!Mapped data file is cached or misaligned");
+    errors++;
+  }
+
+  data_record want;
+  for (int i = 0; i < n; i++) {
+    const data_record *r = map_data_record(data, i);
+    if (!r ||
+        pread(fileno(data->fp), &want, sizeof(data_record),
+              data_offset(data, i)) != (ssize_t)sizeof(data_record) ||
+        memcmp(r, &want, sizeof(data_record)) != 0) {
+      printf("!!Mapped record %d differs from the file\n", i);
+      errors++;
+      break;
+    }
+  }
+
+  // the bulk load reads the records through the mapping
+  build_tree(b, data, n);
+  if (check_leaf_chain(b, &errors) != n) {
+    puts("!!Tree built from the mapping lost keys");
+    errors++;
+  }
+
+  const data_record *r = map_data_record(data, 7);
+  data_record d = *r;
+  d.quilometragem = 4242;
+  data->sync = DATA_SYNC_RECORD;
+  write_data_record(data, &d, 7);
+  pread(fileno(data->fp), &want, sizeof(data_record), data_offset(data, 7));
+  if (r->quilometragem != 4242 || want.quilometragem != 4242) {
+    puts("!!Write through the mapping was lost");
+    errors++;
+  }
+
+  // appended records go to the file and are mapped when first read
+  make_test_plate(n + 5, d.placa);
+  write_data_record(data, &d, n + 5);
+  r = map_data_record(data, n + 5);
+  if (!r || strcmp(r->placa, d.placa) != 0 ||
+      map_data_record(data, n + 100) != NULL) {
+    puts("!!Appended record was not mapped");
+    errors++;
+  }
+  data_record got[2];
+  u32 rrns[2] = {n + 5, n + 100};
+  if (load_data_records(data, rrns, 2, got) != IO_ERROR ||
+      strcmp(got[0].placa, d.placa) != 0 || got[1].placa[0] != '\0') {
+    puts("!!Batch read past the mapping went wrong");
+    errors++;
+  }
+  if (sync_data(data) != IO_SUCCESS)
+    errors++;
+
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+// a legacy export without a header gets one in front, copied through a
+// temporary file in chunks, with every record where it was relative to it
+int test_prepend_header(const char *dir) {
+  int errors = 0;
+  int n = 2000;
+  char path[MAX_ADDRESS], tmp_path[MAX_ADDRESS + 4];
+  snprintf(path, MAX_ADDRESS, "%s/legacy.dat", dir);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  FILE *fp = fopen(path, "wb");
+  if (!fp) {
+    puts("!!Could not set up prepend test");
+    return 1;
+  }
+  data_record d;
+  for (int i = 0; i < n; i++) {
+    memset(&d, 0, sizeof(data_record));
+    make_test_plate(i, d.placa);
+    d.ano = i;
+    fwrite(&d, sizeof(data_record), 1, fp);
+  }
+  fclose(fp);
+
+  io_buf *data = alloc_io_buf();
+  create_data_file(data, path);
+  clear_io_buf(data);
+  data = alloc_io_buf();
+  load_file(data, path, "data");
+  if (!data->fp || data->hr->record_size != sizeof(data_record)) {
+    puts("!!Legacy file got no header");
+    clear_io_buf(data);
+    return errors + 1;
+  }
+
+  if (file_size(path) != (long)data_offset(data, n) ||
+      file_size(tmp_path) != -1) {
+    printf("!!Data file holds %ld bytes, expected %lu\n", file_size(path),
+           (unsigned long)data_offset(data, n));
+    errors++;
+  }
+  for (int i = 0; i < n; i++) {
+    char plate[TAMANHO_PLACA];
+    make_test_plate(i, plate);
+    if (load_data_record_into(data, i, &d) != IO_SUCCESS ||
+        strcmp(d.placa, plate) != 0 || d.ano != i) {
+      printf("!!Record %d moved while the header was prepended\n", i);
+      errors++;
+      break;
+    }
+  }
+
+  clear_io_buf(data);
+  remove(path);
+  return errors;
+}
+
+// plates of one range share their letters, so pages keep them once and hold
+// more keys than full slots would allow
+int test_prefix_pages(const char *dir) {
+  int errors = 0;
+  int n = 2000;
+
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = open_test_tree(dir);
+  if (!data || !b || b->root) {
+    puts("!!Could not set up prefix test");
+    return 1;
+  }
+  build_tree(b, data, n);
+
+  int most = 0, prefixed = 0;
+  for (page *curr = leftmost_leaf(b); curr;) {
+    most = curr->keys_num > most ? curr->keys_num : most;
+    prefixed += curr->prefix > 0;
+    page *next = curr->next_leaf != NULL_RRN ? load_page(b, curr->next_leaf)
+                                             : NULL;
+    unpin_page(b, curr);
+    curr = next;
+  }
+  if (most <= b->io->br->order - 1 || prefixed == 0) {
+    printf("!!Leaves hold at most %d keys, %d with a prefix\n", most,
+           prefixed);
+    errors++;
+  }
+
+  // ids of every length round-trip through a page
+  const char *ids[] = {"A", "AB", "ABC1234", "ABC1D23", "BA"};
+  int count = sizeof(ids) / sizeof(ids[0]);
+  key keys[8], back[8];
+  memset(keys, 0, sizeof(keys));
+  for (int i = 0; i < count; i++) {
+    strcpy(keys[i].id, ids[i]);
+    keys[i].data_register_rrn = 70000 + i;
+  }
+  page *p = alloc_page(b);
+  if (!pack_page(b, p, keys, count, NULL, 0)) {
+    puts("!!Mixed ids did not fit a page");
+    errors++;
+  }
+  unpack_keys(p, back);
+  for (int i = 0; i < p->keys_num; i++) {
+    int pos;
+    if (memcmp(&keys[i], &back[i], sizeof(key)) != 0 ||
+        search_in_page(p, keys[i], &pos) != BTREE_FOUND_KEY || pos != i) {
+      printf("!!Key %s did not round-trip\n", ids[i]);
+      errors++;
+    }
+  }
+  clear_page(p);
+
+  // ids that share nothing with their neighbours split and merge pages
+  data_record d;
+  memset(&d, 0, sizeof(data_record));
+  for (int i = 0; i < count; i++) {
+    strcpy(d.placa, ids[i]);
+    write_data_record(data, &d, n + i);
+    if (b_insert(b, data, &d, n + i) < 0) {
+      printf("!!Could not insert %s\n", ids[i]);
+      errors++;
+    }
+  }
+  check_subtree(b, b->root->rrn, NULL, NULL, &errors);
+  for (int i = 0; i < count; i++) {
+    if (!has_key(b, ids[i])) {
+      printf("!!Key %s was lost\n", ids[i]);
+      errors++;
+    }
+  }
+
+  free_rrn_list *ld = alloc_ilist();
+  char list_path[MAX_ADDRESS];
+  snprintf(list_path, MAX_ADDRESS, "%s/veiculos.hlp", dir);
+  load_list(ld, list_path);
+  for (int i = 0; i < n; i += 2) {
+    make_test_plate(i, d.placa);
+    if (b_remove(b, data, ld, d.placa) != BTREE_SUCCESS)
+      errors++;
+  }
+  check_subtree(b, b->root->rrn, NULL, NULL, &errors);
+  int left = check_leaf_chain(b, &errors);
+  if (left != n / 2 + count) {
+    printf("!!Leaf chain holds %d keys, expected %d\n", left, n / 2 + count);
+    errors++;
+  }
+
+  clear_ilist(ld);
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+// separators keep the id bytes up to the first one telling two neighbours
+// apart, and splits look near the middle for the shortest one
+int test_separators(const char *dir) {
+  int errors = 0;
+  const char *cases[][3] = {{"AAA0199", "AAA0200", "AAA0200"},
+                            {"A", "AB", "AB"},
+                            {"ABC1234", "ABD", "ABD"},
+                            {"ABC1D23", "ABC1D24", "ABC1D24"}};
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    key lo, hi;
+    memset(&lo, 0, sizeof(key));
+    memset(&hi, 0, sizeof(key));
+    strcpy(lo.id, cases[i][0]);
+    strcpy(hi.id, cases[i][1]);
+    key sep = separator(&lo, &hi);
+    if (strcmp(sep.id, cases[i][2]) != 0 || compare_key(&lo, &sep) >= 0 ||
+        compare_key(&sep, &hi) > 0) {
+      printf("!!Separator of %s and %s is %.*s\n", cases[i][0], cases[i][1],
+             TAMANHO_PLACA, sep.id);
+      errors++;
+    }
+  }
+
+  // regular inserts split leaves one at a time
+  int n = 3000;
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = open_test_tree(dir);
+  if (!data || !b || b->root) {
+    puts("!!Could not set up separator test");
+    return errors + 1;
+  }
+  data_record d;
+  for (int i = 0; i < n; i++) {
+    if (load_data_record_into(data, i, &d) != IO_SUCCESS ||
+        b_insert(b, data, &d, i) < 0)
+      errors++;
+  }
+  check_subtree(b, b->root->rrn, NULL, NULL, &errors);
+  errors += check_all_keys(b, data, n);
+
+  // the level above the leaves holds ids cut short and no data rrns
+  page *p = b->root;
+  pin_page(b, p);
+  while (p && p->level > 1) {
+    page *next = load_page(b, page_children(b, p)[0]);
+    unpin_page(b, p);
+    p = next;
+  }
+  // a separator cut short sorts below the first key of the page after it
+  int separators = 0, short_ones = 0;
+  while (p && !p->leaf) {
+    for (int i = 0; i < p->keys_num; i++) {
+      key k = page_key(p, i);
+      page *right = load_page(b, page_children(b, p)[i + 1]);
+      key first = right ? page_key(right, 0) : k;
+      unpin_page(b, right);
+      separators++;
+      short_ones += compare_key(&k, &first) < 0;
+      if (k.data_register_rrn != NULL_RRN) {
+        printf("!!Separator %.*s carries data rrn %u\n", TAMANHO_PLACA, k.id,
+               k.data_register_rrn);
+        errors++;
+      }
+    }
+    page *next =
+        p->next_leaf != NULL_RRN ? load_page(b, p->next_leaf) : NULL;
+    unpin_page(b, p);
+    p = next;
+  }
+  if (separators == 0 || short_ones == 0) {
+    printf("!!Only %d of %d separators were cut short\n", short_ones,
+           separators);
+    errors++;
+  }
+
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+static u64 id_bits(const char *id) {
+  key k;
+  memset(&k, 0, sizeof(key));
+  strncpy(k.id, id, TAMANHO_PLACA);
+  return key_bits(&k);
+}
+
+// plates map to codes in their own order and back, other ids have no code,
+// and a page of plates falls back to raw ids once it takes another key
+int test_plate_codes(const char *dir) {
+  int errors = 0;
+  const char *plates[] = {"AAA0000", "AAA0199", "AAA0200", "ABC1234",
+                          "ABC1D23", "ABC1Z99", "ABC2000", "ZZZ9Z99"};
+  u64 last = 0;
+  for (size_t i = 0; i < sizeof(plates) / sizeof(plates[0]); i++) {
+    u64 code;
+    if (!plate_code(id_bits(plates[i]), &code) ||
+        plate_bits(code) != id_bits(plates[i]) || (i > 0 && code <= last)) {
+      printf("!!Plate %s did not code in order\n", plates[i]);
+      errors++;
+    }
+    last = code;
+  }
+
+  const char *others[] = {"A", "abc1234", "ABC12A4", "1BC1234", "AB-1234"};
+  for (size_t i = 0; i < sizeof(others) / sizeof(others[0]); i++) {
+    u64 code;
+    if (plate_code(id_bits(others[i]), &code)) {
+      printf("!!%s took a plate code\n", others[i]);
+      errors++;
+    }
+  }
+
+  int n = 600;
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = open_test_tree(dir);
+  if (!data || !b) {
+    puts("!!Could not set up plate code test");
+    return errors + 1;
+  }
+  build_tree(b, data, n);
+
+  u16 pos;
+  page *p = b_search(b, "AAA0001", &pos);
+  if (!p || !p->plates) {
+    puts("!!Leaf of plates does not store codes");
+    errors++;
+  }
+  unpin_page(b, p);
+
+  // an id that is no plate lands on the first leaf
+  data_record d;
+  memset(&d, 0, sizeof(data_record));
+  strcpy(d.placa, "A");
+  write_data_record(data, &d, n);
+  if (b_insert(b, data, &d, n) < 0) {
+    puts("!!Insert of an id that is no plate failed");
+    errors++;
+  }
+  p = b_search(b, "A", &pos);
+  if (!p || p->plates || page_key(p, pos).data_register_rrn != (u32)n) {
+    puts("!!Leaf with an id that is no plate kept its codes");
+    errors++;
+  }
+  unpin_page(b, p);
+  check_subtree(b, b->root->rrn, NULL, NULL, &errors);
+  errors += check_all_keys(b, data, n);
+
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
+}
+
+// inserts and removes that repack pages hand their buffers back, so a single
+// writer keeps reusing one, and a pool of 2 MB of frames sits on huge pages
+int test_scratch(const char *dir) {
+  int errors = 0;
+  int n = 3000;
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = open_test_tree(dir);
+  char list_path[MAX_ADDRESS];
+  snprintf(list_path, MAX_ADDRESS, "%s/veiculos.hlp", dir);
+  free_rrn_list *ld = alloc_ilist();
+  load_list(ld, list_path);
+  if (!data || !b || !ld->io->fp) {
+    puts("!!Could not set up scratch test");
+    return 1;
+  }
+
+  u32 frames = HUGE_PAGE / b->io->br->page_size + 1;
+  if (set_pool_capacity(b, frames) != BTREE_SUCCESS) {
+    puts("!!Could not grow the pool");
+    errors++;
+  }
+  data_record d;
+  for (int i = 0; i < n; i++) {
+    if (load_data_record_into(data, i, &d) != IO_SUCCESS ||
+        b_insert(b, data, &d, i) < 0)
+      errors++;
+  }
+  for (int i = 0; i < n; i += 2) {
+    if (load_data_record_into(data, i, &d) != IO_SUCCESS ||
+        b_remove(b, data, ld, d.placa) < 0)
+      errors++;
+  }
+  if (!b->pool->mapped || b->pool->mapped % HUGE_PAGE != 0 ||
+      (uintptr_t)b->pool->pages % HUGE_PAGE != 0) {
+    puts("!!Pool of 2 MB of frames was not mapped on aligned huge pages");
+    errors++;
+  }
+  if (!b->scratch || b->scratch->next) {
+    puts("!!A single writer did not reuse one scratch buffer");
+    errors++;
+  }
+  check_subtree(b, b->root->rrn, NULL, NULL, &errors);
+
+  clear_tree_buf(b);
+  clear_ilist(ld);
+  clear_io_buf(data);
+  return errors;
+}
+
+static size_t count_field(b_tree_buf *b, io_buf *data, secondary_field f,
+                          const char *lo, const char *hi, int *errors) {
+  u32 rrns[1024];
+  size_t n = secondary_search(b, data, f, lo, hi, rrns, 1024);
+  for (size_t i = 0; i < n && i < 1024; i++) {
+    data_record d;
+    char value[TAMANHO_MARCA];
+    load_data_record_into(data, rrns[i], &d);
+    const char *got = f == BY_MARCA       ? d.marca
+                      : f == BY_CATEGORIA ? d.categoria
+                      : f == BY_STATUS    ? d.status
+                                          : value;
+    snprintf(value, sizeof(value), "%d", d.ano);
+    if (f == BY_ANO ? d.ano < atoi(lo) || d.ano > atoi(hi)
+                    : strcmp(got, lo) < 0 || strcmp(got, hi) > 0) {
+      printf("!!%s search for [%s, %s] returned %s\n", secondary_name(f), lo,
+             hi, got);
+      (*errors)++;
+    }
+  }
+  return n;
+}
+
+static void expect_count(b_tree_buf *b, io_buf *data, secondary_field f,
+                         const char *lo, const char *hi, size_t want,
+                         int *errors) {
+  size_t got = count_field(b, data, f, lo, hi, errors);
+  if (got != want) {
+    printf("!!%s in [%s, %s] matched %zu records, expected %zu\n",
+           secondary_name(f), lo, hi, got, want);
+    (*errors)++;
+  }
+}
+
+// rewrites record first over and over with a year of its own
+static void *update_worker(void *arg) {
+  thread_args *t = arg;
+  data_record d;
+  if (load_data_record_into(t->data, t->first, &d) != IO_SUCCESS) {
+    t->errors++;
+    return NULL;
+  }
+  for (int i = 0; i < t->n; i++) {
+    d.ano = 3000 + t->id;
+    if (b_update(t->b, t->data, &d) != BTREE_SUCCESS)
+      t->errors++;
+  }
+  return NULL;
+}
+
+// secondary indexes are loaded from the plates, answer equality and range
+// searches, follow inserts, updates and removes, and keep across reopening
+int test_secondary(const char *dir) {
+  int errors = 0;
+  int n = 600;
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = open_test_tree(dir);
+  char list_path[MAX_ADDRESS];
+  snprintf(list_path, MAX_ADDRESS, "%s/veiculos.hlp", dir);
+  free_rrn_list *ld = alloc_ilist();
+  load_list(ld, list_path);
+  if (!data || !b || !ld->io->fp) {
+    puts("!!Could not set up secondary index test");
+    return 1;
+  }
+  build_tree(b, data, n);
+  for (int f = 0; f < SECONDARY_FIELDS; f++) {
+    if (open_secondary(b, data, f) != BTREE_SUCCESS) {
+      printf("!!Could not open the %s index\n", secondary_name(f));
+      return errors + 1;
+    }
+  }
+
+  expect_count(b, data, BY_MARCA, "Chevrolet", "Chevrolet", n, &errors);
+  expect_count(b, data, BY_MARCA, "Chev", "Chev", 0, &errors);
+  expect_count(b, data, BY_CATEGORIA, "SUV", "SUV", n / 3, &errors);
+  expect_count(b, data, BY_STATUS, "Disponivel", "Disponivel", n / 2, &errors);
+  expect_count(b, data, BY_ANO, "2000", "2004", n / 25 * 5, &errors);
+  expect_count(b, data, BY_ANO, "2030", "2040", 0, &errors);
+
+  // a value sharing the leading bytes of another is told apart
+  data_record d;
+  memset(&d, 0, sizeof(data_record));
+  make_test_plate(n, d.placa);
+  strcpy(d.marca, "Fiat");
+  strcpy(d.categoria, "Hatchback");
+  strcpy(d.status, "Disponivel");
+  d.ano = 1999;
+  write_data_record(data, &d, n);
+  if (b_insert(b, data, &d, n) != BTREE_SUCCESS) {
+    puts("!!Insert with secondary indexes failed");
+    errors++;
+  }
+  expect_count(b, data, BY_CATEGORIA, "Hatch", "Hatch", n - n / 3, &errors);
+  expect_count(b, data, BY_CATEGORIA, "Hatchback", "Hatchback", 1, &errors);
+  expect_count(b, data, BY_CATEGORIA, "Hatch", "Hatchz", n - n / 3 + 1,
+               &errors);
+  expect_count(b, data, BY_STATUS, "Disponivel", "Disponivel", n / 2 + 1,
+               &errors);
+  expect_count(b, data, BY_ANO, "1999", "1999", 1, &errors);
+
+  strcpy(d.status, "Alugado");
+  d.ano = 2001;
+  if (b_update(b, data, &d) != BTREE_SUCCESS) {
+    puts("!!Update with secondary indexes failed");
+    errors++;
+  }
+  expect_count(b, data, BY_STATUS, "Disponivel", "Disponivel", n / 2, &errors);
+  expect_count(b, data, BY_ANO, "1999", "1999", 0, &errors);
+  expect_count(b, data, BY_ANO, "2001", "2001", n / 25 + 1, &errors);
+
+  // record 0 is an available SUV of 2000
+  load_data_record_into(data, 0, &d);
+  if (b_remove(b, data, ld, d.placa) != BTREE_SUCCESS) {
+    puts("!!Remove with secondary indexes failed");
+    errors++;
+  }
+  expect_count(b, data, BY_CATEGORIA, "SUV", "SUV", n / 3 - 1, &errors);
+  expect_count(b, data, BY_MARCA, "A", "Z", n, &errors);
+  for (int f = 0; f < SECONDARY_FIELDS; f++) {
+    bt_cursor *c = bt_cursor_open_bits(b->secondary[f], 0, UINT64_MAX);
+    int keys = 0;
+    key k;
+    while (bt_cursor_next(c, &k))
+      keys++;
+    bt_cursor_close(c);
+    if (keys != n) {
+      printf("!!%s index holds %d keys, expected %d\n", secondary_name(f),
+             keys, n);
+      errors++;
+    }
+  }
+
+  clear_tree_buf(b);
+  b = open_test_tree(dir);
+  for (int f = 0; f < SECONDARY_FIELDS; f++) {
+    if (!b || open_secondary(b, data, f) != BTREE_SUCCESS) {
+      printf("!!Could not reopen the %s index\n", secondary_name(f));
+      return errors + 1;
+    }
+  }
+  expect_count(b, data, BY_CATEGORIA, "SUV", "SUV", n / 3 - 1, &errors);
+  expect_count(b, data, BY_STATUS, "Alugado", "Alugado", n / 2 + 1, &errors);
+  expect_count(b, data, BY_MARCA, "Fiat", "Fiat", 1, &errors);
+
+  // a batch adds the rows it inserts, but not one repeating a plate
+  data_record rows[3];
+  u32 rrns[3] = {n + 1, n + 2, n + 3};
+  memset(rows, 0, sizeof(rows));
+  for (int i = 0; i < 3; i++) {
+    make_test_plate(n + 1 + i, rows[i].placa);
+    strcpy(rows[i].marca, "Fiat");
+    strcpy(rows[i].categoria, "Sedan");
+    strcpy(rows[i].status, "Alugado");
+    rows[i].ano = 2001;
+    write_data_record(data, &rows[i], rrns[i]);
+  }
+  load_data_record_into(data, 1, &rows[2]);
+  strcpy(rows[2].marca, "Fiat");
+  if (b_insert_batch(b, data, rows, rrns, 3) != BTREE_SUCCESS) {
+    puts("!!Batch insert with secondary indexes failed");
+    errors++;
+  }
+  expect_count(b, data, BY_MARCA, "Fiat", "Fiat", 3, &errors);
+  expect_count(b, data, BY_ANO, "2001", "2001", n / 25 + 3, &errors);
+
+  // updates of one plate racing each other leave it a single year key
+  thread_args args[CONCURRENT_THREADS];
+  void *(*fns[CONCURRENT_THREADS])(void *);
+  for (int i = 0; i < CONCURRENT_THREADS; i++) {
+    args[i] = (thread_args){b, data, i, 1, 5, 50, 0, true};
+    fns[i] = update_worker;
+  }
+  errors += run_workers(args, fns, CONCURRENT_THREADS);
+  expect_count(b, data, BY_ANO, "3000", "3999", 1, &errors);
+  load_data_record_into(data, 5, &d);
+  char year[16];
+  snprintf(year, sizeof(year), "%d", d.ano);
+  expect_count(b, data, BY_ANO, year, year, 1, &errors);
+
+  clear_tree_buf(b);
+  clear_ilist(ld);
+  clear_io_buf(data);
+  return errors;
+}
+
+// each secondary index commits apart from the plates one; a crash between
+// the two is played by changing the plates with the secondary indexes shut,
+// and reopening after it must rebuild them
+int test_secondary_crash(const char *dir) {
+  int errors = 0;
+  int n = 600;
+  io_buf *data = make_test_data(dir, n);
+  b_tree_buf *b = open_test_tree(dir);
+  if (!data || !b) {
+    puts("!!Could not set up secondary crash test");
+    return 1;
+  }
+  build_tree(b, data, n);
+  for (int f = 0; f < SECONDARY_FIELDS; f++) {
+    if (open_secondary(b, data, f) != BTREE_SUCCESS) {
+      printf("!!Could not open the %s index\n", secondary_name(f));
+      return errors + 1;
+    }
+  }
+  clear_tree_buf(b);
+
+  data_record d;
+  memset(&d, 0, sizeof(data_record));
+  make_test_plate(n, d.placa);
+  strcpy(d.marca, "Fiat");
+  strcpy(d.categoria, "Hatchback");
+  strcpy(d.status, "Disponivel");
+  d.ano = 1999;
+  write_data_record(data, &d, n);
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    b = open_test_tree(dir);
+    if (!b || !b->root)
+      _exit(1);
+    bool failed = b_insert(b, data, &d, n) != BTREE_SUCCESS;
+    strcpy(d.status, "Alugado");
+    failed = failed || b_update(b, data, &d) != BTREE_SUCCESS;
+    _exit(failed);
+  }
+
+  int child = -1;
+  if (pid < 0 || waitpid(pid, &child, 0) != pid || !WIFEXITED(child) ||
+      WEXITSTATUS(child) != 0) {
+    puts("!!Secondary crash test child failed");
+    errors++;
+  }
+
+  b = open_test_tree(dir);
+  for (int f = 0; f < SECONDARY_FIELDS; f++) {
+    if (!b || open_secondary(b, data, f) != BTREE_SUCCESS) {
+      printf("!!Could not reopen the %s index\n", secondary_name(f));
+      return errors + 1;
+    }
+  }
+  expect_count(b, data, BY_MARCA, "Fiat", "Fiat", 1, &errors);
+  expect_count(b, data, BY_CATEGORIA, "Hatchback", "Hatchback", 1, &errors);
+  expect_count(b, data, BY_STATUS, "Alugado", "Alugado", n / 2 + 1, &errors);
+  expect_count(b, data, BY_ANO, "1999", "1999", 1, &errors);
+
+  clear_tree_buf(b);
+  clear_io_buf(data);
+  return errors;
 }
@@ -3,7 +3,135 @@
 
 #include "../src/defines.h"
 
+#define CONCURRENT_THREADS 8
+
+typedef struct {
+  b_tree_buf *b;
+  io_buf *data;
+  int id, stride, first, n, errors;
+  bool writing;
+} thread_args;
+
 void test_tree(b_tree_buf *b, io_buf *data, int n);
 
-void test_queue_search(void);
+void make_test_plate(int i, char *placa);
+
+io_buf *make_test_data(const char *dir, int n);
+
+b_tree_buf *open_test_tree(const char *dir);
+
+b_tree_buf *attach_test_tree(b_tree_buf *b, const char *dir);
+
+b_tree_buf *attach_unlogged_tree(b_tree_buf *b, const char *dir);
+
+void remove_test_dir(const char *dir);
+
+page *leftmost_leaf(b_tree_buf *b);
+
+int check_leaf_chain(b_tree_buf *b, int *errors);
+
+int check_all_keys(b_tree_buf *b, io_buf *data, int n);
+
+int test_bulk_load(const char *dir);
+
+int pinned_frames(b_tree_buf *b);
+
+int test_buffer_pool(const char *dir);
+
+bool read_disk_page(b_tree_buf *b, u32 rrn, page *out);
+
+int test_dirty_pages(const char *dir);
+
+int test_mmap_index(const char *dir);
+
+int sign(int x);
+
+int test_key_order(const char *dir);
+
+int test_runtime_order(const char *dir);
+
+bool write_legacy_list(const char *path, const u32 *list, u16 n);
+
+bool write_legacy_index(b_tree_buf *b, const char *path, bool ordered);
+
+bool write_unlinked_index(b_tree_buf *b, const char *path);
+
+bool write_plain_index(b_tree_buf *b, const char *path);
+
+bool write_packed_index(b_tree_buf *b, const char *path);
+
+bool write_slim_index(b_tree_buf *b, const char *path);
+
+int test_migrate(const char *dir);
+
+int check_subtree(b_tree_buf *b, u32 rrn, const key *lo, const key *hi,
+                  int *errors);
+
+bool has_key(b_tree_buf *b, const char *placa);
+
+int remove_with_order(const char *dir, u16 order);
+
+int for_each_order(const char *dir, int (*fn)(const char *dir, u16 order));
+
+int test_remove(const char *dir);
+
+long file_size(const char *path);
+
+int test_free_list(const char *dir);
+
+int batch_with_order(const char *dir, u16 order);
+
+int test_batch_insert(const char *dir);
+
+int count_between(io_buf *data, int n, const char *start, const char *end);
+
+int test_cursor(const char *dir);
+
+int test_readahead(const char *dir);
+
+int test_search_many(const char *dir);
+
+void *concurrent_reader(void *arg);
+
+void *concurrent_writer(void *arg);
+
+int run_threads(thread_args *args, int threads, bool writing);
+
+int test_concurrent_reads(const char *dir);
+
+void *insert_worker(void *arg);
+
+void *remove_worker(void *arg);
+
+void *lookup_worker(void *arg);
+
+int run_workers(thread_args *args, void *(**fns)(void *), int threads);
+
+int test_concurrent_writes(const char *dir);
+
+int test_wal(const char *dir);
+
+int test_mapped_log(const char *dir);
+
+int scan_snapshot(bt_snapshot *s, int n);
+
+int test_snapshot(const char *dir);
+
+int test_record_cache(const char *dir);
+
+int test_mapped_data(const char *dir);
+
+int test_prepend_header(const char *dir);
+
+int test_prefix_pages(const char *dir);
+
+int test_separators(const char *dir);
+
+int test_plate_codes(const char *dir);
+
+int test_scratch(const char *dir);
+
+int test_secondary(const char *dir);
+
+int test_secondary_crash(const char *dir);
 #endif
@@ -0,0 +1,15 @@
+#include "../src/migrate.h"
+
+// converts files written with 16-bit rrns; run it from the directory the
+// application runs in, since index headers store relative list paths
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("Usage: %s <file.idx|file.dat|file.hlp>...\n", argv[0]);
+    return 1;
+  }
+
+  int failed = 0;
+  for (int i = 1; i < argc; i++)
+    failed += migrate_file(argv[i]) != IO_SUCCESS;
+  return failed != 0;
+}